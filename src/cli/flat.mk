@@ -1,5 +1,6 @@
-CLI_O=cli/main.o
-CLI_H=
+CLI_O=cli/main.o\
+      cli/serve.o
+CLI_H=cli/serve.h
 CLI_CFLAGS=
 CLI_LDFLAGS=-rdynamic
 cli/main.o:core/version.h
@@ -3,13 +3,116 @@
 #include "pipe/graph-io.h"
 #include "pipe/graph-print.h"
 #include "pipe/graph-export.h"
+#include "pipe/graph-batch.h"
 #include "pipe/global.h"
 #include "pipe/modules/api.h"
 #include "core/log.h"
+#include "core/fs.h"
+#include "core/profile.h"
+#include "core/strexpand.h"
 #include "core/version.h"
+#include "cli/serve.h"
 
 #include <stdlib.h>
 
+typedef struct batch_t
+{
+  const dt_graph_export_t *param; // template for all items
+  char **cfg;                     // list of input files
+}
+batch_t;
+
+static int
+batch_param(
+    void                    *data,
+    uint32_t                 item,
+    dt_graph_batch_worker_t *w,
+    dt_graph_export_t       *param)
+{
+  const batch_t *b = data;
+  *param = *b->param;
+  snprintf(w->cfgfile, sizeof(w->cfgfile), "%s", b->cfg[item]);
+  param->p_cfgfile = w->cfgfile;
+  // expand ${ffile} etc in the output filenames, same as the gui export does:
+  char filedir[PATH_MAX], seq[16];
+  snprintf(filedir, sizeof(filedir), "%s", b->cfg[item]);
+  char *filebase = fs_basename(filedir);
+  size_t len = strlen(filebase);
+  if(len > 4 && !strcasecmp(filebase+len-4, ".cfg")) filebase[len-=4] = 0;
+  char *dot = strrchr(filebase, '.');
+  if(dot) *dot = 0;
+  fs_dirname(filedir);
+  snprintf(seq, sizeof(seq), "%04d", item);
+  const char *key[] = { "home", "seq", "fdir", "ffile", 0};
+  const char *val[] = { getenv("HOME"), seq, filedir, filebase, 0};
+  for(int i=0;i<MIN(param->output_cnt, DT_GRAPH_BATCH_OUTPUTS);i++)
+  {
+    const char *pattern = param->output[i].p_filename ? param->output[i].p_filename : "${ffile}";
+    dt_strexpand(pattern, strlen(pattern)+1, w->filename[i], sizeof(w->filename[i]), key, val);
+    param->output[i].p_filename = w->filename[i];
+  }
+  return 0;
+}
+
+// read the list of input files, one per line. returns the number of items.
+static uint32_t
+batch_read_list(const char *filename, char ***list)
+{
+  FILE *f = fopen(filename, "rb");
+  if(!f) return 0;
+  uint32_t cnt = 0, max = 0;
+  char line[PATH_MAX];
+  *list = 0;
+  while(fgets(line, sizeof(line), f))
+  {
+    line[strcspn(line, "\r\n")] = 0;
+    if(!line[0] || line[0] == '#') continue;
+    if(cnt == max)
+    {
+      max = max ? 2*max : 256;
+      *list = realloc(*list, sizeof(char*)*max);
+    }
+    (*list)[cnt++] = strdup(line);
+  }
+  fclose(f);
+  return cnt;
+}
+
+// list the frames written by this process, one "frame filename" per line.
+// the file names carry the absolute frame number, so the outputs of several
+// processes rendering different --frames ranges can be merged into one
+// sequence, and the manifests tell which frames are there.
+static void
+write_frames_manifest(
+    const dt_graph_export_t *param,
+    const dt_graph_t        *graph)
+{
+  const int end  = param->frame_end > 0 ? MIN(param->frame_end, graph->frame_cnt) : graph->frame_cnt;
+  const int beg  = CLAMP(param->frame_beg, 0, end-1);
+  const int step = MAX(1, param->frame_step);
+  const int last = beg + (end-1-beg)/step*step;
+  for(int i=0;i<param->output_cnt;i++)
+  {
+    char base[PATH_MAX], filename[PATH_MAX+50];
+    if(param->output[i].p_filename)
+      snprintf(base, sizeof(base), "%s", param->output[i].p_filename);
+    else
+      snprintf(base, sizeof(base), "%"PRItkn, dt_token_str(param->output[i].inst));
+    snprintf(filename, sizeof(filename), "%s_%04d-%04d.frames", base, beg, end);
+    FILE *f = fopen(filename, "wb");
+    if(!f)
+    {
+      dt_log(s_log_err, "could not write frame manifest %s", filename);
+      continue;
+    }
+    fprintf(f, "# vkdt frames %d:%d:%d of %d at %g fps\n", beg, end, step, graph->frame_cnt, graph->frame_rate);
+    for(int k=beg;k<end;k+=step)
+      if(!param->last_frame_only || k == last)
+        fprintf(f, "%d %s_%04d\n", k, base, k);
+    fclose(f);
+  }
+}
+
 int main(int argc, char *argv[])
 {
   for(int i=0;i<argc;i++) if(!strcmp(argv[i], "--version"))
@@ -27,7 +130,12 @@ int main(int argc, char *argv[])
   int output_cnt = 0;
   int config_start = 0; // start of arguments which are interpreted as additional config lines
   dt_graph_export_t param = {0};
+  param.pipeline = 1; // we're not running on a worker thread
   const char *gpu_name = 0;
+  const char *profile = 0;
+  const char *batch = 0;
+  const char *serve = 0;
+  int frames = 0;
   int gpu_id = -1;
   for(int i=0;i<argc;i++)
   {
@@ -57,6 +165,27 @@ int main(int argc, char *argv[])
       gpu_name = argv[++i];
     else if(!strcmp(argv[i], "--device-id") && i < argc-1)
       gpu_id = atol(argv[++i]);
+    else if(!strcmp(argv[i], "--profile") && i < argc-1)
+      profile = argv[++i];
+    else if(!strcmp(argv[i], "--batch") && i < argc-1)
+      batch = argv[++i];
+    else if(!strcmp(argv[i], "--frames") && i < argc-1)
+    { // an empty <beg> means 0, an empty <end> all frames
+      frames = 1;
+      char *c = argv[++i];
+      param.frame_beg  = strtol(c, &c, 10);
+      param.frame_end  = *c == ':' ? strtol(c+1, &c, 10) : 0;
+      param.frame_step = *c == ':' ? strtol(c+1, &c, 10) : 1;
+      if(*c)
+      {
+        fprintf(stderr, "[vkdt-cli] can't parse --frames %s, expected <beg>:<end>[:step]\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if(!strcmp(argv[i], "--warmup") && i < argc-1)
+      param.frame_warmup = atol(argv[++i]);
+    else if(!strcmp(argv[i], "--serve") && i < argc-1)
+      serve = argv[++i];
     else if(!strcmp(argv[i], "--config"))
     { config_start = i+1; break; }
   }
@@ -64,11 +193,16 @@ int main(int argc, char *argv[])
 
   if(qvk_init(gpu_name, gpu_id)) exit(1);
 
-  if(!param.p_cfgfile)
+  if(!param.p_cfgfile && !batch && !serve)
   {
     fprintf(stderr, "usage: vkdt-cli -g <graph.cfg>\n"
+    "    [--batch <list>]              export all files in the list (one per line) instead of -g\n"
+    "                                  ${ffile}, ${fdir}, ${seq} in --filename will be replaced\n"
+    "    [--serve <socket>]            stay resident and run export jobs sent to this unix socket\n"
     "    [-d verbosity]                set log verbosity (none,qvk,pipe,gui,db,cli,snd,perf,mem,err,all)\n"
     "    [--last-frame-only]           only write the last frame, not the intermediates\n"
+    "    [--frames <beg>:<end>[:step]] only write these frames of an animation, and a manifest\n"
+    "    [--warmup <n>]                render n frames before <beg> for feedback connectors (default all)\n"
     "    [--dump-modules|--dump-nodes] write graphvis dot files to stdout\n"
     "    [--quality <0-100>]           jpg output quality\n"
     "    [--width <x>]                 max output width\n"
@@ -80,6 +214,7 @@ int main(int argc, char *argv[])
     "                                  this resets output specific options: quality, width, height, audio\n"
     "    [--device <gpu name>]         explicitly use this gpu if you have multiple\n"
     "    [--device-id <gpu id>]        explicitly use this gpu id if you have multiple\n"
+    "    [--profile <file.json>]       write cpu and gpu timings in chrome trace format\n"
     "    [--config]                    everything after this will be interpreted as additional cfg lines\n"
         );
     threads_global_cleanup();
@@ -87,13 +222,48 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
-  dt_graph_t graph;
-  dt_graph_init(&graph);
-
   param.extra_param_cnt = config_start ? argc - config_start : 0;
   param.p_extra_param   = argv + config_start;
 
+  if(profile && dt_profile_start(profile))
+    dt_log(s_log_err, "could not open profile output file %s", profile);
+
+  if(serve)
+  { // the other options serve as defaults for all jobs
+    int err = cli_serve(serve, &param);
+    dt_profile_stop();
+    threads_global_cleanup();
+    qvk_cleanup();
+    exit(err);
+  }
+
+  if(batch)
+  { // run two graphs at a time, one on each work queue
+    char **list = 0;
+    const uint32_t cnt = batch_read_list(batch, &list);
+    batch_t b = { .param = &param, .cfg = list };
+    static dt_graph_batch_t job; // holds a few graphs, keep it off the stack
+    int failed = cnt;
+    if(!cnt)
+      dt_log(s_log_err, "could not read any files from batch list %s", batch);
+    else if(dt_graph_batch_start(&job, cnt, 2, batch_param, 0, &b) >= 0)
+      failed = dt_graph_batch_wait(&job);
+    dt_log(s_log_cli, "exported %u of %u files", cnt - failed, cnt);
+    for(uint32_t i=0;i<cnt;i++) free(list[i]);
+    free(list);
+    dt_profile_stop();
+    threads_global_cleanup();
+    qvk_cleanup();
+    exit(failed || !cnt);
+  }
+
+  dt_graph_t graph;
+  dt_graph_init(&graph);
+
   VkResult res = dt_graph_export(&graph, &param);
+  dt_profile_stop();
+  if(res == VK_SUCCESS && frames && graph.frame_cnt > 1)
+    write_frames_manifest(&param, &graph);
 
   if(param.output[0].p_audio)
   {
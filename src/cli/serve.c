@@ -0,0 +1,177 @@
+#include "cli/serve.h"
+#include "pipe/graph.h"
+#include "pipe/modules/api.h"
+#include "core/core.h"
+#include "core/log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVE_EXTRA_MAX 64 // max number of extra config lines per job
+
+typedef struct serve_job_t
+{
+  dt_graph_export_t param;
+  int   output_cur;                       // output that options apply to, same as --output
+  char  cfgfile[PATH_MAX];
+  char  filename[20][PATH_MAX];
+  char *extra[SERVE_EXTRA_MAX];           // strdup'ed config lines of this job
+  int   extra_cnt;
+  char *p_extra[2*SERVE_EXTRA_MAX];       // defaults followed by ours
+}
+serve_job_t;
+
+static volatile sig_atomic_t serve_quit = 0;
+
+static void
+serve_signal(int sig)
+{
+  serve_quit = 1;
+}
+
+static void
+job_init(serve_job_t *j, const dt_graph_export_t *defaults)
+{
+  for(int i=0;i<j->extra_cnt;i++) free(j->extra[i]);
+  j->extra_cnt  = 0;
+  j->cfgfile[0] = 0;
+  j->output_cur = 0;
+  j->param      = *defaults;
+}
+
+static VkResult
+job_run(serve_job_t *j, dt_graph_t *graph)
+{
+  dt_graph_export_t *p = &j->param;
+  p->output_cnt = MAX(p->output_cnt, j->output_cur);
+  int cnt = 0;
+  for(int i=0;i<p->extra_param_cnt && cnt<SERVE_EXTRA_MAX;i++)
+    j->p_extra[cnt++] = p->p_extra_param[i];
+  for(int i=0;i<j->extra_cnt;i++)
+    j->p_extra[cnt++] = j->extra[i];
+  p->extra_param_cnt = cnt;
+  p->p_extra_param   = j->p_extra;
+  p->p_cfgfile       = j->cfgfile;
+  // the graph is kept from the last job, so if the structure is the same
+  // the export will only read params, upload and record the command buffer:
+  return dt_graph_export(graph, p);
+}
+
+// read jobs from one client until it hangs up or asks us to quit
+static void
+serve_connection(
+    int                      conn,
+    dt_graph_t              *graph,
+    const dt_graph_export_t *defaults)
+{
+  FILE *f = fdopen(dup(conn), "rb");
+  if(!f) return;
+  static serve_job_t job; // large, keep it off the stack
+  job_init(&job, defaults);
+  static char line[300000]; // config lines may come with drawn masks
+  while(!serve_quit && fgets(line, sizeof(line), f))
+  {
+    line[strcspn(line, "\r\n")] = 0;
+    char *val = strchr(line, ' ');
+    if(val) *(val++) = 0;
+    else val = line + strlen(line);
+    dt_graph_export_output_t *out = job.param.output + MIN(job.output_cur, 19);
+
+    if(!line[0] || !strcmp(line, "run"))
+    {
+      if(!job.cfgfile[0]) continue; // nothing to do
+      const double beg = dt_time();
+      VkResult res = job_run(&job, graph);
+      const double ms = 1000.0*(dt_time() - beg);
+      if(res == VK_SUCCESS) dprintf(conn, "ok %.3f\n", ms);
+      else dprintf(conn, "error %d %.3f\n", res, ms);
+      dt_log(s_log_cli, "[serve] %s %s in %.3f ms", job.cfgfile, res == VK_SUCCESS ? "done" : "failed", ms);
+      job_init(&job, defaults);
+    }
+    else if(!strcmp(line, "quit"))
+    {
+      dprintf(conn, "ok bye\n");
+      serve_quit = 1;
+    }
+    else if(!strcmp(line, "cfg"))
+      snprintf(job.cfgfile, sizeof(job.cfgfile), "%s", val);
+    else if(!strcmp(line, "quality"))
+      out->quality = atof(val);
+    else if(!strcmp(line, "width"))
+      out->max_width = atol(val);
+    else if(!strcmp(line, "height"))
+      out->max_height = atol(val);
+    else if(!strcmp(line, "format"))
+      out->mod = dt_token(val);
+    else if(!strcmp(line, "filename"))
+    {
+      snprintf(job.filename[MIN(job.output_cur, 19)], PATH_MAX, "%s", val);
+      out->p_filename = job.filename[MIN(job.output_cur, 19)];
+    }
+    else if(!strcmp(line, "output") && job.output_cur < 20)
+      job.param.output[job.output_cur++].inst = dt_token(val);
+    else if(!strcmp(line, "last-frame-only"))
+      job.param.last_frame_only = 1;
+    else if(!strcmp(line, "config") && job.extra_cnt < SERVE_EXTRA_MAX)
+      job.extra[job.extra_cnt++] = strdup(val);
+    else
+      dprintf(conn, "error unknown command '%s'\n", line);
+  }
+  job_init(&job, defaults); // free extra lines
+  fclose(f);
+}
+
+int cli_serve(
+    const char              *socketname,
+    const dt_graph_export_t *defaults)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if(strlen(socketname) >= sizeof(addr.sun_path))
+  {
+    dt_log(s_log_err, "[serve] socket name too long: %s", socketname);
+    return 1;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketname);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0) return 1;
+  unlink(socketname); // stale socket from a previous run
+  if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 16))
+  {
+    dt_log(s_log_err, "[serve] could not listen on %s: %s", socketname, strerror(errno));
+    close(sock);
+    return 1;
+  }
+
+  // no SA_RESTART, so ctrl-c gets us out of accept():
+  struct sigaction sa = { .sa_handler = serve_signal };
+  sigaction(SIGINT,  &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  signal(SIGPIPE, SIG_IGN); // clients may hang up before reading the answer
+
+  dt_graph_t graph;
+  dt_graph_init(&graph);
+  dt_log(s_log_cli, "[serve] listening on %s", socketname);
+  while(!serve_quit)
+  {
+    int conn = accept(sock, 0, 0);
+    if(conn < 0)
+    {
+      if(errno == EINTR) continue;
+      dt_log(s_log_err, "[serve] accept failed: %s", strerror(errno));
+      break;
+    }
+    serve_connection(conn, &graph, defaults);
+    close(conn);
+  }
+  dt_graph_cleanup(&graph);
+  close(sock);
+  unlink(socketname);
+  return 0;
+}
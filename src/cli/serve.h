@@ -0,0 +1,24 @@
+#pragma once
+#include "pipe/graph.h"
+#include "pipe/graph-export.h"
+
+// vkdt-cli --serve <socket>: keep the vulkan device, the modules and a warm
+// graph around and run export jobs sent over a unix domain socket. this way
+// many small exports don't pay for the startup over and over.
+//
+// a job is a couple of lines, same names as the command line options:
+//
+//   cfg /path/to/image.cfg
+//   width 512
+//   format o-jpg
+//   filename /tmp/preview
+//   config param:exposure:01:exposure:1.0
+//   run
+//
+// the "run" line (or an empty line) starts the export, the server answers with
+// "ok <ms>" or "error <vkresult> <ms>". options not given in the job are taken
+// from the command line of the server. "quit" shuts the server down.
+// returns non-zero if the socket could not be set up.
+int cli_serve(
+    const char              *socketname,
+    const dt_graph_export_t *defaults);
@@ -0,0 +1,55 @@
+#pragma once
+#include "pipe/token.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+// reading the gzipped bc1 files written by o-bc1: a header of
+// { magic "bc1z", version 1, width, height } followed by 8 bytes per 4x4 block.
+// users need to link -lz.
+
+// open the file and read the header. returns the file positioned at the
+// blocks, or 0 on error.
+static inline gzFile
+dt_bc1_open(
+    const char *filename,
+    uint32_t   *wd,
+    uint32_t   *ht)
+{
+  uint32_t header[4] = {0};
+  gzFile f = gzopen(filename, "rb");
+  if(!f) return 0;
+  if(gzread(f, header, sizeof(uint32_t)*4) != sizeof(uint32_t)*4 ||
+     header[0] != dt_token("bc1z") || header[1] != 1)
+  {
+    gzclose(f);
+    return 0;
+  }
+  *wd = 4*(header[2]/4);
+  *ht = 4*(header[3]/4);
+  return f;
+}
+
+// read the whole file. if *data is 0 a buffer is allocated for the blocks,
+// else they are written there. returns 0 on success.
+static inline int
+dt_bc1_read(
+    const char *filename,
+    uint32_t   *wd,
+    uint32_t   *ht,
+    uint8_t   **data)
+{
+  gzFile f = dt_bc1_open(filename, wd, ht);
+  if(!f) return 1;
+  const size_t size = 8ul*(*wd/4)*(*ht/4);
+  uint8_t *buf = *data ? *data : malloc(size);
+  if(gzread(f, buf, size) != (int)size)
+  {
+    if(!*data) free(buf);
+    gzclose(f);
+    return 2;
+  }
+  *data = buf;
+  gzclose(f);
+  return 0;
+}
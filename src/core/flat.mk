@@ -1,7 +1,9 @@
 CORE_O=core/log.o \
+       core/profile.o \
        core/threads.o
-CORE_H=core/core.h \
+CORE_H=core/bc1.h core/core.h \
        core/log.h \
+       core/profile.h \
        core/threads.h
 CORE_CFLAGS=
 CORE_LDFLAGS=-pthread -ldl
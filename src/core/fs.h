@@ -80,6 +80,14 @@ fs_homedir(
   snprintf(basedir, maxlen, "%s/.config/vkdt", getenv("HOME"));
 }
 
+static inline void  // ${HOME}/.cache/vkdt
+fs_cachedir(
+    char *cachedir, // output will be copied here
+    size_t maxlen)  // allocation size
+{ // TODO: getenv(XDG_CACHE_HOME)
+  snprintf(cachedir, maxlen, "%s/.cache/vkdt", getenv("HOME"));
+}
+
 static inline void  // returns the directory where the actual binary (not the symlink) resides
 fs_basedir(
     char *basedir,  // output will be copied here
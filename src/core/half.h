@@ -1,5 +1,11 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
+#if defined(__F16C__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 // #include <xmmintrin.h>
 
 // float->half variants.
@@ -56,53 +62,43 @@ static inline float half_to_float(uint16_t hi)
   return o.f;
 }
 
-// Approximate solution. This is faster but converts some sNaNs to
-// infinity and doesn't round correctly. Handle with care.
+// round to nearest even, same as the hardware conversions below. nans stay
+// nans (quietened, keeping the upper mantissa bits like f16c does), too large
+// values become infinity.
 static inline uint16_t float_to_half(float fi)
 {
   typedef union FP32
   {
     uint32_t u;
     float f;
-    struct
-    {
-      uint32_t Mantissa : 23;
-      uint32_t Exponent : 8;
-      uint32_t Sign : 1;
-    };
   } FP32;
-  typedef union FP16
-  {
-    uint16_t u;
-    struct
-    {
-      uint16_t Mantissa : 10;
-      uint16_t Exponent : 5;
-      uint16_t Sign : 1;
-    };
-  } FP16;
   FP32 f = { .f = fi };
-  FP32 f32infty = { 255 << 23 };
-  FP32 f16max = { (127 + 16) << 23 };
-  FP32 magic = { 15 << 23 };
-  FP32 expinf = { (255 ^ 31) << 23 };
-  uint32_t sign_mask = 0x80000000u;
-  FP16 o = { 0 };
+  const FP32 f32infty = { 255 << 23 };
+  const FP32 f16max = { (127 + 16) << 23 };
+  const FP32 denorm_magic = { ((127 - 15) + (23 - 10) + 1) << 23 };
+  const uint32_t sign_mask = 0x80000000u;
+  uint16_t o = 0;
 
   uint32_t sign = f.u & sign_mask;
   f.u ^= sign;
 
-  if (!(f.f < f32infty.u)) // Inf or NaN
-    o.u = f.u ^ expinf.u;
+  if (f.u >= f16max.u) // result is Inf or NaN (all exponent bits set)
+    o = (f.u > f32infty.u) ? 0x7e00 | ((f.u >> 13) & 0x3ff) : 0x7c00;
+  else if (f.u < (113 << 23)) // resulting half is subnormal or zero
+  { // align our 10 mantissa bits at the bottom of the float,
+    // the float addition rounds to nearest even for us.
+    f.f += denorm_magic.f;
+    o = f.u - denorm_magic.u;
+  }
   else
   {
-    if (f.f > f16max.f) f.f = f16max.f;
-    f.f *= magic.f;
+    uint32_t mant_odd = (f.u >> 13) & 1; // resulting mantissa is odd
+    f.u += ((15 - 127) << 23) + 0xfff;   // update exponent, rounding bias part 1
+    f.u += mant_odd;                     // rounding bias part 2
+    o = f.u >> 13;
   }
-
-  o.u = f.u >> 13; // Take the mantissa bits
-  o.u |= sign >> 16;
-  return o.u;
+  o |= sign >> 16;
+  return o;
 }
 
 #if 0
@@ -146,3 +142,37 @@ static inline __m128i float_to_half_sse(__m128 f)
 #undef CONSTF
 }
 #endif
+
+// convert a whole buffer of floats to half floats. values are clamped to the
+// largest finite half (65504) first, nans are kept. uses the hardware
+// conversion (f16c or neon) where the compiler has been told it's there
+// (-march=native does), the results are the same as float_to_half().
+static inline void
+float_to_half_buf(
+    uint16_t    *out,
+    const float *in,
+    size_t       cnt)
+{
+  size_t i = 0;
+#if defined(__F16C__)
+  const __m256 lo = _mm256_set1_ps(-65504.0f), hi = _mm256_set1_ps(65504.0f);
+  for(;i<(cnt&~(size_t)7);i+=8)
+  {
+    // min/max return their second argument if one is nan, so that's the input:
+    __m256 v = _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_loadu_ps(in+i)));
+    _mm_storeu_si128((__m128i *)(out+i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+  }
+#elif defined(__aarch64__)
+  const float32x4_t lo = vdupq_n_f32(-65504.0f), hi = vdupq_n_f32(65504.0f);
+  for(;i<(cnt&~(size_t)3);i+=4)
+  {
+    float32x4_t v = vminq_f32(vmaxq_f32(vld1q_f32(in+i), lo), hi);
+    vst1_u16(out+i, vreinterpret_u16_f16(vcvt_f16_f32(v)));
+  }
+#endif
+  for(;i<cnt;i++)
+  {
+    const float v = in[i] < -65504.0f ? -65504.0f : in[i] > 65504.0f ? 65504.0f : in[i];
+    out[i] = float_to_half(v);
+  }
+}
@@ -0,0 +1,77 @@
+#include "core/profile.h"
+#include "core/threads.h"
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+dt_profile_t dt_profile_global;
+static threads_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+write_event(
+    const char *cat,
+    const char *name,
+    double      beg,
+    double      end,
+    long        tid)
+{
+  threads_mutex_lock(&profile_mutex);
+  if(dt_profile_global.f)
+    fprintf(dt_profile_global.f,
+        "%s\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld}",
+        dt_profile_global.cnt++ ? "," : "",
+        cat, name, 1e6*beg, 1e6*(end-beg), getpid(), tid);
+  threads_mutex_unlock(&profile_mutex);
+}
+
+int
+dt_profile_start(const char *filename)
+{
+  dt_profile_stop();
+  FILE *f = fopen(filename, "wb");
+  if(!f) return 1;
+  threads_mutex_lock(&profile_mutex);
+  dt_profile_global.f = f;
+  dt_profile_global.cnt = 1;
+  // name the gpu track so it doesn't show up as some random thread id:
+  fprintf(f, "{\"traceEvents\":[\n"
+      "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"gpu\"}}",
+      getpid(), DT_PROFILE_GPU);
+  threads_mutex_unlock(&profile_mutex);
+  return 0;
+}
+
+void
+dt_profile_stop()
+{
+  threads_mutex_lock(&profile_mutex);
+  if(dt_profile_global.f)
+  {
+    fprintf(dt_profile_global.f, "\n]}\n");
+    fclose(dt_profile_global.f);
+  }
+  dt_profile_global.f = 0;
+  dt_profile_global.cnt = 0;
+  threads_mutex_unlock(&profile_mutex);
+}
+
+void
+dt_profile_span(
+    const char *cat,
+    const char *name,
+    double      beg,
+    double      end)
+{
+  if(!dt_profile_active()) return;
+  write_event(cat, name, beg, end, syscall(SYS_gettid));
+}
+
+void
+dt_profile_gpu_span(
+    const char *name,
+    double      beg,
+    double      end)
+{
+  if(!dt_profile_active()) return;
+  write_event("gpu", name, beg, end, DT_PROFILE_GPU);
+}
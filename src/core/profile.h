@@ -0,0 +1,43 @@
+#pragma once
+#include <stdio.h>
+
+// record a trace in chrome's json trace event format, for viewing in
+// chrome://tracing or https://ui.perfetto.dev. cpu spans end up on the
+// thread that recorded them, gpu kernels on an extra "gpu" track.
+// all timestamps are in seconds as returned by dt_time().
+
+typedef struct dt_profile_t
+{
+  FILE *f;   // trace file, 0 if not recording
+  int   cnt; // number of events written so far
+}
+dt_profile_t;
+
+extern dt_profile_t dt_profile_global;
+
+#define DT_PROFILE_GPU 1 // thread id of the gpu track
+
+// start recording to the given file. returns 0 on success.
+int dt_profile_start(const char *filename);
+
+// finish the json and close the file
+void dt_profile_stop();
+
+static inline int
+dt_profile_active()
+{
+  return dt_profile_global.f != 0;
+}
+
+// record a complete span on the calling thread
+void dt_profile_span(
+    const char *cat,    // category, such as "pipe" or "db"
+    const char *name,   // what happened
+    double      beg,    // dt_time() at start
+    double      end);   // dt_time() at end
+
+// record a span on the gpu track
+void dt_profile_gpu_span(
+    const char *name,
+    double      beg,
+    double      end);
@@ -227,6 +227,20 @@ void threads_wait(int taskid)
   }
 }
 
+void threads_help(int taskid)
+{
+  if(taskid < 0 || taskid >= thr.task_max) return;
+  threads_task_t *task = thr.task + taskid;
+  while(!thr.shutdown)
+  { // take items from the same counter as the workers do
+    uint32_t item = task->work_item++;
+    if(item >= task->work_item_cnt) break;
+    task->run(item, task->data);
+    task->done++;
+  }
+  threads_wait(taskid);
+}
+
 void threads_global_init()
 {
   thr.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
@@ -58,6 +58,11 @@ int threads_num();
 // wait for a task to finish (pass the taskid that threads_task returned)
 void threads_wait(int taskid);
 
+// work on the items of the task nobody picked up yet on the calling thread,
+// then wait for the ones in flight. unlike threads_wait() this does not stall
+// if all workers are busy with other (long running) tasks.
+void threads_help(int taskid);
+
 static inline uint32_t threads_id()
 {
   return thr_tls.tid;
@@ -1,10 +1,14 @@
 #include "db.h"
 #include "thumbnails.h"
+#include "core/core.h"
 #include "core/log.h"
 #include "core/fs.h"
+#include "core/threads.h"
 #include "pipe/graph-defaults.h"
 #include "stringpool.h"
 #include "exif.h"
+#include "hash.h"
+#include "sort.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,6 +19,8 @@
 #include <time.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 void
 dt_db_init(dt_db_t *db)
@@ -76,35 +82,14 @@ compare_labels(const void *a, const void *b, void *arg)
 
 static int
 compare_createdate(const void *a, const void *b, void *arg)
-{ // you ask for complicated sort, you get slow and stupid.
-  // we don't store the date in the db, since there is in general no clear 1:1 mapping
-  // between images and cfg file/graph. also, loading a directory becomes painfully slow
-  // when initialising metadata during ingestion.
+{ // precomputed in the metadata index when loading the directory
   dt_db_t *db = arg;
   const uint32_t *ia = a, *ib = b;
-  char cda[20] = {0}, cdb[20] = {0};
-  char fna[1024], fnb[1024], *aa = fna, *bb = fnb;
-  char fna2[1024], fnb2[1024];
-  dt_db_image_path(db, ia[0], fna, sizeof(fna));
-  dt_db_image_path(db, ib[0], fnb, sizeof(fnb));
-  size_t off;
-  off = readlink(fna, fna2, sizeof(fna2));
-  if(off != -1) aa = fna2;
-  else off = strnlen(fna, sizeof(fna));
-  if(off > 4) aa[off - 4] = 0;
-  else aa[off] = 0;
-
-  off = readlink(fnb, fnb2, sizeof(fnb2));
-  if(off != -1) bb = fnb2;
-  else off = strnlen(fnb, sizeof(fnb));
-  if(off > 4) bb[off - 4] = 0;
-  else bb[off] = 0;
-
-  char model[32];
-  dt_db_exif_mini(aa, cda, model, sizeof(model));
-  dt_db_exif_mini(bb, cdb, model, sizeof(model));
-
-  return strcmp(cda, cdb);
+  const uint64_t ca = db->image[ia[0]].meta.createdate;
+  const uint64_t cb = db->image[ib[0]].meta.createdate;
+  if(ca > cb) return 1;
+  else if(cb > ca) return -1;
+  return 0;
 }
 
 static int
@@ -112,14 +97,288 @@ compare_filetype(const void *a, const void *b, void *arg)
 {
   dt_db_t *db = arg;
   const uint32_t *ia = a, *ib = b;
-  dt_token_t ta = dt_graph_default_input_module(db->image[ia[0]].filename);
-  dt_token_t tb = dt_graph_default_input_module(db->image[ib[0]].filename);
+  dt_token_t ta = db->image[ia[0]].meta.filetype;
+  dt_token_t tb = db->image[ib[0]].meta.filetype;
   // convert 64 to 32 bits:
   if(ta > tb) return 1;
   else if(tb > ta) return -1;
   return 0;
 }
 
+// metadata index, stored as <dirname>/vkdt.meta: a header followed by one
+// record per image. the records are keyed by the hash of the filename.
+typedef struct meta_header_t
+{
+  uint64_t magic;   // dt_token("vkdtmeta")
+  uint32_t version;
+  uint32_t cnt;     // number of records following
+}
+meta_header_t;
+
+typedef struct meta_record_t
+{
+  uint64_t        hash; // hash64() of the filename as in the string pool
+  dt_image_meta_t meta;
+}
+meta_record_t;
+
+#define META_VERSION 1
+
+// shared with the thread pool. helpers may only be started after we're done,
+// so this lives on the heap and the last one to let go frees it.
+typedef struct meta_job_t
+{
+  dt_db_t             *db;
+  const meta_record_t *cache;     // sorted by hash, read from disk
+  uint32_t             cache_cnt;
+  uint8_t             *fresh;     // set to 1 if the meta data was (re-)extracted from the file
+  uint32_t             cnt;       // number of images
+  atomic_uint          next;      // next image to be picked
+  atomic_uint          done;      // number of images finished
+  atomic_uint          ref;       // the caller plus helpers pushed to the pool
+}
+meta_job_t;
+
+static int
+compare_meta_record(const void *a, const void *b)
+{
+  const meta_record_t *ra = a, *rb = b;
+  if(ra->hash > rb->hash) return 1;
+  else if(rb->hash > ra->hash) return -1;
+  return 0;
+}
+
+// pack "yyyy:mm:dd hh:mm:ss" into a decimal number that sorts the same way
+static inline uint64_t
+pack_createdate(const char *cd)
+{
+  uint64_t res = 0;
+  for(int i=0;i<19&&cd[i];i++)
+    if(cd[i] >= '0' && cd[i] <= '9') res = 10*res + cd[i] - '0';
+  return res;
+}
+
+static void
+meta_work(uint32_t item, void *arg)
+{
+  meta_job_t *job = arg;
+  dt_db_t *db = job->db;
+  dt_image_t *img = db->image + item;
+  img->meta.filetype = dt_graph_default_input_module(img->filename);
+
+  // resolve the cfg to the image file it refers to (might be a symlink to a tagged image)
+  char fn[1024], fn2[1024], *f = fn;
+  dt_db_image_path(db, item, fn, sizeof(fn));
+  ssize_t off = readlink(fn, fn2, sizeof(fn2)-1);
+  if(off != -1) f = fn2;
+  else off = strnlen(fn, sizeof(fn));
+  if(off > 4) f[off - 4] = 0;
+  else f[off] = 0;
+
+  struct stat statbuf = {0};
+  stat(f, &statbuf);
+  const int64_t mtime = statbuf.st_mtime;
+  const meta_record_t key = { .hash = hash64(img->filename) };
+  const meta_record_t *r = job->cache_cnt ?
+    bsearch(&key, job->cache, job->cache_cnt, sizeof(key), compare_meta_record) : 0;
+  if(r && r->meta.mtime == mtime)
+  {
+    img->meta = r->meta;
+    return;
+  }
+
+  char createdate[20] = {0};
+  img->meta.model[0] = 0;
+  dt_db_exif_mini(f, createdate, img->meta.model, sizeof(img->meta.model));
+  img->meta.createdate = pack_createdate(createdate);
+  img->meta.mtime = mtime;
+  job->fresh[item] = 1;
+}
+
+static void
+meta_drain(meta_job_t *job)
+{
+  uint32_t k;
+  while((k = atomic_fetch_add(&job->next, 1)) < job->cnt)
+  {
+    meta_work(k, job);
+    atomic_fetch_add(&job->done, 1);
+  }
+}
+
+static void
+meta_unref(meta_job_t *job)
+{
+  if(atomic_fetch_sub(&job->ref, 1) == 1) free(job);
+}
+
+static void
+meta_help(uint32_t item, void *arg)
+{
+  meta_job_t *job = arg;
+  meta_drain(job);
+  meta_unref(job);
+}
+
+static meta_record_t *
+meta_read(const char *filename, uint32_t *cnt)
+{
+  *cnt = 0;
+  FILE *f = fopen(filename, "rb");
+  if(!f) return 0;
+  meta_header_t hdr = {0};
+  meta_record_t *rec = 0;
+  if(fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+     hdr.magic != dt_token("vkdtmeta") || hdr.version != META_VERSION)
+    goto error;
+  rec = malloc(sizeof(meta_record_t)*hdr.cnt);
+  if(hdr.cnt && fread(rec, sizeof(meta_record_t), hdr.cnt, f) != hdr.cnt)
+    goto error;
+  fclose(f);
+  qsort(rec, hdr.cnt, sizeof(rec[0]), compare_meta_record);
+  *cnt = hdr.cnt;
+  return rec;
+error:
+  dt_log(s_log_db|s_log_err, "ignoring corrupt metadata index %s", filename);
+  fclose(f);
+  free(rec);
+  return 0;
+}
+
+static int
+meta_write(const dt_db_t *db, const char *filename)
+{
+  char tmpname[1100];
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+  FILE *f = fopen(tmpname, "wb");
+  if(!f) return 1;
+  const meta_header_t hdr = {
+    .magic   = dt_token("vkdtmeta"),
+    .version = META_VERSION,
+    .cnt     = db->image_cnt,
+  };
+  int err = fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+  for(uint32_t i=0;i<db->image_cnt&&!err;i++)
+  {
+    meta_record_t r = { .hash = hash64(db->image[i].filename), .meta = db->image[i].meta };
+    err = fwrite(&r, sizeof(r), 1, f) != 1;
+  }
+  err |= fclose(f);
+  if(!err) err = rename(tmpname, filename);
+  if(err) unlink(tmpname);
+  return err;
+}
+
+// fill db->image[].meta for all images. this reuses the index next to vkdt.db
+// for unchanged files and extracts the rest in parallel, which is a lot faster
+// than opening files one by one on network storage.
+static void
+meta_update(dt_db_t *db)
+{
+  if(!db->image_cnt) return;
+  char filename[1040];
+  snprintf(filename, sizeof(filename), "%s/vkdt.meta", db->dirname);
+  const uint32_t cnt = db->image_cnt;
+  meta_job_t *job = malloc(sizeof(*job));
+  job->db    = db;
+  job->cache = meta_read(filename, &job->cache_cnt);
+  job->fresh = calloc(cnt, sizeof(uint8_t));
+  job->cnt   = cnt;
+  atomic_init(&job->next, 0);
+  atomic_init(&job->done, 0);
+  // the calling thread works on the list too, so we don't depend on idle workers:
+  const uint32_t helpers = MIN(cnt, threads_num()) - 1;
+  atomic_init(&job->ref, 1 + helpers);
+  uint32_t pushed = 0;
+  for(;pushed<helpers;pushed++)
+    if(threads_task("meta", 1, -1, job, meta_help, 0) < 0) break;
+  if(pushed < helpers) atomic_fetch_sub(&job->ref, helpers - pushed);
+  meta_drain(job);
+  // wait for the files still being read on other threads
+  while(atomic_load(&job->done) < cnt) sched_yield();
+
+  uint32_t fresh = 0;
+  for(uint32_t k=0;k<cnt;k++) fresh += job->fresh[k];
+  if(fresh || job->cache_cnt != cnt)
+  {
+    dt_log(s_log_db, "updating metadata index for %u/%u images", fresh, cnt);
+    if(meta_write(db, filename))
+      dt_log(s_log_db, "could not write metadata index %s", filename);
+  }
+  free((void *)job->cache);
+  free(job->fresh);
+  meta_unref(job);
+}
+
+static int (*const compare_prop[])(const void *, const void *, void *) = {
+  [s_prop_filename]   = compare_filename,
+  [s_prop_rating]     = compare_rating,
+  [s_prop_labels]     = compare_labels,
+  [s_prop_createdate] = compare_createdate,
+  [s_prop_filetype]   = compare_filetype,
+};
+
+// sort a list of image ids by the current sort criterion. all but the file
+// name are packed into 64-bit keys together with the image id and radix sorted.
+static void
+sort_images(dt_db_t *db, uint32_t *list, uint32_t cnt)
+{
+  const dt_db_property_t prop = db->collection_sort;
+  if(cnt < 2 || prop == s_prop_none) return;
+  if(prop == s_prop_filename) goto fallback; // strings don't fit into the keys
+
+  // file types are sorted by token, replace them by their rank among the few distinct ones:
+  uint64_t filetype[32];
+  uint32_t filetype_cnt = 0;
+  if(prop == s_prop_filetype)
+  {
+    for(uint32_t i=0;i<cnt;i++)
+    {
+      const uint64_t t = db->image[list[i]].meta.filetype;
+      uint32_t j = 0;
+      while(j < filetype_cnt && filetype[j] < t) j++;
+      if(j < filetype_cnt && filetype[j] == t) continue;
+      if(filetype_cnt == sizeof(filetype)/sizeof(filetype[0])) goto fallback;
+      memmove(filetype+j+1, filetype+j, sizeof(filetype[0])*(filetype_cnt-j));
+      filetype[j] = t;
+      filetype_cnt++;
+    }
+  }
+
+  const int idbits = 64 - __builtin_clzll(db->image_cnt);
+  uint64_t *key = malloc(sizeof(uint64_t)*cnt);
+  uint64_t all = 0;
+  for(uint32_t i=0;i<cnt;i++)
+  {
+    const dt_image_t *img = db->image + list[i];
+    uint64_t v = 0;
+    switch(prop)
+    {
+    case s_prop_rating:     v = 0xffff - img->rating; break; // higher rating comes first
+    case s_prop_labels:     v = img->labels; break;
+    case s_prop_createdate: v = img->meta.createdate; break;
+    case s_prop_filetype:
+      while(filetype[v] != img->meta.filetype) v++;
+      break;
+    default: break;
+    }
+    all |= v;
+    key[i] = (v << idbits) | list[i];
+  }
+  if(all >> (64 - idbits))
+  { // does not fit, dates in a huge database?
+    free(key);
+    goto fallback;
+  }
+  dt_sort_radix(key, cnt);
+  const uint64_t mask = (1ul << idbits) - 1;
+  for(uint32_t i=0;i<cnt;i++) list[i] = key[i] & mask;
+  free(key);
+  return;
+fallback:
+  qsort_r(list, cnt, sizeof(list[0]), compare_prop[prop], db);
+}
+
 static inline void
 image_init(dt_image_t *img)
 {
@@ -151,32 +410,12 @@ dt_db_update_collection(dt_db_t *db)
       // TODO: match beginning of filter val string
       break;
     case s_prop_filetype:
-      if(dt_graph_default_input_module(db->image[k].filename) != db->collection_filter_val) continue;
+      if(db->image[k].meta.filetype != db->collection_filter_val) continue;
       break;
     }
     db->collection[db->collection_cnt++] = k;
   }
-  // TODO: use db/tests/parallel radix sort
-  switch(db->collection_sort)
-  {
-  case s_prop_none:
-    break;
-  case s_prop_filename:
-    qsort_r(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_filename, db);
-    break;
-  case s_prop_rating:
-    qsort_r(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_rating, db);
-    break;
-  case s_prop_labels:
-    qsort_r(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_labels, db);
-    break;
-  case s_prop_createdate:
-    qsort_r(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_createdate, db);
-    break;
-  case s_prop_filetype:
-    qsort_r(db->collection, db->collection_cnt, sizeof(db->collection[0]), compare_filetype, db);
-    break;
-  }
+  sort_images(db, db->collection, db->collection_cnt);
 }
 
 void dt_db_load_directory(
@@ -270,6 +509,10 @@ void dt_db_load_directory(
   snprintf(dbname, sizeof(dbname), "%s/vkdt.db", dirname);
   dt_db_read(db, dbname);
 
+  double meta_beg = dt_time();
+  meta_update(db);
+  dt_log(s_log_perf|s_log_db, "time to load metadata %2.3fs", dt_time() - meta_beg);
+
   dt_db_update_collection(db);
 }
 
@@ -324,6 +567,9 @@ int dt_db_load_image(
 
   db->image[imgid].thumbnail = thumbid;
 
+  meta_job_t job = { .db = db, .fresh = (uint8_t[1]){0} };
+  meta_work(imgid, &job);
+
   // collect images:
   dt_db_update_collection(db);
   return 0;
@@ -414,26 +660,8 @@ void dt_db_selection_clear(dt_db_t *db)
 
 const uint32_t *dt_db_selection_get(dt_db_t *db)
 {
-  switch(db->collection_sort)
-  { // sync sorting criterion with collection
-  case s_prop_none:
-    break;
-  case s_prop_filename:
-    qsort_r(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_filename, db);
-    break;
-  case s_prop_rating:
-    qsort_r(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_rating, db);
-    break;
-  case s_prop_labels:
-    qsort_r(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_labels, db);
-    break;
-  case s_prop_createdate:
-    qsort_r(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_createdate, db);
-    break;
-  case s_prop_filetype:
-    qsort_r(db->selection, db->selection_cnt, sizeof(db->selection[0]), compare_filetype, db);
-    break;
-  }
+  // sync sorting criterion with collection
+  sort_images(db, db->selection, db->selection_cnt);
   return db->selection;
 }
 
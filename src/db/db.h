@@ -16,12 +16,25 @@ typedef enum dt_image_label_t
 }
 dt_image_label_t;
 
+// metadata extracted from the image file once when loading a directory.
+// this is kept in <dirname>/vkdt.meta so we don't have to open all files again
+// next time, and serves as precomputed sort keys.
+typedef struct dt_image_meta_t
+{
+  int64_t  mtime;      // modification time of the image file, to detect stale entries
+  uint64_t createdate; // create date packed as decimal yyyymmddhhmmss, 0 if unknown
+  uint64_t filetype;   // dt_token_t of the default input module
+  char     model[32];  // camera maker and model
+}
+dt_image_meta_t;
+
 typedef struct dt_image_t
 {
   const char *filename;  // point into db.sp_filename.buf stringpool
   uint32_t    thumbnail; // index into thumbnails->thumb[] or -1u
   uint16_t    rating;    // -1u reject 0 1 2 3 4 5 stars
   uint16_t    labels;    // each bit is one colour label flag, 1<<15 is selected bit
+  dt_image_meta_t meta;  // create date, model, file type
 }
 dt_image_t;
 
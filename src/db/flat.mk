@@ -1,12 +1,16 @@
 DB_O=\
 db/db.o\
 db/rc.o\
-db/thumbnails.o
+db/sort.o\
+db/thumbnails.o\
+db/thumbpack.o
 DB_H=\
 db/db.h\
 db/exif.h\
 db/hash.h\
+db/sort.h\
 db/thumbnails.h\
+db/thumbpack.h\
 db/stringpool.h
 DB_CFLAGS=
-DB_LDFLAGS=
+DB_LDFLAGS=-lz
@@ -0,0 +1,152 @@
+#include "db/sort.h"
+#include "core/threads.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+// below this many keys just sort on the calling thread
+#define SORT_PARALLEL_MIN (1<<16)
+
+static inline void
+insertion_sort(uint64_t *list, const uint32_t size)
+{
+  for(uint32_t i=1;i<size;i++)
+  {
+    const uint64_t tmp = list[i];
+    uint32_t j = i;
+    for(;j>0&&list[j-1]>tmp;j--)
+      list[j] = list[j-1];
+    list[j] = tmp;
+  }
+}
+
+// permute the list in place such that it is ordered by the 8 bits at shift,
+// returns the number of elements in each of the 256 buckets.
+static inline void
+partition(uint64_t *list, const uint32_t size, const int shift, uint32_t *histogram)
+{
+  for(int k=0;k<256;k++) histogram[k] = 0;
+  for(uint32_t i=0;i<size;i++)
+    histogram[(list[i] >> shift) & 0xff]++;
+
+  uint64_t *head[256], *tail[256];
+  uint64_t *p = list;
+  for(int k=0;k<256;k++)
+  {
+    head[k] = p;
+    p += histogram[k];
+    tail[k] = p;
+  }
+  for(int k=0;k<256;k++)
+  {
+    while(head[k] < tail[k])
+    { // swap elements into their bins until one belonging here turns up
+      uint64_t v = *head[k];
+      int b = (v >> shift) & 0xff;
+      while(b != k)
+      {
+        uint64_t tmp = *head[b];
+        *head[b]++ = v;
+        v = tmp;
+        b = (v >> shift) & 0xff;
+      }
+      *head[k]++ = v;
+    }
+  }
+}
+
+static void
+sort_block(uint64_t *list, const uint32_t size, const int shift)
+{
+  if(size <= 32)
+  {
+    insertion_sort(list, size);
+    return;
+  }
+  uint32_t histogram[256];
+  partition(list, size, shift, histogram);
+  if(!shift) return;
+  // the digits may overlap with the previous ones close to the lsb, which is
+  // fine since all higher bits are equal within a bucket:
+  const int next = shift > 8 ? shift - 8 : 0;
+  for(int k=0;k<256;list+=histogram[k++])
+    if(histogram[k] > 1) sort_block(list, histogram[k], next);
+}
+
+typedef struct sort_job_t
+{
+  uint64_t   *bucket[256]; // start of each top level bucket
+  uint32_t    cnt[256];    // number of keys in the bucket
+  int         shift;       // digit to sort the buckets by
+  atomic_uint next;        // next bucket to be picked
+  atomic_uint done;        // number of buckets finished
+  atomic_uint ref;         // the caller plus helpers pushed to the pool, last one frees
+}
+sort_job_t;
+
+static void
+sort_job_drain(sort_job_t *j)
+{
+  uint32_t b;
+  while((b = atomic_fetch_add(&j->next, 1)) < 256)
+  {
+    if(j->cnt[b] > 1) sort_block(j->bucket[b], j->cnt[b], j->shift);
+    atomic_fetch_add(&j->done, 1);
+  }
+}
+
+static void
+sort_job_unref(sort_job_t *j)
+{
+  if(atomic_fetch_sub(&j->ref, 1) == 1) free(j);
+}
+
+static void
+sort_work(uint32_t item, void *arg)
+{
+  sort_job_t *j = arg;
+  sort_job_drain(j);
+  sort_job_unref(j);
+}
+
+void
+dt_sort_radix(uint64_t *key, uint32_t cnt)
+{
+  if(cnt < 2) return;
+  // find the highest bit that differs between any two keys and start there,
+  // so we don't waste passes on common prefixes (small keys, same rating, ..)
+  uint64_t diff = 0;
+  for(uint32_t i=1;i<cnt;i++) diff |= key[i] ^ key[0];
+  if(!diff) return;
+  const int msb = 63 - __builtin_clzll(diff);
+  const int shift = msb > 7 ? msb - 7 : 0;
+
+  if(cnt < SORT_PARALLEL_MIN || threads_num() < 2 || !shift)
+  {
+    sort_block(key, cnt, shift);
+    return;
+  }
+
+  sort_job_t *j = malloc(sizeof(*j));
+  partition(key, cnt, shift, j->cnt);
+  uint64_t *p = key;
+  for(int k=0;k<256;p+=j->cnt[k++]) j->bucket[k] = p;
+  j->shift = shift > 8 ? shift - 8 : 0;
+  atomic_init(&j->next, 0);
+  atomic_init(&j->done, 0);
+
+  // every helper is a task of its own, so one that starts late only ever
+  // touches this job and drops its reference:
+  const uint32_t helpers = threads_num() - 1;
+  atomic_init(&j->ref, 1 + helpers);
+  uint32_t pushed = 0;
+  for(;pushed<helpers;pushed++)
+    if(threads_task("sort", 1, -1, j, sort_work, 0) < 0) break;
+  if(pushed < helpers) atomic_fetch_sub(&j->ref, helpers - pushed); // those will never run
+
+  sort_job_drain(j);
+  // wait for buckets still in flight on other threads
+  while(atomic_load(&j->done) < 256) sched_yield();
+  sort_job_unref(j);
+}
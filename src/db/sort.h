@@ -0,0 +1,10 @@
+#pragma once
+#include <stdint.h>
+
+// in-place msd radix sort on 64-bit keys, ascending. the top level buckets
+// are distributed over the thread pool for large arrays, the calling thread
+// helps out so this doesn't stall behind long running tasks (thumbnails).
+// after https://github.com/vvnguyen/parallel-in-place-radix-sort
+// pack whatever you want to sort by in the high bits and the index of the
+// element in the low bits, which also makes the order deterministic.
+void dt_sort_radix(uint64_t *key, uint32_t cnt);
@@ -1,6 +1,8 @@
 // g++ -fsanitize=address -Wall -ggdb3 -g test.cc -o test -lpthread -lm -fsanitize=address && ./test
 // clang++ -Wall -march=native -O3 test.cc -o rtest -lpthread -lm && ./rtest
-#include "sort.h"
+#include "../sort.h"
+#include "threads.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
@@ -12,13 +14,15 @@ int main()
   const int N = 1000000;
   uint64_t *arr = malloc(sizeof(uint64_t)*N);
   for(int k=0;k<N;k++) arr[k] = ((uint64_t)lrand48() << 32) | lrand48();
-  clock_t t = clock();
-  parallel_sort(arr, N);
-  t = clock() - t;
-  fprintf(stderr, "time to sort %d entries %g s\n", N, t/(double)CLOCKS_PER_SEC);
+  struct timespec beg, end;
+  clock_gettime(CLOCK_MONOTONIC, &beg);
+  dt_sort_radix(arr, N);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stderr, "time to sort %d entries %g s\n", N,
+      end.tv_sec - beg.tv_sec + 1e-9*(end.tv_nsec - beg.tv_nsec));
   for(int k=1;k<N;k++)
   {
-    assert(arr[k] > arr[k-1]);
+    assert(arr[k] >= arr[k-1]);
     // fprintf(stderr, "%lu ", arr[k]);
   }
   // fprintf(stderr, "\n");
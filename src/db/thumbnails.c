@@ -1,14 +1,19 @@
+#include "core/core.h"
 #include "core/log.h"
 #include "core/fs.h"
+#include "core/profile.h"
+#include "core/bc1.h"
 #include "db/db.h"
 #include "db/thumbnails.h"
 #include "db/hash.h"
+#include "db/thumbpack.h"
 #include "qvk/qvk.h"
 #include "pipe/graph-io.h"
 #include "pipe/graph-defaults.h"
 #include "pipe/graph-export.h"
 #include "pipe/modules/api.h"
 #include "pipe/dlist.h"
+#include <zlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -16,6 +21,8 @@
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #if 0
 void
@@ -48,9 +55,7 @@ dt_thumbnails_init(
 {
   memset(tn, 0, sizeof(*tn));
 
-  // TODO: getenv(XDG_CACHE_HOME)
-  const char *home = getenv("HOME");
-  snprintf(tn->cachedir, sizeof(tn->cachedir), "%s/.cache/vkdt", home);
+  fs_cachedir(tn->cachedir, sizeof(tn->cachedir));
   int err = fs_mkdir(tn->cachedir, 0755);
   if(err && errno != EEXIST)
   {
@@ -73,6 +78,7 @@ dt_thumbnails_init(
 
   threads_mutex_init(tn->graph_lock + 0, 0);
   threads_mutex_init(tn->graph_lock + 1, 0);
+  threads_mutex_init(&tn->pack_mutex, 0);
 
   // just creating bc1 files in the background, not actually used to serve
   // any thumbnails:
@@ -173,6 +179,26 @@ dt_thumbnails_init(
   for(int i=0;i<tn->thumb_max;i++)
     QVKR(vkAllocateDescriptorSets(qvk.device, &dset_info, &tn->thumb[i].dset));
 
+  // command buffer for batch uploads of thumbnails, submitted to the work0 queue
+  VkCommandPoolCreateInfo cmd_pool_create_info = {
+    .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .queueFamilyIndex = qvk.queue_idx_work0,
+    .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+  };
+  QVKR(vkCreateCommandPool(qvk.device, &cmd_pool_create_info, NULL, &tn->command_pool));
+  VkCommandBufferAllocateInfo cmd_buf_alloc_info = {
+    .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .commandPool        = tn->command_pool,
+    .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandBufferCount = 1,
+  };
+  QVKR(vkAllocateCommandBuffers(qvk.device, &cmd_buf_alloc_info, &tn->command_buffer));
+  VkFenceCreateInfo fence_info = {
+    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+  };
+  QVKR(vkCreateFence(qvk.device, &fence_info, NULL, &tn->command_fence));
+
   return VK_SUCCESS;
 }
 
@@ -195,7 +221,17 @@ dt_thumbnails_cleanup(
   if(tn->dset_layout) vkDestroyDescriptorSetLayout(qvk.device, tn->dset_layout, 0);
   if(tn->dset_pool)   vkDestroyDescriptorPool     (qvk.device, tn->dset_pool,   0);
   if(tn->vkmem)       vkFreeMemory                (qvk.device, tn->vkmem,       0);
+  if(tn->staging)       vkDestroyBuffer(qvk.device, tn->staging,       0);
+  if(tn->vkmem_staging) vkFreeMemory   (qvk.device, tn->vkmem_staging, 0);
+  if(tn->command_fence) vkDestroyFence (qvk.device, tn->command_fence, 0);
+  if(tn->command_pool)
+  {
+    vkFreeCommandBuffers(qvk.device, tn->command_pool, 1, &tn->command_buffer);
+    vkDestroyCommandPool(qvk.device, tn->command_pool, 0);
+  }
   dt_vkalloc_cleanup(&tn->alloc);
+  dt_thumbpack_close(&tn->pack);
+  threads_mutex_destroy(&tn->pack_mutex);
 }
 
 void
@@ -207,6 +243,34 @@ dt_thumbnails_invalidate(
   char bc1filename[1040];
   snprintf(bc1filename, sizeof(bc1filename), "%s/%lx.bc1", tn->cachedir, hash);
   unlink(bc1filename);
+  threads_mutex_lock(&tn->pack_mutex);
+  if(!dt_thumbpack_open(&tn->pack, tn->cachedir, filename))
+    dt_thumbpack_append(&tn->pack, hash, 0, 0, 0, 0);
+  threads_mutex_unlock(&tn->pack_mutex);
+}
+
+// move a bc1 file into the thumbnail pack of the image's directory
+static VkResult
+pack_bc1(
+    dt_thumbnails_t *tn,
+    const char      *filename,    // the image (.cfg)
+    const char      *bc1filename, // the gzipped .bc1 to read
+    uint64_t         hash,
+    int64_t          mtime)
+{
+  uint32_t wd, ht;
+  uint8_t *data = 0;
+  if(dt_bc1_read(bc1filename, &wd, &ht, &data))
+  {
+    dt_log(s_log_db, "[thm] %s: can't read bc1 file!", bc1filename);
+    return VK_INCOMPLETE;
+  }
+  threads_mutex_lock(&tn->pack_mutex);
+  int err = dt_thumbpack_open(&tn->pack, tn->cachedir, filename) ||
+            dt_thumbpack_append(&tn->pack, hash, mtime, wd, ht, data);
+  threads_mutex_unlock(&tn->pack_mutex);
+  free(data);
+  return err ? VK_INCOMPLETE : VK_SUCCESS;
 }
 
 // process one image and write a .bc1 thumbnail
@@ -222,8 +286,9 @@ dt_thumbnails_cache_one(
   const char *f2 = filename + len - 4;
   if(strcasecmp(f2, ".cfg")) return VK_INCOMPLETE;
 
-  // use ~/.cache/vkdt/<hash-of-filename>.bc1 as output file name
-  // if that already exists with a newer timestamp than the cfg, bail out
+  // the thumbnail ends up in the pack of the image's directory, see thumbpack.h.
+  // if that already has it with a newer timestamp than the cfg, bail out.
+  // ~/.cache/vkdt/<hash-of-filename>.bc1 is used as temporary output file
 
   dt_token_t input_module = dt_graph_default_input_module(filename);
   char cfgfilename[PATH_MAX+100];
@@ -248,14 +313,26 @@ dt_thumbnails_cache_one(
     else return VK_INCOMPLETE;
   }
 
+  threads_mutex_lock(&tn->pack_mutex);
+  if(!dt_thumbpack_open(&tn->pack, tn->cachedir, filename))
+  {
+    const dt_thumbpack_record_t *r = dt_thumbpack_find(&tn->pack, hash);
+    tbc1 = r ? r->mtime : 0;
+  }
+  threads_mutex_unlock(&tn->pack_mutex);
+  if(tcfg && (tbc1 >= tcfg)) return VK_SUCCESS; // already up to date
+
   if(!stat(bc1filename, &statbuf))
-  { // check timestamp
+  { // found a thumbnail from before we had packs. check timestamp and migrate:
     tbc1 = statbuf.st_mtim.tv_sec;
-    if(tcfg && (tbc1 >= tcfg)) return VK_SUCCESS; // already up to date
+    if(tcfg && (tbc1 >= tcfg) && pack_bc1(tn, filename, bc1filename, hash, tbc1) == VK_SUCCESS)
+    {
+      unlink(bc1filename);
+      return VK_SUCCESS;
+    }
   }
 
-  dt_graph_reset(graph);
-
+  // no need to reset the graph, the export will reuse it if it can
   char *extrap[] = {
     "param:f2srgb:main:usemat:0", // write thumbnails as rec2020 with gamma
     "frames:1",                   // only render first frame of animation
@@ -282,13 +359,15 @@ dt_thumbnails_cache_one(
     dt_log(s_log_db, "[thm] running the thumbnail graph failed on image '%s'!", filename);
     // mark as dead
     snprintf(cfgfilename, sizeof(cfgfilename), "%s/data/bomb.bc1", dt_pipe.basedir);
-    link(cfgfilename, bc1filename);
+    pack_bc1(tn, filename, cfgfilename, hash, tcfg);
     return 4;
   }
   clock_t end = clock();
   dt_log(s_log_perf, "[thm] ran graph in %3.0fms", 1000.0*(end-beg)/CLOCKS_PER_SEC);
 
-  return VK_SUCCESS;
+  VkResult res = pack_bc1(tn, filename, bc1filename, hash, tcfg);
+  if(res == VK_SUCCESS) unlink(bc1filename);
+  return res;
 }
 
 typedef struct cache_coll_job_t
@@ -340,7 +419,9 @@ thread_work_coll(
   j->tn->graph[j->gid].io_mutex = j->mutex;
   char filename[1024];
   dt_db_image_path(j->db, j->coll[item], filename, sizeof(filename));
+  const double beg = dt_time();
   (void) dt_thumbnails_cache_one(j->tn->graph + j->gid, j->tn, filename);
+  dt_profile_span("db", "cache thumbnail", beg, dt_time());
   // invalidate what we have in memory to trigger a reload:
   j->db->image[j->coll[item]].thumbnail = 0;
   j->tn->graph[j->gid].io_mutex = 0;
@@ -414,74 +495,112 @@ dt_thumbnails_cache_collection(
   return dt_thumbnails_cache_list(tn, db, db->collection, db->collection_cnt, updatefn);
 }
 
-// 1) if db loads a directory, kick off thumbnail creation of directory in bg
-//    this step is the only thing in the non-gui thread
-// 2) for currently visible collection: batch-update lru and trigger thumbnail loading
-//    if necessary (bc1 file exists but not loaded, maybe need "ready" flag)
-//    this should be fast enough to run every refresh.
-//    start single-thread and maybe interleave with two threads, too
-//    (needs lru mutex then)
-// this function is 2):
-void
-dt_thumbnails_load_list(
-    dt_thumbnails_t *tn,
-    dt_db_t         *db,
-    const uint32_t  *collection,
-    uint32_t         beg,
-    uint32_t         end)
+typedef struct load_job_t
 {
-  for(int k=beg;k<end;k++)
-  { // for all images in given collection
-    const uint32_t imgid = collection[k];
-    if(imgid >= db->image_cnt) break; // safety first. this probably means this job is stale! big danger!
-    dt_image_t *img = db->image + imgid;
-    if(img->thumbnail == 0)
-    { // not loaded
-      char filename[1024];
-      dt_db_image_path(db, imgid, filename, sizeof(filename));  
-      img->thumbnail = -1u;
-      if(dt_thumbnails_load_one(tn, filename, &img->thumbnail))
-        img->thumbnail = 0;
-    }
-    else if(img->thumbnail > 0 && img->thumbnail < tn->thumb_max)
-    { // loaded, update lru
-      // threads_mutex_lock(&tn->lru_lock);
-      dt_thumbnail_t *th = tn->thumb + img->thumbnail;
-      if(th == tn->lru) tn->lru = tn->lru->next; // move head
-      tn->lru->prev = 0;
-      if(tn->mru == th) tn->mru = th->prev;      // going to remove mru, need to move
-      DLIST_RM_ELEMENT(th);                      // disconnect old head
-      tn->mru = DLIST_APPEND(tn->mru, th);       // append to end and move tail
-      // threads_mutex_unlock(&tn->lru_lock);
-    }
+  char     filename[PATH_MAX+100]; // the bc1 file, if not packed
+  uint64_t hash;                   // hash of the image filename
+  int      packed;                 // found in the thumbnail pack, read from there
+  uint32_t wd, ht;                 // dimensions read from file
+  uint8_t *data;                   // bc1 blocks, or 0 if reading failed
+  uint32_t *thumb_index;           // thumbnail slot, or -1u to allocate a new one
+  int      ok;                     // set to 1 after successful upload
+}
+load_job_t;
+
+static void
+thread_work_load(uint32_t item, void *arg)
+{
+  load_job_t *j = ((load_job_t *)arg) + item;
+  if(j->packed) return; // will be copied straight out of the mmapped pack
+  const double beg = dt_time();
+  j->data = 0;
+  if(dt_bc1_read(j->filename, &j->wd, &j->ht, &j->data))
+    dt_log(s_log_db, "[thm] %s: can't read bc1 file!", j->filename);
+  dt_profile_span("db", "load thumbnail", beg, dt_time());
+}
+
+// a batch of load jobs shared with the thread pool. helpers may be started
+// long after the batch has been loaded, so this is allocated on the heap and
+// freed by whoever is last. the jobs themselves are only touched by the ones
+// who picked them, and the caller waits for those.
+typedef struct load_batch_t
+{
+  load_job_t *job;
+  uint32_t    cnt;
+  atomic_uint next; // next job to be picked
+  atomic_uint done; // number of jobs finished
+  atomic_uint ref;  // the caller plus helpers pushed to the pool, last one frees
+}
+load_batch_t;
+
+static void
+load_batch_drain(load_batch_t *b)
+{
+  uint32_t k;
+  while((k = atomic_fetch_add(&b->next, 1)) < b->cnt)
+  {
+    thread_work_load(k, b->job);
+    atomic_fetch_add(&b->done, 1);
   }
 }
 
-// load a previously cached thumbnail to a VkImage onto the GPU.
-// returns VK_SUCCESS on success
-VkResult
-dt_thumbnails_load_one(
+static void
+load_batch_unref(load_batch_t *b)
+{
+  if(atomic_fetch_sub(&b->ref, 1) == 1) free(b);
+}
+
+static void
+thread_work_load_batch(uint32_t item, void *arg)
+{
+  load_batch_t *b = arg;
+  load_batch_drain(b);
+  load_batch_unref(b);
+}
+
+// find out where to load the thumbnail from. returns non-zero if there is none.
+static int
+load_job_init(
     dt_thumbnails_t *tn,
     const char      *filename,
-    uint32_t        *thumb_index)
+    load_job_t      *j)
 {
-  dt_graph_t *graph = tn->graph;
-  char imgfilename[PATH_MAX+100] = {0};
+  j->data   = 0;
+  j->packed = 0;
+  j->hash   = 0;
   if(strncmp(filename, "data/", 5))
   { // only hash images that aren't straight from our resource directory:
     // TODO: make sure ./dir/file and dir//file etc turn out to be the same
-    uint64_t hash = hash64(filename);
-    snprintf(imgfilename, sizeof(imgfilename), "%s/%lx.bc1", tn->cachedir, hash);
+    j->hash = hash64(filename);
+    threads_mutex_lock(&tn->pack_mutex);
+    if(!dt_thumbpack_open(&tn->pack, tn->cachedir, filename))
+    {
+      const dt_thumbpack_record_t *r = dt_thumbpack_find(&tn->pack, j->hash);
+      if(r)
+      {
+        j->packed = 1;
+        j->wd = r->wd;
+        j->ht = r->ht;
+      }
+    }
+    threads_mutex_unlock(&tn->pack_mutex);
+    if(j->packed) return 0;
+    snprintf(j->filename, sizeof(j->filename), "%s/%lx.bc1", tn->cachedir, j->hash);
   }
-  else snprintf(imgfilename, sizeof(imgfilename), "%s/%s", dt_pipe.basedir, filename);
+  else snprintf(j->filename, sizeof(j->filename), "%s/%s", dt_pipe.basedir, filename);
   struct stat statbuf = {0};
-  if(stat(imgfilename, &statbuf)) return VK_INCOMPLETE;
-
-  dt_graph_reset(graph);
-  int m0 = dt_module_add(graph, dt_token("i-bc1"), dt_token("01"));
-  int m1 = dt_module_add(graph, dt_token("thumb"), dt_token("main"));
-  dt_module_connect(graph, m0, 0, m1, 0);
+  return stat(j->filename, &statbuf); // not cached (yet)
+}
 
+// grab a thumbnail slot (from the lru list if *thumb_index is -1u)
+// and create an image of the given size for it.
+static VkResult
+thumbnail_alloc(
+    dt_thumbnails_t *tn,
+    uint32_t        *thumb_index,
+    uint32_t         wd,
+    uint32_t         ht)
+{
   dt_thumbnail_t *th = 0;
   if(*thumb_index == -1u)
   { // allocate thumbnail from lru list
@@ -508,22 +627,8 @@ dt_thumbnails_load_one(
   th->mem        = 0;
   // keep dset and prev/next dlist pointers! (i.e. don't memset th)
 
-  // set param for rawinput
-  // get module
-  dt_module_set_param_string(graph->module + m0, dt_token("filename"), imgfilename);
-
-  // run graph only up to roi computations to get size
-  // run all <= create nodes
-  dt_graph_run_t run = ~-(s_graph_run_create_nodes<<1);
-  if(dt_graph_run(graph, run) != VK_SUCCESS)
-  {
-    dt_log(s_log_err, "[thm] failed to run first half of graph!");
-    return VK_INCOMPLETE;
-  }
-
-  // now grab roi size from graph's main output node
-  th->wd = graph->module[m1].connector[0].roi.full_wd;
-  th->ht = graph->module[m1].connector[0].roi.full_ht;
+  th->wd = wd;
+  th->ht = ht;
 
   VkFormat format = VK_FORMAT_BC1_RGB_SRGB_BLOCK;
   VkImageCreateInfo images_create_info = {
@@ -559,6 +664,8 @@ dt_thumbnails_load_one(
   if(!mem)
   {
     dt_log(s_log_err, "[thm] no more thumbnail gpu memory allocation possible!\n");
+    vkDestroyImage(qvk.device, th->image, VK_NULL_HANDLE);
+    th->image = 0;
     return VK_INCOMPLETE; // probably fragmented memory
   }
   // TODO: if (!mem) we have not enough memory! need to handle this now (more cache eviction?)
@@ -566,7 +673,6 @@ dt_thumbnails_load_one(
   // walk lru list from front and kill all contents (see above)
   // but leave list as it is
 
-  assert(mem);
   th->mem    = mem;
   th->offset = mem->offset;
 
@@ -603,27 +709,232 @@ dt_thumbnails_load_one(
   img_dset.dstSet    = th->dset;
   img_info.imageView = th->image_view;
   vkUpdateDescriptorSets(qvk.device, 1, &img_dset, 0, NULL);
+  return VK_SUCCESS;
+}
+
+// make sure the host visible staging buffer can hold size bytes
+static VkResult
+staging_alloc(
+    dt_thumbnails_t *tn,
+    size_t           size)
+{
+  if(size <= tn->staging_size) return VK_SUCCESS;
+  if(tn->staging)       vkDestroyBuffer(qvk.device, tn->staging, 0);
+  if(tn->vkmem_staging) vkFreeMemory(qvk.device, tn->vkmem_staging, 0);
+  tn->staging = 0;
+  tn->vkmem_staging = 0;
+  tn->staging_size = 0;
+  size = MAX(size, 1ul<<20); // avoid reallocating for every other batch
+  VkBufferCreateInfo buffer_info = {
+    .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size        = size,
+    .usage       = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+  };
+  QVKR(vkCreateBuffer(qvk.device, &buffer_info, 0, &tn->staging));
+  VkMemoryRequirements mem_req;
+  vkGetBufferMemoryRequirements(qvk.device, tn->staging, &mem_req);
+  VkMemoryAllocateInfo mem_alloc_info = {
+    .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .allocationSize  = mem_req.size,
+    .memoryTypeIndex = qvk_get_memory_type(mem_req.memoryTypeBits,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
+  };
+  QVKR(vkAllocateMemory(qvk.device, &mem_alloc_info, 0, &tn->vkmem_staging));
+  QVKR(vkBindBufferMemory(qvk.device, tn->staging, tn->vkmem_staging, 0));
+  tn->staging_size = size;
+  return VK_SUCCESS;
+}
 
-  // now run the rest of the graph and copy over VkImage
-  // let graph render into our thumbnail:
-  graph->thumbnail_image = tn->thumb[*thumb_index].image;
-  // these should already match, let's not mess with rounding errors:
-  // tn->graph.output_wd = th->wd;
-  // tn->graph.output_ht = th->ht;
+// load a batch of bc1 files: read and inflate them on the thread pool,
+// pack all blocks into one staging buffer and upload everything with one
+// command buffer submission. marks successful jobs as ok.
+static VkResult
+load_batch(
+    dt_thumbnails_t *tn,
+    load_job_t      *job,
+    uint32_t         cnt)
+{
+  if(!cnt) return VK_SUCCESS;
+  if(cnt > 1 && threads_num() > 1)
+  { // schedule a few more threads to help out and read files on this thread
+    // too. if the pool is busy with exports this does not stall the gui.
+    load_batch_t *b = malloc(sizeof(*b));
+    b->job = job;
+    b->cnt = cnt;
+    atomic_init(&b->next, 0);
+    atomic_init(&b->done, 0);
+    const uint32_t helpers = MIN(cnt, threads_num()) - 1;
+    atomic_init(&b->ref, 1 + helpers);
+    uint32_t pushed = 0;
+    for(;pushed<helpers;pushed++)
+      if(threads_task("thmload", 1, -1, b, thread_work_load_batch, 0) < 0) break;
+    if(pushed < helpers) atomic_fetch_sub(&b->ref, helpers - pushed);
+    load_batch_drain(b);
+    // wait for the files still being read on other threads
+    while(atomic_load(&b->done) < cnt) sched_yield();
+    load_batch_unref(b);
+  }
+  else for(int k=0;k<cnt;k++) thread_work_load(k, job);
 
-  clock_t beg = clock();
-  // run all the rest we didn't run above
-  if(dt_graph_run(graph, ~run) != VK_SUCCESS)
+  // allocate thumbnails and compute staging offsets
+  size_t size = 0;
+  for(int k=0;k<cnt;k++)
   {
-    dt_log(s_log_err, "[thm] running the thumbnail graph failed on image '%s'!", imgfilename);
-    return VK_INCOMPLETE;
+    job[k].ok = 0;
+    if(!(job[k].data || job[k].packed) || thumbnail_alloc(tn, job[k].thumb_index, job[k].wd, job[k].ht) != VK_SUCCESS)
+    {
+      free(job[k].data);
+      job[k].data = 0;
+      job[k].packed = 0;
+      continue;
+    }
+    size += 8ul*(job[k].wd/4)*(job[k].ht/4);
   }
-  clock_t end = clock();
-  dt_log(s_log_perf, "[thm] ran graph in %3.0fms", 1000.0*(end-beg)/CLOCKS_PER_SEC);
 
-  // reset here too to make sure cleanup() is called on all modules.
-  // this releases file descriptors and webcams etc.
-  dt_graph_reset(graph);
+  VkResult res = staging_alloc(tn, size);
+  if(res != VK_SUCCESS) goto error;
+  uint8_t *mapped = 0;
+  if((res = vkMapMemory(qvk.device, tn->vkmem_staging, 0, VK_WHOLE_SIZE, 0, (void**)&mapped)) != VK_SUCCESS)
+    goto error;
 
-  return VK_SUCCESS;
+  VkCommandBuffer cmd_buf = tn->command_buffer;
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  if((res = vkBeginCommandBuffer(cmd_buf, &begin_info)) != VK_SUCCESS)
+  {
+    vkUnmapMemory(qvk.device, tn->vkmem_staging);
+    goto error;
+  }
+  size_t offset = 0; // 8-byte bc1 blocks keep this aligned to texel block size
+  threads_mutex_lock(&tn->pack_mutex);
+  for(int k=0;k<cnt;k++)
+  {
+    const dt_thumbnail_t *th = tn->thumb + *job[k].thumb_index;
+    const size_t bytes = 8ul*(job[k].wd/4)*(job[k].ht/4);
+    if(job[k].packed)
+    { // the pointer is only valid until the next call, so look it up right here:
+      const dt_thumbpack_record_t *r = dt_thumbpack_find(&tn->pack, job[k].hash);
+      if(!r || r->wd != job[k].wd || r->ht != job[k].ht)
+      { // replaced in the meantime, we'll come back for it
+        job[k].packed = 0;
+        continue;
+      }
+      memcpy(mapped + offset, dt_thumbpack_data(r), bytes);
+    }
+    else if(job[k].data) memcpy(mapped + offset, job[k].data, bytes);
+    else continue;
+    VkBufferImageCopy cp = {
+      .bufferOffset = offset,
+      .imageSubresource = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .mipLevel = 0,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+      },
+      .imageExtent = { th->wd, th->ht, 1 },
+    };
+    BARRIER_IMG_LAYOUT(th->image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    vkCmdCopyBufferToImage(cmd_buf, tn->staging, th->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cp);
+    BARRIER_IMG_LAYOUT(th->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    offset += bytes;
+  }
+  threads_mutex_unlock(&tn->pack_mutex);
+  vkUnmapMemory(qvk.device, tn->vkmem_staging);
+  if((res = vkEndCommandBuffer(cmd_buf)) != VK_SUCCESS) goto error;
+
+  VkSubmitInfo submit = {
+    .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .commandBufferCount = 1,
+    .pCommandBuffers    = &cmd_buf,
+  };
+  vkResetFences(qvk.device, 1, &tn->command_fence);
+  threads_mutex_lock(&qvk.queue_work0_mutex);
+  res = vkQueueSubmit(qvk.queue_work0, 1, &submit, tn->command_fence);
+  threads_mutex_unlock(&qvk.queue_work0_mutex);
+  if(res == VK_SUCCESS)
+    res = vkWaitForFences(qvk.device, 1, &tn->command_fence, VK_TRUE, 1ul<<40);
+error:
+  if(res != VK_SUCCESS)
+    dt_log(s_log_err|s_log_qvk, "[thm] uploading thumbnails failed: %s", qvk_result_to_string(res));
+  for(int k=0;k<cnt;k++)
+  {
+    job[k].ok = (res == VK_SUCCESS) && (job[k].data || job[k].packed);
+    free(job[k].data);
+    job[k].data = 0;
+  }
+  return res;
+}
+
+// 1) if db loads a directory, kick off thumbnail creation of directory in bg
+//    this step is the only thing in the non-gui thread
+// 2) for currently visible collection: batch-update lru and trigger thumbnail loading
+//    if necessary (bc1 file exists but not loaded, maybe need "ready" flag)
+//    this should be fast enough to run every refresh.
+//    thumbnails that need loading are collected and uploaded in batches,
+//    see load_batch().
+// this function is 2):
+void
+dt_thumbnails_load_list(
+    dt_thumbnails_t *tn,
+    dt_db_t         *db,
+    const uint32_t  *collection,
+    uint32_t         beg,
+    uint32_t         end)
+{
+  // don't evict thumbnails of the same batch from the lru list:
+  const uint32_t batch_max = MIN(DT_THUMBNAILS_BATCH, tn->thumb_max/2);
+  load_job_t *job = 0;
+  uint32_t cnt = 0;
+  for(int k=beg;k<end;k++)
+  { // for all images in given collection
+    const uint32_t imgid = collection[k];
+    if(imgid >= db->image_cnt) break; // safety first. this probably means this job is stale! big danger!
+    dt_image_t *img = db->image + imgid;
+    if(img->thumbnail == 0)
+    { // not loaded
+      char filename[1024];
+      dt_db_image_path(db, imgid, filename, sizeof(filename));
+      if(!job) job = malloc(sizeof(load_job_t)*batch_max);
+      if(load_job_init(tn, filename, job+cnt)) continue; // not cached yet
+      img->thumbnail = -1u;
+      job[cnt].thumb_index = &img->thumbnail;
+      if(++cnt == batch_max)
+      {
+        load_batch(tn, job, cnt);
+        for(int i=0;i<cnt;i++) if(!job[i].ok) *job[i].thumb_index = 0;
+        cnt = 0;
+      }
+    }
+    else if(img->thumbnail > 0 && img->thumbnail < tn->thumb_max)
+    { // loaded, update lru
+      // threads_mutex_lock(&tn->lru_lock);
+      dt_thumbnail_t *th = tn->thumb + img->thumbnail;
+      if(th == tn->lru) tn->lru = tn->lru->next; // move head
+      tn->lru->prev = 0;
+      if(tn->mru == th) tn->mru = th->prev;      // going to remove mru, need to move
+      DLIST_RM_ELEMENT(th);                      // disconnect old head
+      tn->mru = DLIST_APPEND(tn->mru, th);       // append to end and move tail
+      // threads_mutex_unlock(&tn->lru_lock);
+    }
+  }
+  load_batch(tn, job, cnt);
+  for(int i=0;i<cnt;i++) if(!job[i].ok) *job[i].thumb_index = 0;
+  free(job);
+}
+
+// load a previously cached thumbnail to a VkImage onto the GPU.
+// returns VK_SUCCESS on success
+VkResult
+dt_thumbnails_load_one(
+    dt_thumbnails_t *tn,
+    const char      *filename,
+    uint32_t        *thumb_index)
+{
+  load_job_t job = { .thumb_index = thumb_index };
+  if(load_job_init(tn, filename, &job)) return VK_INCOMPLETE;
+  load_batch(tn, &job, 1);
+  return job.ok ? VK_SUCCESS : VK_INCOMPLETE;
 }
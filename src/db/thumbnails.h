@@ -2,6 +2,7 @@
 
 #include "pipe/graph.h"
 #include "pipe/alloc.h"
+#include "db/thumbpack.h"
 #include "core/threads.h"
 
 #include <vulkan/vulkan.h>
@@ -16,7 +17,7 @@
 //
 // create thumbnails and default history here
 // /<full path from root>/imgname.raw.cfg
-// ~/.cache/vkdt/imgnamehash.bc1
+// ~/.cache/vkdt/dirnamehash.bc1p (see thumbpack.h)
 
 typedef struct dt_db_t dt_db_t;
 typedef struct dt_thumbnail_t
@@ -35,6 +36,7 @@ typedef struct dt_thumbnail_t
 dt_thumbnail_t;
 
 #define DT_THUMBNAILS_THREADS 2
+#define DT_THUMBNAILS_BATCH 256  // max number of thumbnails uploaded in one go
 typedef struct dt_thumbnails_t
 {
   dt_graph_t            graph[DT_THUMBNAILS_THREADS];
@@ -52,11 +54,22 @@ typedef struct dt_thumbnails_t
   dt_thumbnail_t       *thumb;
   int                   thumb_max;
 
+  // batch upload of bc1 thumbnails from disk, see dt_thumbnails_load_list()
+  VkCommandPool         command_pool;
+  VkCommandBuffer       command_buffer;
+  VkFence               command_fence;
+  VkBuffer              staging;
+  VkDeviceMemory        vkmem_staging;
+  size_t                staging_size;
+
   // threads_mutex_t       lru_lock; // currently not needed, only using lru cache in gui thread
   dt_thumbnail_t       *lru;   // least recently used thumbnail, delete this first
   dt_thumbnail_t       *mru;   // most  recently used thumbnail, append here
 
   char                  cachedir[1024];
+
+  threads_mutex_t       pack_mutex; // cache workers share the pack
+  dt_thumbpack_t        pack;       // packed thumbnails of the current directory
 }
 dt_thumbnails_t;
 
@@ -97,11 +110,12 @@ VkResult dt_thumbnails_cache_one(
 void dt_thumbnails_cache_abort( dt_thumbnails_t *tn);
 
 // load one bc1 thumbnail for a given filename. fills thumb_index and returns
-// VK_SUCCESS if all went well.
+// VK_SUCCESS if all went well. prefer dt_thumbnails_load_list() for many
+// images, it reads the files in parallel and uploads with a single submit.
 VkResult dt_thumbnails_load_one(dt_thumbnails_t *tn, const char *filename, uint32_t *thumb_index);
 
-// update thumbnails for a list of image ids. this will run in this thread
-// and return after it's done. it'll update lru lists and try to load bc1 thumbnails
+// update thumbnails for a list of image ids. this will block this thread
+// (the files are read by the thread pool) and return after it's done. it'll update lru lists and try to load bc1 thumbnails
 // from the cache location. it does not trigger a bc1 creation process (such as
 // dt_thumbnails_cache_directory() does).
 void
@@ -112,7 +126,7 @@ dt_thumbnails_load_list(
     uint32_t         beg,          // update collection[k] with k in [beg, end)
     uint32_t         end);         // 
 
-// explitly delete the cached bc1 thumbnail in ~/.cache/vkdt/
+// explitly delete the cached bc1 thumbnail in ~/.cache/vkdt/ (marks it invalid in the pack)
 void
 dt_thumbnails_invalidate(
     dt_thumbnails_t *tn,
@@ -0,0 +1,286 @@
+#include "db/thumbpack.h"
+#include "db/hash.h"
+#include "core/log.h"
+#include "core/fs.h"
+#include "pipe/token.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// rewrite the pack once this many bytes are stale and they are more than half of it
+#define DT_THUMBPACK_DEAD_MAX (32ul<<20)
+
+// returns the offset of the record this one overrides, or -1 if there was none
+static uint64_t
+index_insert(
+    dt_thumbpack_t *p,
+    uint64_t        hash,
+    uint64_t        off)
+{
+  if(2*(p->idx_cnt+1) > p->idx_max)
+  { // grow and rehash
+    uint32_t  old_max  = p->idx_max;
+    uint64_t *old_hash = p->idx_hash;
+    uint64_t *old_off  = p->idx_off;
+    p->idx_max  = old_max ? 2*old_max : 1024;
+    p->idx_hash = calloc(p->idx_max, sizeof(uint64_t));
+    p->idx_off  = calloc(p->idx_max, sizeof(uint64_t));
+    p->idx_cnt  = 0;
+    for(uint32_t i=0;i<old_max;i++)
+      if(old_hash[i]) index_insert(p, old_hash[i], old_off[i]);
+    free(old_hash);
+    free(old_off);
+  }
+  if(!hash) hash = 1; // 0 marks empty slots
+  uint32_t i = hash & (p->idx_max-1);
+  while(p->idx_hash[i] && p->idx_hash[i] != hash) i = (i+1) & (p->idx_max-1);
+  uint64_t old = p->idx_hash[i] ? p->idx_off[i] : -1;
+  if(!p->idx_hash[i]) p->idx_cnt++;
+  p->idx_hash[i] = hash;
+  p->idx_off [i] = off; // later records override earlier ones
+  return old;
+}
+
+static inline size_t
+record_size(const dt_thumbpack_record_t *r)
+{
+  return sizeof(*r) + dt_thumbpack_data_size(r->wd, r->ht);
+}
+
+// forget the mapping and the index, keep the file name
+static void
+reset(dt_thumbpack_t *p)
+{
+  if(p->map) munmap(p->map, p->map_size);
+  free(p->idx_hash);
+  free(p->idx_off);
+  p->map = 0;
+  p->map_size = p->scanned = p->live = 0;
+  p->idx_hash = p->idx_off = 0;
+  p->idx_max = p->idx_cnt = 0;
+}
+
+// (re)open the pack file, read-only or for appending. only the latter creates
+// the file, so looking up thumbnails does not leave empty packs behind.
+static int
+reopen(dt_thumbpack_t *p, int write)
+{
+  if(p->fd >= 0) close(p->fd);
+  reset(p);
+  p->fd = open(p->filename, write ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY, 0644);
+  p->writable = write && p->fd >= 0;
+  if(p->fd < 0 && (write || errno != ENOENT))
+    dt_log(s_log_db|s_log_err, "[thm] could not open thumbnail pack %s", p->filename);
+  return p->fd < 0;
+}
+
+// has the file been rewritten and renamed over the one we have open?
+static int
+replaced(dt_thumbpack_t *p)
+{
+  struct stat sa, sb;
+  if(stat(p->filename, &sa) || fstat(p->fd, &sb)) return 1;
+  return sa.st_ino != sb.st_ino || sa.st_dev != sb.st_dev;
+}
+
+// remap the file if it grew and index all new records. needs the file lock.
+static void
+remap(dt_thumbpack_t *p)
+{
+  struct stat sb;
+  if(fstat(p->fd, &sb) || sb.st_size <= p->map_size) return;
+  if(p->map) munmap(p->map, p->map_size);
+  p->map_size = sb.st_size;
+  p->map = mmap(0, p->map_size, PROT_READ, MAP_SHARED, p->fd, 0);
+  if(p->map == MAP_FAILED)
+  {
+    p->map = 0;
+    p->map_size = p->scanned = 0;
+    return;
+  }
+  while(p->scanned + sizeof(dt_thumbpack_record_t) <= p->map_size)
+  {
+    const dt_thumbpack_record_t *r = (const dt_thumbpack_record_t *)(p->map + p->scanned);
+    const size_t size = record_size(r);
+    if(r->magic != dt_token("bc1pack") || p->scanned + size > p->map_size)
+    { // corrupt, stop here and don't index anything after it
+      dt_log(s_log_db|s_log_err, "[thm] corrupt thumbnail pack at offset %zu!", p->scanned);
+      p->scanned = p->map_size;
+      break;
+    }
+    uint64_t old = index_insert(p, r->hash, p->scanned);
+    if(old != -1)
+    {
+      const dt_thumbpack_record_t *o = (const dt_thumbpack_record_t *)(p->map + old);
+      if(o->wd) p->live -= record_size(o);
+    }
+    if(r->wd) p->live += size;
+    p->scanned += size;
+  }
+}
+
+// pick up records appended or files renamed into place by others
+static void
+update(dt_thumbpack_t *p)
+{
+  if(p->fd < 0 && reopen(p, 0)) return; // still not created
+  flock(p->fd, LOCK_SH); // make sure no half written records are visible
+  if(replaced(p))
+  {
+    flock(p->fd, LOCK_UN);
+    if(reopen(p, p->writable)) return;
+    flock(p->fd, LOCK_SH);
+  }
+  remap(p);
+  flock(p->fd, LOCK_UN);
+}
+
+// write only the latest valid records to a new file and rename it into place.
+// called with the exclusive lock held, which is released by closing the old
+// file on success. returns 0 in that case.
+static int
+compact(dt_thumbpack_t *p)
+{
+  char tmp[PATH_MAX+120];
+  snprintf(tmp, sizeof(tmp), "%s.%d", p->filename, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) return 1;
+  int err = 0;
+  for(uint32_t i=0;i<p->idx_max && !err;i++)
+  {
+    if(!p->idx_hash[i]) continue;
+    const dt_thumbpack_record_t *r = (const dt_thumbpack_record_t *)(p->map + p->idx_off[i]);
+    if(!r->wd) continue; // invalidated, drop it altogether
+    const uint8_t *buf = (const uint8_t *)r;
+    for(size_t size = record_size(r); size && !err;)
+    {
+      ssize_t wr = write(fd, buf, size);
+      if(wr <= 0) err = 1;
+      else { buf += wr; size -= wr; }
+    }
+  }
+  if(close(fd) || err || rename(tmp, p->filename))
+  {
+    dt_log(s_log_db|s_log_err, "[thm] could not compact thumbnail pack %s", p->filename);
+    unlink(tmp);
+    return 1;
+  }
+  dt_log(s_log_db, "[thm] compacted thumbnail pack %s from %zu to %zu bytes",
+      p->filename, p->scanned, p->live);
+  if(!reopen(p, 1)) update(p);
+  return 0;
+}
+
+int
+dt_thumbpack_open(
+    dt_thumbpack_t *p,
+    const char     *cachedir,
+    const char     *imgfilename)
+{
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", imgfilename);
+  if(!fs_dirname(dir)) snprintf(dir, sizeof(dir), ".");
+  const uint64_t dirhash = hash64(dir);
+  if(p->dirhash == dirhash) return 0; // also if the file does not exist yet
+
+  dt_thumbpack_close(p);
+  snprintf(p->filename, sizeof(p->filename), "%s/%lx.bc1p", cachedir, dirhash);
+  p->dirhash = dirhash;
+  p->fd = -1;
+  update(p);
+  return 0;
+}
+
+void
+dt_thumbpack_close(dt_thumbpack_t *p)
+{
+  if(p->map) munmap(p->map, p->map_size);
+  if(p->dirhash && p->fd >= 0) close(p->fd);
+  free(p->idx_hash);
+  free(p->idx_off);
+  memset(p, 0, sizeof(*p));
+}
+
+static const dt_thumbpack_record_t *
+lookup(dt_thumbpack_t *p, uint64_t hash)
+{
+  if(!p->idx_max) return 0;
+  if(!hash) hash = 1;
+  uint32_t i = hash & (p->idx_max-1);
+  while(p->idx_hash[i])
+  {
+    if(p->idx_hash[i] == hash)
+    {
+      const dt_thumbpack_record_t *r = (const dt_thumbpack_record_t *)(p->map + p->idx_off[i]);
+      return r->wd ? r : 0; // invalidated?
+    }
+    i = (i+1) & (p->idx_max-1);
+  }
+  return 0;
+}
+
+const dt_thumbpack_record_t *
+dt_thumbpack_find(
+    dt_thumbpack_t *p,
+    uint64_t        hash)
+{
+  if(!p->dirhash) return 0;
+  update(p); // cheap (f)stat, picks up records appended by the cache workers
+  return lookup(p, hash);
+}
+
+int
+dt_thumbpack_append(
+    dt_thumbpack_t *p,
+    uint64_t        hash,
+    int64_t         mtime,
+    uint32_t        wd,
+    uint32_t        ht,
+    const uint8_t  *data)
+{
+  if(!p->dirhash) return 1;
+  if(!p->writable && reopen(p, 1)) return 1; // first write, create the file
+  dt_thumbpack_record_t r = {
+    .magic = dt_token("bc1pack"),
+    .hash  = hash,
+    .mtime = mtime,
+    .wd    = data ? wd : 0,
+    .ht    = data ? ht : 0,
+  };
+  struct iovec iov[2] = {
+    { .iov_base = &r,            .iov_len = sizeof(r) },
+    { .iov_base = (void *)data,  .iov_len = dt_thumbpack_data_size(r.wd, r.ht) },
+  };
+  const size_t size = iov[0].iov_len + iov[1].iov_len;
+  flock(p->fd, LOCK_EX);
+  if(replaced(p))
+  { // someone compacted the file while we were waiting for the lock
+    flock(p->fd, LOCK_UN);
+    if(reopen(p, 1)) return 1;
+    flock(p->fd, LOCK_EX);
+  }
+  ssize_t wr = writev(p->fd, iov, data ? 2 : 1);
+  if(wr >= 0 && wr != size)
+  { // out of disk space or similar. cut off the broken tail so others don't stumble over it
+    struct stat sb;
+    if(!fstat(p->fd, &sb)) (void)ftruncate(p->fd, sb.st_size - wr);
+  }
+  if(wr == size)
+  {
+    remap(p);
+    const size_t dead = p->scanned - p->live;
+    if(dead > DT_THUMBPACK_DEAD_MAX && dead > p->live && !compact(p))
+      return 0; // the lock went with the old file
+  }
+  flock(p->fd, LOCK_UN);
+  return wr != size;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+
+// packed per-directory thumbnail store.
+// this is a single append-only file in the cache directory per image
+// directory, ~/.cache/vkdt/<hash-of-dirname>.bc1p. it holds a sequence of
+// records, each a header followed by uncompressed bc1 blocks. later records
+// for the same image override earlier ones. the file is memory mapped for
+// reading, so loading a thumbnail does not open, stat or inflate anything.
+// appends are done with a single write() under an exclusive flock(), so
+// several processes/threads can add thumbnails at the same time.
+// the file is only created by the first append, lookups open it read-only.
+// once most of it is overridden or invalidated records, the writer rewrites it
+// with only the latest records and renames it into place. everybody else
+// notices the new inode on the next lookup or append and switches over.
+
+typedef struct dt_thumbpack_record_t
+{
+  uint64_t magic;  // dt_token("bc1pack")
+  uint64_t hash;   // hash64() of the image filename (the .cfg)
+  int64_t  mtime;  // mtime of the cfg the thumbnail was created from
+  uint32_t wd;     // width, multiple of 4. 0 marks an invalidated entry
+  uint32_t ht;     // height, multiple of 4
+}
+dt_thumbpack_record_t; // followed by 8*(wd/4)*(ht/4) bytes of bc1 blocks
+
+typedef struct dt_thumbpack_t
+{
+  uint64_t  dirhash;  // hash of the directory this pack refers to, 0 if none open
+  char      filename[PATH_MAX+100]; // the pack file for this directory
+  int       fd;       // file descriptor of the pack file, -1 if it does not exist yet
+  int       writable; // fd has been opened for appending
+  uint8_t  *map;      // memory mapped file contents
+  size_t    map_size; // size of the mapping
+  size_t    scanned;  // bytes of the file that have been indexed
+  size_t    live;     // bytes of the scanned records that are the latest valid ones
+  uint32_t  idx_max;  // size of the open addressing hash table (power of two)
+  uint32_t  idx_cnt;  // number of occupied slots
+  uint64_t *idx_hash; // image hash per slot, 0 if empty
+  uint64_t *idx_off;  // offset of the latest record for this image
+}
+dt_thumbpack_t;
+
+// make sure the pack for the directory of the given image file is open.
+// switches directory if another one was open before. returns 0 on success.
+int dt_thumbpack_open(
+    dt_thumbpack_t *p,
+    const char     *cachedir,
+    const char     *imgfilename);
+
+// close the file and free the index
+void dt_thumbpack_close(dt_thumbpack_t *p);
+
+// find the most recent valid record for the given image hash. picks up
+// records appended by others since the last call. returns 0 if there is none.
+// the returned pointer is valid until the next call to any dt_thumbpack function.
+const dt_thumbpack_record_t *dt_thumbpack_find(
+    dt_thumbpack_t *p,
+    uint64_t        hash);
+
+// return the bc1 blocks following a record
+static inline const uint8_t *
+dt_thumbpack_data(const dt_thumbpack_record_t *r)
+{
+  return (const uint8_t *)(r + 1);
+}
+
+static inline size_t
+dt_thumbpack_data_size(uint32_t wd, uint32_t ht)
+{
+  return 8ul*(wd/4)*(ht/4);
+}
+
+// atomically append a record to the pack. pass wd = ht = 0 and data = 0
+// to invalidate the thumbnail. returns 0 on success.
+int dt_thumbpack_append(
+    dt_thumbpack_t *p,
+    uint64_t        hash,
+    int64_t         mtime,
+    uint32_t        wd,
+    uint32_t        ht,
+    const uint8_t  *data);
@@ -3,6 +3,8 @@
 #include "gui/gui.h"
 #include "gui/darkroom.h"
 #include "pipe/draw.h"
+#include "core/fs.h"
+#include "core/profile.h"
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 // api functions for gui interactions, c portion.
@@ -16,6 +18,24 @@ dt_gui_dr_reload_shaders()
   vkdt.graph_dev.runflags = s_graph_run_all;
 }
 
+static inline void
+dt_gui_toggle_profile()
+{ // start or stop writing a chrome trace to the cache directory
+  if(dt_profile_active())
+  {
+    dt_profile_stop();
+    dt_gui_notification("stopped profiling");
+    return;
+  }
+  char filename[PATH_MAX];
+  fs_cachedir(filename, sizeof(filename));
+  strncat(filename, "/profile.json", sizeof(filename)-strlen(filename)-1);
+  if(dt_profile_start(filename))
+    dt_gui_notification("could not open %s", filename);
+  else
+    dt_gui_notification("writing profile to %s", filename);
+}
+
 static inline void
 dt_gui_dr_anim_start()
 {
@@ -6,6 +6,7 @@
 #include "pipe/modules/api.h"
 #include "db/thumbnails.h"
 #include "core/log.h"
+#include "core/profile.h"
 #include "core/signal.h"
 #include "core/version.h"
 #include "core/tools.h"
@@ -366,6 +367,7 @@ out:
 
   threads_shutdown();
   threads_global_cleanup(); // join worker threads before killing their resources
+  dt_profile_stop(); // finish the trace if one is still being written
   dt_thumbnails_cleanup(&vkdt.thumbnails);
   dt_thumbnails_cleanup(&vkdt.thumbnail_gen);
   dt_gui_cleanup();
@@ -39,6 +39,7 @@ static ImHotKey::HotKey hk_darkroom[] = {
   {"label yellow",    "toggle yellow label",                        {ImGuiKey_F4}},
   {"label purple",    "toggle purple label",                        {ImGuiKey_F5}},
   {"reload shaders",  "debug: reload shader code while running",    {}},
+  {"profile",         "debug: start/stop writing a chrome trace",   {}},
 };
 
 enum hotkey_names_t
@@ -66,6 +67,7 @@ enum hotkey_names_t
   s_hotkey_label_4         = 20,
   s_hotkey_label_5         = 21,
   s_hotkey_reload_shaders  = 22,
+  s_hotkey_profile         = 23,
 };
 
 // used to communictate between the gui helper functions
@@ -564,6 +566,7 @@ abort:
     case s_hotkey_label_4: dt_gui_label_4(); break;
     case s_hotkey_label_5: dt_gui_label_5(); break;
     case s_hotkey_reload_shaders: dt_gui_dr_reload_shaders(); break;
+    case s_hotkey_profile: dt_gui_toggle_profile(); break;
     default:;
   }
   dt_gui_dr_modals(); // draw modal windows for presets etc
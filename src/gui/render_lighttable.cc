@@ -7,6 +7,7 @@ extern "C"
 #include "db/rc.h"
 #include "db/hash.h"
 #include "core/strexpand.h"
+#include "pipe/graph-batch.h"
 }
 #include "gui/render_view.hh"
 #include "gui/hotkey.hh"
@@ -251,23 +252,17 @@ struct export_job_t
   float quality;
   uint32_t cnt;
   uint32_t overwrite;
-  uint32_t abort;
-  int taskid;
   char basename[1000];
-  dt_graph_t graph;
+  dt_graph_batch_t batch;
 };
-void export_job_cleanup(void *arg)
-{ // task is done, every thread will call this (but we put only one)
-  export_job_t *j = (export_job_t *)arg;
-  free(j->sel);
-  dt_graph_cleanup(&j->graph);
-}
-void export_job_work(uint32_t item, void *arg)
+int export_job_param(
+    void                    *data,
+    uint32_t                 item,
+    dt_graph_batch_worker_t *w,
+    dt_graph_export_t       *param)
 {
-  export_job_t *j = (export_job_t *)arg;
-  if(j->abort) return;
-
-  char filename[PATH_MAX], infilename[PATH_MAX], filedir[PATH_MAX];
+  export_job_t *j = (export_job_t *)data;
+  char filedir[PATH_MAX];
   dt_db_image_path(&vkdt.db, j->sel[item], filedir, sizeof(filedir));
   char *filebase = fs_basename(filedir);
   size_t len = strlen(filebase);
@@ -283,29 +278,34 @@ void export_job_work(uint32_t item, void *arg)
   snprintf(istr, sizeof(istr), "%04d", item);
   const char *key[] = { "home", "yyyy", "date", "seq", "fdir", "ffile", 0};
   const char *val[] = { getenv("HOME"), yyyy, date, istr, filedir, filebase, 0};
-  dt_strexpand(j->basename, sizeof(j->basename), filename, sizeof(filename), key, val);
-
-  dt_gui_notification("exporting to %s", filename);
-
-  dt_db_image_path(&vkdt.db, j->sel[item], infilename, sizeof(infilename));
-  dt_graph_export_t param = {0};
-  param.output_cnt = 1;
-  param.output[0].p_filename = filename;
-  param.output[0].max_width  = j->wd;
-  param.output[0].max_height = j->ht;
-  param.output[0].quality    = j->quality;
-  param.output[0].mod        = j->output_module;
-  param.p_cfgfile = infilename;
-  if(dt_graph_export(&j->graph, &param))
-    dt_gui_notification("export %s failed!\n", infilename);
-  dt_graph_reset(&j->graph);
+  dt_strexpand(j->basename, sizeof(j->basename), w->filename[0], sizeof(w->filename[0]), key, val);
+
+  dt_gui_notification("exporting to %s", w->filename[0]);
+
+  dt_db_image_path(&vkdt.db, j->sel[item], w->cfgfile, sizeof(w->cfgfile));
+  param->output_cnt = 1;
+  param->output[0].p_filename = w->filename[0];
+  param->output[0].max_width  = j->wd;
+  param->output[0].max_height = j->ht;
+  param->output[0].quality    = j->quality;
+  param->output[0].mod        = j->output_module;
+  param->p_cfgfile = w->cfgfile;
+  return 0;
+}
+void export_job_done(
+    void                    *data,
+    uint32_t                 item,
+    dt_graph_batch_worker_t *w,
+    VkResult                 res)
+{
+  if(res != VK_SUCCESS)
+    dt_gui_notification("export %s failed!\n", w->cfgfile);
   glfwPostEmptyEvent(); // redraw status bar
 }
 int export_job(
     export_job_t *j,
     int overwrite)
 {
-  j->abort = 0;
   j->overwrite = overwrite;
   if(vkdt.db.selection_cnt <= 0)
   {
@@ -323,11 +323,11 @@ int export_job(
           (int)0, (int)(sizeof(format_mod)/sizeof(format_mod[0])-1));
   j->output_module = format_mod[fm];
   j->quality = dt_rc_get_float(&vkdt.rc, "gui/export/quality", 90.0f);
-  dt_graph_init(&j->graph);
   // TODO:
   // fs_mkdir(j->dst, 0777); // try and potentially fail to create destination directory
-  j->taskid = threads_task("export", j->cnt, -1, j, export_job_work, export_job_cleanup);
-  return j->taskid;
+  // a couple of graphs in parallel, but leave some threads for the gui and thumbnails:
+  const int graph_cnt = dt_rc_get_int(&vkdt.rc, "gui/export/graphs", 2);
+  return dt_graph_batch_start(&j->batch, j->cnt, graph_cnt, export_job_param, export_job_done, j);
 }
 // end export bg job stuff
 
@@ -752,16 +752,18 @@ void render_lighttable_right_panel(int hotkey)
         }
         if(ImGui::IsItemHovered()) dt_gui_set_tooltip("export current selection");
       }
-      else if(job[k].cnt > 0 && threads_task_running(job[k].taskid))
+      else if(job[k].cnt > 0 && dt_graph_batch_running(&job[k].batch))
       { // running
-        if(ImGui::Button("abort")) job[k].abort = 1;
+        if(ImGui::Button("abort")) job[k].batch.abort = 1;
         ImGui::SameLine();
-        ImGui::ProgressBar(threads_task_progress(job[k].taskid), ImVec2(-1, 0));
+        ImGui::ProgressBar(dt_graph_batch_progress(&job[k].batch), ImVec2(-1, 0));
       }
       else
       { // done/aborted
-        if(ImGui::Button(job[k].abort ? "aborted" : "done"))
+        if(ImGui::Button(job[k].batch.abort ? "aborted" : "done"))
         { // reset
+          dt_graph_batch_wait(&job[k].batch); // clean up graphs the thread pool never started
+          free(job[k].sel);
           memset(job+k, 0, sizeof(export_job_t));
         }
         if(ImGui::IsItemHovered()) dt_gui_set_tooltip("click to reset");
@@ -22,6 +22,8 @@ dt_vkalloc_cleanup(dt_vkalloc_t *a)
 {
   // free whole thing
   free(a->vkmem_pool);
+  free(a->plan);
+  free(a->plan_dst);
   // don't free a, it's owned externally
   memset(a, 0, sizeof(*a));
 }
@@ -38,6 +40,407 @@ dt_vkalloc_nuke(dt_vkalloc_t *a)
   for(int i=1;i<a->pool_size;i++)
     a->unused = DLIST_PREPEND(a->unused, a->vkmem_pool+i);
   a->peak_rss = a->rss = a->vmsize = 0ul;
+  if(a->plan_mode) a->plan_mode = 1; // record the next pass
+  a->plan_cnt = a->plan_clock = a->plan_dst_cnt = 0;
+}
+
+void
+dt_vkalloc_plan_init(dt_vkalloc_t *a)
+{
+  a->plan_mode = 1;
+  a->plan_cnt = a->plan_clock = a->plan_dst_cnt = 0;
+}
+
+// while recording, allocations are only given a slot and are placed later by
+// dt_vkalloc_plan(), once all lifetimes are known.
+static dt_vkmem_t*
+plan_record(dt_vkalloc_t *a, uint64_t size, uint64_t alignment, int feedback)
+{
+  assert(a->unused && "vkalloc: no more free slots!");
+  if(!a->unused) return 0;
+  if(a->plan_cnt == a->plan_max)
+  {
+    a->plan_max = a->plan_max ? 2*a->plan_max : 1024;
+    a->plan = realloc(a->plan, sizeof(dt_vkalloc_plan_t)*a->plan_max);
+  }
+  dt_vkmem_t *mem = a->unused;
+  a->unused = DLIST_REMOVE(a->unused, mem); // remove first is O(1)
+  assert(size < 1ul<<48);
+  mem->offset = mem->offset_orig = 0;
+  mem->size = size;
+  mem->ref  = 1;
+  mem->plan = a->plan_cnt++;
+  a->plan[mem->plan] = (dt_vkalloc_plan_t) {
+    .size      = size,
+    .alignment = alignment,
+    .beg       = a->plan_clock++,
+    .end       = -1u,
+    .feedback  = feedback,
+    .dst       = -1u,
+  };
+  a->rss += size;
+  a->peak_rss = MAX(a->peak_rss, a->rss);
+  a->used = DLIST_PREPEND(a->used, mem);
+  return mem;
+}
+
+void
+dt_vkalloc_plan_dst(dt_vkalloc_t *a, dt_vkmem_t *mem, uint64_t *dst)
+{
+  if(a->plan_mode != 1) return;
+  if(a->plan_dst_cnt == a->plan_dst_max)
+  {
+    a->plan_dst_max = a->plan_dst_max ? 2*a->plan_dst_max : 1024;
+    a->plan_dst = realloc(a->plan_dst, sizeof(dt_vkalloc_plan_dst_t)*a->plan_dst_max);
+  }
+  dt_vkalloc_plan_t *p = a->plan + mem->plan;
+  a->plan_dst[a->plan_dst_cnt] = (dt_vkalloc_plan_dst_t) { .dst = dst, .next = p->dst };
+  p->dst = a->plan_dst_cnt++;
+}
+
+typedef struct plan_order_t
+{
+  uint64_t size;
+  uint32_t beg, i;
+}
+plan_order_t;
+
+static int
+compare_size(const void *a, const void *b)
+{ // largest first, then in order of allocation
+  const plan_order_t *oa = a, *ob = b;
+  if(oa->size != ob->size) return oa->size > ob->size ? -1 : 1;
+  return oa->beg < ob->beg ? -1 : oa->beg > ob->beg;
+}
+
+// greedy by size: place the largest blocks first, each at the lowest offset
+// where it does not collide with a block placed before that is alive at the
+// same time. writes the offsets to off[] and returns the heap size.
+static uint64_t
+plan_by_size(const dt_vkalloc_plan_t *p, uint32_t cnt, uint32_t clock, uint64_t base, uint64_t *off)
+{
+  plan_order_t *order = malloc(sizeof(plan_order_t)*cnt);
+  uint32_t *placed = malloc(sizeof(uint32_t)*cnt); // sorted by offset
+  uint32_t num = 0, num_placed = 0;
+  for(uint32_t i=0;i<cnt;i++) if(!p[i].feedback)
+    order[num++] = (plan_order_t){ .size = p[i].size, .beg = p[i].beg, .i = i };
+  qsort(order, num, sizeof(order[0]), compare_size);
+  uint64_t vmsize = base;
+  for(uint32_t k=0;k<num;k++)
+  {
+    const uint32_t i = order[k].i;
+    const uint32_t end = p[i].end == -1u ? clock : p[i].end;
+    const uint64_t align = p[i].alignment, size = p[i].size;
+    uint64_t o = (base + align-1) & ~(align-1);
+    for(uint32_t l=0;l<num_placed;l++)
+    {
+      const uint32_t j = placed[l];
+      const uint32_t end_j = p[j].end == -1u ? clock : p[j].end;
+      if(p[j].beg >= end || p[i].beg >= end_j) continue; // not alive at the same time
+      if(o + size <= off[j]) break; // fits in front of this one, and all after it
+      if(off[j] + p[j].size > o) o = (off[j] + p[j].size + align-1) & ~(align-1);
+    }
+    uint32_t pos = 0;
+    while(pos < num_placed && off[placed[pos]] <= o) pos++;
+    off[i] = o;
+    memmove(placed+pos+1, placed+pos, sizeof(uint32_t)*(num_placed-pos));
+    placed[pos] = i;
+    num_placed++;
+    vmsize = MAX(vmsize, o + size);
+  }
+  free(placed);
+  free(order);
+  return vmsize;
+}
+
+// the planner sweeps through the recorded allocation and free events in
+// order. the address space is kept as a list of segments, blocks and gaps,
+// the gaps are additionally kept in a treap ordered by size for best fit.
+typedef struct plan_seg_t
+{
+  uint64_t off, size;
+  int32_t  prev, next;   // neighbours in address order
+  int32_t  left, right;  // children in the treap of gaps
+  uint32_t prio;         // heap priority in the treap
+  int32_t  gap;
+}
+plan_seg_t;
+
+static inline int
+seg_less(const plan_seg_t *a, const plan_seg_t *b)
+{
+  return a->size < b->size || (a->size == b->size && a->off < b->off);
+}
+
+static int32_t
+gap_merge(plan_seg_t *s, int32_t a, int32_t b)
+{ // everything in a is less than everything in b
+  if(a < 0) return b;
+  if(b < 0) return a;
+  if(s[a].prio > s[b].prio)
+  {
+    s[a].right = gap_merge(s, s[a].right, b);
+    return a;
+  }
+  s[b].left = gap_merge(s, a, s[b].left);
+  return b;
+}
+
+static int32_t
+gap_insert(plan_seg_t *s, int32_t r, int32_t n)
+{
+  if(r < 0)
+  { // might have been in the treap before
+    s[n].left = s[n].right = -1;
+    return n;
+  }
+  if(seg_less(s+n, s+r))
+  {
+    s[r].left = gap_insert(s, s[r].left, n);
+    if(s[s[r].left].prio > s[r].prio)
+    { // rotate right
+      int32_t l = s[r].left;
+      s[r].left = s[l].right;
+      s[l].right = r;
+      return l;
+    }
+  }
+  else
+  {
+    s[r].right = gap_insert(s, s[r].right, n);
+    if(s[s[r].right].prio > s[r].prio)
+    { // rotate left
+      int32_t g = s[r].right;
+      s[r].right = s[g].left;
+      s[g].left = r;
+      return g;
+    }
+  }
+  return r;
+}
+
+static int32_t
+gap_remove(plan_seg_t *s, int32_t r, int32_t n)
+{
+  if(r < 0) return r;
+  if(r == n) return gap_merge(s, s[r].left, s[r].right);
+  if(seg_less(s+n, s+r)) s[r].left  = gap_remove(s, s[r].left,  n);
+  else                   s[r].right = gap_remove(s, s[r].right, n);
+  return r;
+}
+
+// smallest gap of at least the given size
+static int32_t
+gap_find(const plan_seg_t *s, int32_t r, uint64_t size)
+{
+  int32_t best = -1;
+  while(r >= 0)
+  {
+    if(s[r].size >= size) { best = r; r = s[r].left; }
+    else r = s[r].right;
+  }
+  return best;
+}
+
+static inline void
+seg_unlink(plan_seg_t *s, int32_t n, int32_t *last)
+{
+  if(s[n].prev >= 0) s[s[n].prev].next = s[n].next;
+  if(s[n].next >= 0) s[s[n].next].prev = s[n].prev;
+  else *last = s[n].prev;
+}
+
+// insert the new segment n after segment p (or first, if p < 0)
+static inline void
+seg_link(plan_seg_t *s, int32_t p, int32_t n, int32_t *first, int32_t *last)
+{
+  s[n].prev = p;
+  s[n].next = p >= 0 ? s[p].next : *first;
+  if(s[n].next >= 0) s[s[n].next].prev = n;
+  else *last = n;
+  if(p >= 0) s[p].next = n;
+  else *first = n;
+}
+
+static int
+compare_offset(const void *a, const void *b)
+{
+  const dt_vkmem_t *ma = *(const dt_vkmem_t **)a, *mb = *(const dt_vkmem_t **)b;
+  return ma->offset < mb->offset ? -1 : ma->offset > mb->offset;
+}
+
+uint64_t
+dt_vkalloc_plan(dt_vkalloc_t *a)
+{
+  if(a->plan_mode != 1) return a->vmsize;
+  const uint32_t cnt = a->plan_cnt;
+  dt_vkalloc_plan_t *p = a->plan;
+
+  // feedback buffers are kept for the next frame and can't share memory with
+  // anything, ever. stack them at the bottom:
+  uint64_t base = 0;
+  for(uint32_t i=0;i<cnt;i++) if(p[i].feedback)
+  {
+    p[i].offset = (base + p[i].alignment-1) & ~(p[i].alignment-1);
+    base = p[i].offset + p[i].size;
+  }
+
+  // every clock tick is either the allocation or the free of one block:
+  int32_t *ev  = malloc(sizeof(int32_t)*(a->plan_clock + cnt));
+  int32_t *blk = ev + a->plan_clock; // segment per allocation
+  for(uint32_t t=0;t<a->plan_clock;t++) ev[t] = INT32_MIN;
+  for(uint32_t i=0;i<cnt;i++) if(!p[i].feedback)
+  {
+    ev[p[i].beg] = i;
+    if(p[i].end != -1u) ev[p[i].end] = ~i;
+  }
+  plan_seg_t *s = malloc(sizeof(plan_seg_t)*(2*cnt+2));
+  int32_t seg_cnt = 0, first = -1, last = -1, root = -1;
+  uint32_t rnd = 0x9e3779b9u;
+  uint64_t top = base, vmsize = base;
+#define NEW_SEG(O, S, G) ({\
+  int32_t n = seg_cnt++;\
+  rnd ^= rnd << 13; rnd ^= rnd >> 17; rnd ^= rnd << 5;\
+  s[n] = (plan_seg_t){ .off = (O), .size = (S), .left = -1, .right = -1, .prio = rnd, .gap = (G) };\
+  n;\
+})
+  for(uint32_t t=0;t<a->plan_clock;t++)
+  {
+    if(ev[t] == INT32_MIN) continue;
+    if(ev[t] >= 0)
+    { // allocate: smallest gap that fits, or on top.
+      // look for an exact size first, and if that doesn't align one that surely does:
+      const uint32_t i = ev[t];
+      const uint64_t align = p[i].alignment, size = p[i].size;
+      int32_t g = gap_find(s, root, size);
+      if(g >= 0 && ((s[g].off + align-1) & ~(align-1)) + size > s[g].off + s[g].size)
+        g = gap_find(s, root, size + align-1);
+      if(g >= 0)
+      {
+        root = gap_remove(s, root, g);
+        const uint64_t off = (s[g].off + align-1) & ~(align-1);
+        const uint64_t end = s[g].off + s[g].size;
+        if(off > s[g].off)
+        { // keep the gap in front
+          int32_t n = NEW_SEG(s[g].off, off - s[g].off, 1);
+          seg_link(s, s[g].prev, n, &first, &last);
+          root = gap_insert(s, root, n);
+        }
+        if(off + size < end)
+        { // and the rest behind
+          int32_t n = NEW_SEG(off + size, end - off - size, 1);
+          seg_link(s, g, n, &first, &last);
+          root = gap_insert(s, root, n);
+        }
+        s[g].off  = off;
+        s[g].size = size;
+        s[g].gap  = 0;
+        blk[i] = g;
+      }
+      else
+      { // grow the heap
+        const uint64_t off = (top + align-1) & ~(align-1);
+        if(off > top)
+        {
+          int32_t n = NEW_SEG(top, off - top, 1);
+          seg_link(s, last, n, &first, &last);
+          root = gap_insert(s, root, n);
+        }
+        blk[i] = NEW_SEG(off, size, 0);
+        seg_link(s, last, blk[i], &first, &last);
+        top = off + size;
+        vmsize = MAX(vmsize, top);
+      }
+      p[i].offset = s[blk[i]].off;
+    }
+    else
+    { // free: turn into a gap and merge with the neighbours
+      const int32_t b = blk[~ev[t]];
+      s[b].gap = 1;
+      const int32_t pv = s[b].prev, nx = s[b].next;
+      if(pv >= 0 && s[pv].gap)
+      {
+        root = gap_remove(s, root, pv);
+        s[b].size += s[b].off - s[pv].off;
+        s[b].off   = s[pv].off;
+        seg_unlink(s, pv, &last);
+        if(first == pv) first = b;
+      }
+      if(nx >= 0 && s[nx].gap)
+      {
+        root = gap_remove(s, root, nx);
+        s[b].size = s[nx].off + s[nx].size - s[b].off;
+        seg_unlink(s, nx, &last);
+      }
+      if(s[b].next < 0)
+      { // nothing above, shrink the heap
+        top = s[b].off;
+        seg_unlink(s, b, &last);
+        if(first == b) first = -1;
+      }
+      else root = gap_insert(s, root, b);
+    }
+  }
+#undef NEW_SEG
+  free(s);
+  free(ev);
+
+  // now the same using the full lifetimes, and keep whichever is smaller:
+  uint64_t *off = malloc(sizeof(uint64_t)*(cnt+1));
+  const uint64_t vmsize_by_size = plan_by_size(p, cnt, a->plan_clock, base, off);
+  if(vmsize_by_size < vmsize)
+  {
+    for(uint32_t i=0;i<cnt;i++) if(!p[i].feedback) p[i].offset = off[i];
+    vmsize = vmsize_by_size;
+  }
+  free(off);
+
+  // patch the copies of the offsets the caller holds, and our own blocks:
+  for(uint32_t i=0;i<cnt;i++)
+    for(uint32_t d=p[i].dst;d!=-1u;d=a->plan_dst[d].next)
+      *a->plan_dst[d].dst = p[i].offset;
+  a->vmsize = vmsize;
+  a->plan_mode = 2;
+
+  // rebuild the free list from the gaps between the blocks still in use, so
+  // the allocator works as usual until the next nuke:
+  int num_used = DLIST_LENGTH(a->used);
+  dt_vkmem_t **used = malloc(sizeof(dt_vkmem_t*)*(num_used+1));
+  num_used = 0;
+  for(dt_vkmem_t *l=a->used;l;l=l->next)
+  {
+    l->offset = l->offset_orig = p[l->plan].offset;
+    used[num_used++] = l;
+  }
+  qsort(used, num_used, sizeof(dt_vkmem_t*), compare_offset);
+  while(a->free)
+  { // the single block from the nuke
+    dt_vkmem_t *mem = a->free;
+    a->free = DLIST_REMOVE(a->free, mem);
+    a->unused = DLIST_PREPEND(a->unused, mem);
+  }
+  dt_vkmem_t *fl = 0;
+  uint64_t pos = 0;
+  for(int i=0;i<=num_used;i++)
+  {
+    const uint64_t end = i < num_used ? used[i]->offset : a->heap_size;
+    if(end > pos)
+    {
+      assert(a->unused && "vkalloc: no more free slots!");
+      if(!a->unused) break;
+      dt_vkmem_t *mem = a->unused;
+      a->unused = DLIST_REMOVE(a->unused, mem);
+      mem->offset = mem->offset_orig = pos;
+      mem->size = end - pos;
+      mem->ref  = 0;
+      fl = DLIST_APPEND(fl, mem);
+      if(!a->free) a->free = fl;
+    }
+    if(i < num_used) pos = used[i]->offset + used[i]->size;
+  }
+  free(used);
+  assert(!dt_vkalloc_check(a));
+  return a->vmsize;
 }
 
 // feedback version of allocation:
@@ -50,6 +453,7 @@ dt_vkmem_t*
 dt_vkalloc_feedback(dt_vkalloc_t *a, uint64_t size, uint64_t alignment)
 {
   if(!alignment) alignment = 1;
+  if(a->plan_mode == 1) return plan_record(a, size, alignment, 1);
   assert(!dt_vkalloc_check(a));
   // linear scan through free list O(n)
   dt_vkmem_t *l = a->free;
@@ -116,6 +520,7 @@ dt_vkmem_t*
 dt_vkalloc(dt_vkalloc_t *a, uint64_t size, uint64_t alignment)
 {
   if(!alignment) alignment = 1;
+  if(a->plan_mode == 1) return plan_record(a, size, alignment, 0);
   // linear scan through free list O(n)
   dt_vkmem_t *l = a->free;
   while(l)
@@ -175,6 +580,12 @@ dt_vkfree(dt_vkalloc_t *a, dt_vkmem_t *mem)
   // remove from used list, put back to free list.
   a->rss -= mem->size;
   a->used = DLIST_REMOVE(a->used, mem);
+  if(a->plan_mode == 1)
+  { // recording, only remember when this happened
+    a->plan[mem->plan].end = a->plan_clock++;
+    a->unused = DLIST_PREPEND(a->unused, mem);
+    return;
+  }
   dt_vkmem_t *l = a->free;
   do
   {
@@ -12,11 +12,31 @@ typedef struct dt_vkmem_t
   uint64_t offset_orig;     // unaligned offset
   uint64_t ref  : 16;       // reference count
   uint64_t size : 48;       // only for us, the gpu will know what they asked for
+  uint32_t plan;            // index into the lifetime record, if recording
   struct dt_vkmem_t *prev;  // for alloced/free lists
   struct dt_vkmem_t *next;
 }
 dt_vkmem_t;
 
+// one allocation as seen by the lifetime recording, see dt_vkalloc_plan()
+typedef struct dt_vkalloc_plan_t
+{
+  uint64_t  size, alignment;
+  uint64_t  offset;   // planned offset
+  uint32_t  beg, end; // lifetime in allocator events, end is -1u if never freed
+  uint32_t  feedback; // needs memory of its own for the next frame too
+  uint32_t  dst;      // first copy of the offset the caller holds (will be patched), or -1u
+}
+dt_vkalloc_plan_t;
+
+// a copy of a planned offset, in a singly linked list per allocation
+typedef struct dt_vkalloc_plan_dst_t
+{
+  uint64_t *dst;
+  uint32_t  next;     // next copy of the same offset, or -1u
+}
+dt_vkalloc_plan_dst_t;
+
 typedef struct dt_vkalloc_t
 {
   dt_vkmem_t *used;
@@ -31,6 +51,16 @@ typedef struct dt_vkalloc_t
   uint64_t peak_rss;
   uint64_t rss;
   uint64_t vmsize; // <= necessary to stay within limits here!
+
+  // optional lifetime recording for static planning:
+  dt_vkalloc_plan_t *plan;  // one entry per allocation since the last nuke
+  uint32_t plan_max;        // allocated size of the above
+  uint32_t plan_cnt;        // number of recorded allocations
+  uint32_t plan_clock;      // counts allocation and free events
+  uint32_t plan_mode;       // 0 first fit only, 1 recording, 2 planned (first fit until the next nuke)
+  dt_vkalloc_plan_dst_t *plan_dst; // copies of the offsets to be patched
+  uint32_t plan_dst_max;    // allocated size of the above
+  uint32_t plan_dst_cnt;    // number of copies registered
 }
 dt_vkalloc_t;
 
@@ -47,5 +77,28 @@ void dt_vkfree(dt_vkalloc_t *a, dt_vkmem_t *mem);
 // free all the mallocs!
 void dt_vkalloc_nuke(dt_vkalloc_t *a);
 
+// switch to static planning: after every nuke, allocations and frees are only
+// recorded and all blocks get offset 0 for now. dt_vkalloc_plan() then places
+// them all at once.
+void dt_vkalloc_plan_init(dt_vkalloc_t *a);
+
+// tell the recording that the caller copied the offset of mem to dst,
+// so it can be updated after planning. any number of copies per allocation.
+void dt_vkalloc_plan_dst(dt_vkalloc_t *a, dt_vkmem_t *mem, uint64_t *dst);
+
+// static memory planning. the first fit allocator only ever sees one request
+// at a time. once a full pass of allocations and frees has been recorded, we
+// know all lifetimes up front. feedback blocks are stacked at the bottom, the
+// rest is placed in two ways and the smaller footprint wins:
+// - largest blocks first, each at the lowest offset that doesn't overlap any
+//   block placed before with an overlapping lifetime (greedy by size, O(n^2))
+// - sweeping through the events in order, each allocation in the smallest
+//   gap that fits (best fit on the live blocks only, O(n log n))
+// this writes the offsets to the blocks still in use and to everything
+// registered via dt_vkalloc_plan_dst(), sets vmsize and rebuilds the free
+// list so the allocator can be used as usual until the next nuke.
+// returns the new vmsize.
+uint64_t dt_vkalloc_plan(dt_vkalloc_t *a);
+
 // perform an (expensive) internal consistency check in O(n^2)
 int dt_vkalloc_check(dt_vkalloc_t *a);
@@ -3,8 +3,11 @@ pipe/alloc.o\
 pipe/connector.o\
 pipe/global.o\
 pipe/graph.o\
+pipe/graph-batch.o\
+pipe/graph-checkpoint.o\
 pipe/graph-io.o\
 pipe/graph-export.o\
+pipe/graph-tile.o\
 pipe/module.o\
 pipe/raytrace.o
 PIPE_H=\
@@ -16,9 +19,12 @@ pipe/dlist.h\
 pipe/draw.h\
 pipe/global.h\
 pipe/graph.h\
+pipe/graph-batch.h\
+pipe/graph-checkpoint.h\
 pipe/graph-io.h\
 pipe/graph-print.h\
 pipe/graph-export.h\
+pipe/graph-tile.h\
 pipe/graph-traverse.inc\
 pipe/modules/api.h\
 pipe/io.h\
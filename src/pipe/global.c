@@ -397,6 +397,8 @@ int dt_pipe_global_init()
   // setup search directory
   fs_basedir(dt_pipe.basedir, sizeof(dt_pipe.basedir));
   fs_homedir(dt_pipe.homedir, sizeof(dt_pipe.homedir));
+  threads_mutex_init(&dt_pipe.shader_mutex, 0);
+  threads_mutex_init(&dt_pipe.module_mutex, 0);
   char mod[PATH_MAX+20];
   snprintf(mod, sizeof(mod), "%s/modules", dt_pipe.basedir);
   struct dirent *dp;
@@ -414,12 +416,21 @@ int dt_pipe_global_init()
   i = 0;
   rewinddir(fd);
   while((dp = readdir(fd)))
-  {
-    if(dp->d_type == DT_DIR)
+  { // only register the names here. dlopen and parsing the params is
+    // deferred to dt_pipe_get_module(), most graphs only use a few modules.
+    if(dp->d_type != DT_DIR) continue;
+    if(!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..") || !strcmp(dp->d_name, "shared"))
+      continue;
+    char filename[3*PATH_MAX];
+    struct stat statbuf;
+    snprintf(filename, sizeof(filename), "%s/%s/connectors", mod, dp->d_name);
+    if(stat(filename, &statbuf))
     {
-      int err = dt_module_so_load(dt_pipe.module + i, dp->d_name);
-      if(!err) i++;
+      dt_log(s_log_pipe, "module %s has no connectors!", dp->d_name);
+      continue; // error, can't have zero connectors.
     }
+    memset(dt_pipe.module + i, 0, sizeof(dt_pipe.module[0]));
+    dt_pipe.module[i++].name = dt_token(dp->d_name);
   }
   dt_pipe.num_modules = i;
   closedir(fd);
@@ -428,10 +439,44 @@ int dt_pipe_global_init()
   return 0;
 }
 
+dt_module_so_t *
+dt_pipe_get_module(dt_token_t name)
+{
+  dt_module_so_t key = { .name = name };
+  dt_module_so_t *mod = bsearch(&key, dt_pipe.module, dt_pipe.num_modules,
+      sizeof(dt_pipe.module[0]), &compare_module_name);
+  if(!mod) return 0;
+  if(!__atomic_load_n(&mod->loaded, __ATOMIC_ACQUIRE))
+  {
+    threads_mutex_lock(&dt_pipe.module_mutex);
+    if(!mod->loaded)
+    { // first time, go to disk
+      char dirname[9] = {0};
+      memcpy(dirname, dt_token_str(name), 8);
+      int err = dt_module_so_load(mod, dirname);
+      if(err)
+      { // free what we might have, but keep the name around
+        dt_module_so_unload(mod);
+        memset(mod, 0, sizeof(*mod));
+        mod->name = name;
+      }
+      __atomic_store_n(&mod->loaded, err ? -1 : 1, __ATOMIC_RELEASE);
+    }
+    threads_mutex_unlock(&dt_pipe.module_mutex);
+  }
+  return mod->loaded > 0 ? mod : 0;
+}
+
 void dt_pipe_global_cleanup()
 {
   for(int i=0;i<dt_pipe.num_modules;i++)
-    dt_module_so_unload(dt_pipe.module + i);
+    if(dt_pipe.module[i].loaded > 0)
+      dt_module_so_unload(dt_pipe.module + i);
   free(dt_pipe.module);
+  for(int i=0;i<dt_pipe.num_shaders;i++)
+    free(dt_pipe.shader[i].data);
+  free(dt_pipe.shader);
+  threads_mutex_destroy(&dt_pipe.shader_mutex);
+  threads_mutex_destroy(&dt_pipe.module_mutex);
   memset(&dt_pipe, 0, sizeof(dt_pipe));
 }
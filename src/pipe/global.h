@@ -4,6 +4,7 @@
 #include "params.h"
 #include "connector.h"
 #include "graph-fwd.h"
+#include "core/threads.h"
 #include <limits.h>
 
 // static global structs to keep around for all instances of pipelines.
@@ -55,13 +56,14 @@ typedef void (*dt_module_input_t)(dt_module_t *module, dt_module_input_event_t *
 typedef dt_graph_run_t (*dt_module_check_params_t)(dt_module_t *module, uint32_t parid, void *oldval);
 
 // this is all the "class" info that is not bound to an instance and can be
-// read once on startup
+// read once on first use, see dt_pipe_get_module()
 typedef struct dt_module_so_t
 {
   dt_token_t name;
 
   // for dlopen state
   void *dlhandle;
+  int   loaded; // 0: only the name is known, 1: dlopened and parsed, -1: failed to load
 
   // pass full image forward through pipe, init roi.full_{wd,ht}
   // this is also responsible of initing the img_params struct correctly
@@ -115,6 +117,17 @@ typedef struct dt_module_so_t
 }
 dt_module_so_t;
 
+// spir-v code of one kernel, read once per process
+typedef struct dt_pipe_shader_t
+{
+  dt_token_t module;  // module name
+  dt_token_t kernel;  // kernel name
+  dt_token_t stage;   // comp, vert, geom, frag
+  size_t     len;     // size of code in bytes
+  void      *data;    // spir-v code, or 0 if the file does not exist
+}
+dt_pipe_shader_t;
+
 typedef struct dt_pipe_global_t
 {
   // this is the directory where the vkdt binary resides,
@@ -123,8 +136,15 @@ typedef struct dt_pipe_global_t
   // relative to it, i.e. data/ and modules/.
   char basedir[PATH_MAX];
   char homedir[PATH_MAX]; // this is normally ${HOME}/.config/vkdt
-  dt_module_so_t *module;
+  dt_module_so_t *module;    // sorted by name, only the name is valid until loaded
   uint32_t num_modules;
+  threads_mutex_t module_mutex; // protects lazy loading of the modules
+
+  // cache of shader code, so graphs don't go to disk every time they create nodes
+  threads_mutex_t   shader_mutex;
+  dt_pipe_shader_t *shader;
+  uint32_t          num_shaders;
+  uint32_t          max_shaders;
 }
 dt_pipe_global_t;
 
@@ -135,3 +155,8 @@ int dt_pipe_global_init();
 
 // global cleanup:
 void dt_pipe_global_cleanup();
+
+// returns the module class by name, or 0 if there is no such module. the
+// module's shared object and parameter files are loaded on first request.
+// thread safe.
+dt_module_so_t *dt_pipe_get_module(dt_token_t name);
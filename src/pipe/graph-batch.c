@@ -0,0 +1,158 @@
+#include "pipe/graph-batch.h"
+#include "core/core.h"
+#include "core/log.h"
+#include "core/profile.h"
+#include "core/threads.h"
+#include "qvk/qvk.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the thread pool task of a worker only holds on to this. the first of the
+// pool task and dt_graph_batch_wait() to claim it runs the worker, so a task
+// that never started doesn't hold up the wait, and one that starts late
+// finds it claimed and doesn't touch the batch any more.
+typedef struct batch_ticket_t
+{
+  dt_graph_batch_worker_t *w;
+  atomic_uint              claimed;
+  atomic_uint              ref;     // pool task + batch
+}
+batch_ticket_t;
+
+static void
+batch_ticket_unref(batch_ticket_t *t)
+{
+  if(atomic_fetch_sub(&t->ref, 1) == 1) free(t);
+}
+
+static void
+batch_work(uint32_t item, dt_graph_batch_worker_t *w)
+{
+  dt_graph_batch_t *b = w->batch;
+  if(b->abort) return;
+
+  dt_graph_export_t param = {0};
+  w->cfgfile[0] = 0;
+  if(b->param(b->data, item, w, &param)) return;
+  param.pipeline = 0; // we are on a worker thread already
+
+  const double beg = dt_time();
+  VkResult res = dt_graph_export(&w->graph, &param);
+  dt_profile_span("pipe", "batch export", beg, dt_time());
+  if(res != VK_SUCCESS)
+  {
+    dt_log(s_log_err, "[batch] exporting %s failed!", w->cfgfile);
+    __atomic_add_fetch(&b->failed, 1, __ATOMIC_SEQ_CST);
+  }
+  if(b->done) b->done(b->data, item, w, res);
+  // no reset here: if the next item has the same structure, dt_graph_export
+  // will keep the nodes and memory of this one.
+}
+
+// take items until there are none left, then clean up the graph
+static void
+batch_worker(batch_ticket_t *t)
+{
+  if(atomic_exchange(&t->claimed, 1)) return; // somebody else runs this one
+  dt_graph_batch_worker_t *w = t->w;
+  dt_graph_batch_t *b = w->batch;
+  __atomic_add_fetch(&b->running, 1, __ATOMIC_SEQ_CST);
+  while(1)
+  {
+    const uint32_t item = __atomic_fetch_add(&b->next, 1, __ATOMIC_SEQ_CST);
+    if(item >= b->cnt) break;
+    batch_work(item, w);
+    __atomic_add_fetch(&b->finished, 1, __ATOMIC_SEQ_CST);
+  }
+  dt_graph_cleanup(&w->graph);
+  __atomic_sub_fetch(&b->running, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&b->workers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+batch_task(uint32_t item, void *arg)
+{
+  batch_ticket_t *t = arg;
+  batch_worker(t);
+  batch_ticket_unref(t);
+}
+
+int
+dt_graph_batch_start(
+    dt_graph_batch_t       *b,
+    uint32_t                cnt,
+    int                     graph_cnt,
+    dt_graph_batch_param_t  param,
+    dt_graph_batch_done_t   done,
+    void                   *data)
+{
+  b->cnt       = cnt;
+  b->graph_cnt = CLAMP(graph_cnt, 1, MIN(DT_GRAPH_BATCH_MAX, threads_num()));
+  b->graph_cnt = MIN(b->graph_cnt, (int)cnt);
+  b->next      = 0;
+  b->finished  = 0;
+  b->abort     = 0;
+  b->failed    = 0;
+  b->running   = 0;
+  b->workers   = 0;
+  b->param     = param;
+  b->done      = done;
+  b->data      = data;
+  memset(b->ticket, 0, sizeof(b->ticket));
+  if(!cnt || !param) return -1;
+  for(int k=0;k<b->graph_cnt;k++)
+  {
+    batch_ticket_t *t = malloc(sizeof(*t));
+    if(!t) { b->graph_cnt = k; break; }
+    dt_graph_batch_worker_t *w = b->worker + k;
+    w->batch = b;
+    dt_graph_init(&w->graph);
+    // share the two work queues with the thumbnail creation, these
+    // come with a mutex so we can submit from several threads:
+    w->graph.queue       = (k & 1) ?  qvk.queue_work1       :  qvk.queue_work0;
+    w->graph.queue_idx   = (k & 1) ?  qvk.queue_idx_work1   :  qvk.queue_idx_work0;
+    w->graph.queue_mutex = (k & 1) ? &qvk.queue_work1_mutex : &qvk.queue_work0_mutex;
+    t->w = w;
+    atomic_init(&t->claimed, 0);
+    atomic_init(&t->ref, 2);
+    b->ticket[k] = t;
+    b->workers++;
+  }
+  if(!b->graph_cnt) return -1;
+  for(int k=0;k<b->graph_cnt;k++) // independent tasks, if the pool is busy dt_graph_batch_wait() does the work
+    if(threads_task("batch", 1, -1, b->ticket[k], batch_task, 0) < 0)
+      batch_ticket_unref(b->ticket[k]);
+  return 0;
+}
+
+int
+dt_graph_batch_running(dt_graph_batch_t *b)
+{
+  return __atomic_load_n(&b->running, __ATOMIC_SEQ_CST) > 0 ||
+    (!b->abort && __atomic_load_n(&b->finished, __ATOMIC_SEQ_CST) < b->cnt);
+}
+
+float
+dt_graph_batch_progress(dt_graph_batch_t *b)
+{
+  if(!b->cnt) return 1.0f;
+  return __atomic_load_n(&b->finished, __ATOMIC_SEQ_CST) / (float)b->cnt;
+}
+
+int
+dt_graph_batch_wait(dt_graph_batch_t *b)
+{
+  for(int k=0;k<DT_GRAPH_BATCH_MAX;k++)
+  { // run the workers the thread pool didn't get to on this thread
+    batch_ticket_t *t = b->ticket[k];
+    if(!t) continue;
+    batch_worker(t);
+    batch_ticket_unref(t);
+    b->ticket[k] = 0;
+  }
+  while(__atomic_load_n(&b->workers, __ATOMIC_SEQ_CST) > 0) sched_yield(); // others may still be running
+  return b->failed;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "pipe/graph.h"
+#include "pipe/graph-export.h"
+#include <limits.h>
+
+// batch export: work through a list of export jobs with a few graphs in
+// parallel, one per worker thread. this way the decoding of one image, gpu
+// processing of another and encoding of a third overlap, instead of running
+// one image after the other. used by vkdt-cli --batch and the lighttable.
+
+#define DT_GRAPH_BATCH_MAX 4     // max number of graphs in flight
+#define DT_GRAPH_BATCH_OUTPUTS 4 // max number of output files per item
+
+typedef struct dt_graph_batch_t dt_graph_batch_t;
+
+typedef struct dt_graph_batch_worker_t
+{
+  dt_graph_batch_t *batch;
+  dt_graph_t        graph;
+  char              cfgfile[PATH_MAX];  // storage for the parameter callback
+  char              filename[DT_GRAPH_BATCH_OUTPUTS][PATH_MAX];
+}
+dt_graph_batch_worker_t;
+
+// fill the export parameters for the given item. strings can be stored in
+// the worker's cfgfile/filename buffers. return non-zero to skip this item.
+typedef int (*dt_graph_batch_param_t)(
+    void                    *data,
+    uint32_t                 item,
+    dt_graph_batch_worker_t *worker,
+    dt_graph_export_t       *param);
+
+// optional, called after every item that has been exported or failed
+typedef void (*dt_graph_batch_done_t)(
+    void                    *data,
+    uint32_t                 item,
+    dt_graph_batch_worker_t *worker,
+    VkResult                 res);
+
+struct dt_graph_batch_t
+{
+  uint32_t                cnt;         // number of items
+  int                     graph_cnt;   // number of graphs working in parallel
+  uint32_t                next;        // next item to be taken by a worker
+  uint32_t                finished;    // number of items done or skipped
+  volatile int            abort;       // set to non-zero to stop after the current images
+  int                     running;     // number of workers busy exporting or cleaning up
+  int                     workers;     // number of workers which haven't cleaned up yet
+  int                     failed;      // number of failed exports
+  dt_graph_batch_param_t  param;
+  dt_graph_batch_done_t   done;
+  void                   *data;        // passed to the callbacks
+  dt_graph_batch_worker_t worker[DT_GRAPH_BATCH_MAX];
+  void                   *ticket[DT_GRAPH_BATCH_MAX]; // shared with the thread pool tasks
+};
+
+// start exporting cnt items in the background on up to graph_cnt graphs.
+// every graph is pushed to the thread pool as a task of its own. the ones the
+// pool doesn't pick up are run by dt_graph_batch_wait(), which has to be
+// called before the struct is reused or goes away.
+// returns 0 or something < 0 on error.
+int dt_graph_batch_start(
+    dt_graph_batch_t       *b,
+    uint32_t                cnt,
+    int                     graph_cnt,
+    dt_graph_batch_param_t  param,
+    dt_graph_batch_done_t   done,
+    void                   *data);
+
+// returns non-zero while items are left or workers are busy
+int dt_graph_batch_running(dt_graph_batch_t *b);
+
+// fraction of items done
+float dt_graph_batch_progress(dt_graph_batch_t *b);
+
+// work on the items on this thread if the pool didn't start all graphs, and
+// block until all is done and cleaned up. returns the number of failed items.
+int dt_graph_batch_wait(dt_graph_batch_t *b);
@@ -0,0 +1,334 @@
+#include "pipe/graph-checkpoint.h"
+#include "pipe/modules/api.h"
+#include "core/log.h"
+#include "core/fs.h"
+#include "core/lut.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// evict the least recently used entries when the cache grows larger than this
+#define DT_CHECKPOINT_MAX (8ul<<30)
+
+static inline uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t len)
+{ // fnv-1a, params are binary so we can't stop at zero bytes
+  const uint8_t *c = data;
+  for(size_t i=0;i<len;i++) hash = (hash ^ c[i]) * 1099511628211ul;
+  return hash;
+}
+
+static inline uint64_t
+hash_u64(uint64_t hash, uint64_t v)
+{
+  return hash_bytes(hash, &v, sizeof(v));
+}
+
+// mix in everything the output of this module depends on, recursively for all
+// modules upstream. returns 0 if something can't be cached.
+static uint64_t
+hash_module(dt_graph_t *graph, int m, uint64_t hash, int depth)
+{
+  if(depth > 100) return 0; // something is wrong, don't loop forever
+  dt_module_t *mod = graph->module + m;
+  hash = hash_u64(hash, mod->name);
+  hash = hash_u64(hash, mod->inst);
+  hash = hash_u64(hash, mod->version);
+  hash = hash_u64(hash, mod->disabled);
+  if(mod->param_size) hash = hash_bytes(hash, mod->param, mod->param_size);
+  for(int p=0;p<mod->so->num_params;p++)
+  { // files referenced by name may change behind our back: input images, luts, ..
+    if(mod->so->param[p]->type != dt_token("string")) continue;
+    const char *str = dt_module_param_string(mod, p);
+    if(!str || !str[0]) continue;
+    FILE *f = dt_graph_open_resource(graph, 0, str, "rb");
+    if(!f) continue;
+    struct stat statbuf;
+    if(!fstat(fileno(f), &statbuf))
+    {
+      hash = hash_u64(hash, statbuf.st_size);
+      hash = hash_u64(hash, statbuf.st_mtim.tv_sec);
+      hash = hash_u64(hash, statbuf.st_mtim.tv_nsec);
+    }
+    fclose(f);
+  }
+  for(int c=0;c<mod->num_connectors;c++)
+  {
+    dt_connector_t *cn = mod->connector + c;
+    if(!dt_connector_input(cn) || cn->connected_mi < 0) continue;
+    if(cn->flags & s_conn_feedback) return 0; // depends on the previous frame
+    hash = hash_u64(hash, c);
+    hash = hash_u64(hash, cn->connected_mc);
+    hash = hash_module(graph, cn->connected_mi, hash, depth+1);
+    if(!hash) return 0;
+  }
+  return hash;
+}
+
+// returns the output connector to be cached, or -1
+static int
+checkpoint_connector(dt_graph_t *graph, dt_module_t *module)
+{
+  const int mc = dt_module_get_connector(module, dt_token("output"));
+  if(mc < 0) return -1;
+  const dt_connector_t *c = module->connector + mc;
+  if(c->format != dt_token("f16") && c->format != dt_token("f32")) return -1;
+  if(c->chan == dt_token("ssbo") || c->array_length > 1 || c->frames > 1) return -1;
+  if(!c->roi.wd || !c->roi.ht) return -1;
+  // we only replace this one output, nobody may use the others:
+  const int modid = module - graph->module;
+  for(int m=0;m<graph->num_modules;m++)
+    for(int i=0;i<graph->module[m].num_connectors;i++)
+      if(dt_connector_input(graph->module[m].connector+i) &&
+         graph->module[m].connector[i].connected_mi == modid &&
+         graph->module[m].connector[i].connected_mc != mc)
+        return -1;
+  return mc;
+}
+
+static void
+checkpoint_filename(uint64_t key, char *filename, size_t size)
+{
+  char cachedir[PATH_MAX];
+  fs_cachedir(cachedir, sizeof(cachedir));
+  snprintf(filename, size, "%s/nodes/%016lx.lut", cachedir, key);
+}
+
+// returns non-zero if the file holds a complete image for this connector.
+// broken entries are removed, so we create the real nodes instead.
+static int
+checkpoint_valid(const char *filename, const dt_connector_t *c)
+{
+  FILE *f = fopen(filename, "rb");
+  if(!f) return 0; // not cached yet
+  dt_lut_header_t header;
+  struct stat statbuf;
+  const size_t bytes = dt_connector_bufsize(c, c->roi.wd, c->roi.ht);
+  int valid = fread(&header, sizeof(header), 1, f) == 1 &&
+     !fstat(fileno(f), &statbuf) &&
+     statbuf.st_size >= (off_t)(sizeof(header) + bytes) &&
+     header.magic    == dt_lut_header_magic &&
+     header.version  == dt_lut_header_version &&
+     header.channels == dt_connector_channels(c) &&
+     header.wd       == c->roi.wd &&
+     header.ht       == c->roi.ht;
+  fclose(f);
+  if(!valid)
+  {
+    dt_log(s_log_pipe|s_log_err, "[checkpoint] removing broken %s", filename);
+    unlink(filename);
+  }
+  else utimensat(AT_FDCWD, filename, 0, 0); // mark as recently used for eviction
+  return valid;
+}
+
+typedef struct checkpoint_entry_t
+{
+  char   name[32];
+  off_t  size;
+  time_t mtime;
+}
+checkpoint_entry_t;
+
+static int
+compare_mtime(const void *a, const void *b)
+{
+  const checkpoint_entry_t *ea = a, *eb = b;
+  return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+// delete the oldest entries until the cache fits into DT_CHECKPOINT_MAX again
+static void
+checkpoint_evict(const char *dirname)
+{
+  DIR *dp = opendir(dirname);
+  if(!dp) return;
+  int cnt = 0, max = 0;
+  checkpoint_entry_t *entry = 0;
+  uint64_t total = 0;
+  char filename[PATH_MAX+64];
+  struct dirent *ep;
+  while((ep = readdir(dp)))
+  {
+    const size_t len = strlen(ep->d_name);
+    if(len < 4 || len >= sizeof(entry->name) || strcmp(ep->d_name + len - 4, ".lut")) continue;
+    struct stat statbuf;
+    snprintf(filename, sizeof(filename), "%s/%s", dirname, ep->d_name);
+    if(stat(filename, &statbuf)) continue;
+    if(cnt >= max)
+    {
+      max = MAX(64, 2*max);
+      checkpoint_entry_t *grown = realloc(entry, sizeof(*entry)*max);
+      if(!grown) break;
+      entry = grown;
+    }
+    memcpy(entry[cnt].name, ep->d_name, len+1);
+    entry[cnt].size  = statbuf.st_size;
+    entry[cnt].mtime = statbuf.st_mtim.tv_sec;
+    total += statbuf.st_size;
+    cnt++;
+  }
+  closedir(dp);
+  if(total > DT_CHECKPOINT_MAX)
+  {
+    qsort(entry, cnt, sizeof(*entry), compare_mtime);
+    for(int i=0;i<cnt && total > DT_CHECKPOINT_MAX;i++)
+    {
+      snprintf(filename, sizeof(filename), "%s/%s", dirname, entry[i].name);
+      if(!unlink(filename)) total -= entry[i].size;
+    }
+  }
+  free(entry);
+}
+
+int
+dt_graph_checkpoint_cnt(dt_graph_t *graph)
+{
+  int cnt = 0;
+  for(int m=0;m<graph->num_modules;m++)
+    cnt += graph->module[m].name && graph->module[m].checkpoint;
+  return cnt;
+}
+
+int
+dt_graph_checkpoint_read_nodes(dt_graph_t *graph, dt_module_t *module)
+{
+  module->checkpoint_key = 0;
+  if(graph->gui_attached || graph->frame_cnt > 1 || module->disabled) return 0;
+  if(graph->tile.wd) return 0; // the key doesn't know where the tile is
+  const int mc = checkpoint_connector(graph, module);
+  if(mc < 0) return 0;
+  const dt_connector_t *c = module->connector + mc;
+  uint64_t key = hash_module(graph, module - graph->module, 1469598103934665603ul, 0);
+  if(!key) return 0;
+  key = hash_u64(key, dt_lut_header_version);
+  key = hash_u64(key, c->roi.wd);
+  key = hash_u64(key, c->roi.ht);
+  key = hash_u64(key, c->chan);
+  key = hash_u64(key, c->format);
+  module->checkpoint_key = key;
+
+  char filename[PATH_MAX];
+  checkpoint_filename(key, filename, sizeof(filename));
+  if(!checkpoint_valid(filename, c)) return 0;
+
+  if(graph->num_nodes >= graph->max_nodes) return 0;
+  const int nodeid = graph->num_nodes++;
+  graph->node[nodeid] = (dt_node_t) {
+    .name           = module->name,
+    .kernel         = dt_token("ckpt"),
+    .module         = module,
+    .num_connectors = 1,
+    .type           = s_node_compute,
+  };
+  dt_connector_copy(graph, module, mc, nodeid, 0);
+  graph->node[nodeid].connector[0].type = dt_token("source");
+  dt_log(s_log_pipe, "[checkpoint] %"PRItkn" %"PRItkn" reads %s",
+      dt_token_str(module->name), dt_token_str(module->inst), filename);
+  return 1;
+}
+
+void
+dt_graph_checkpoint_write_nodes(dt_graph_t *graph, dt_module_t *module)
+{
+  if(!module->checkpoint_key) return;
+  const int mc = dt_module_get_connector(module, dt_token("output"));
+  if(module->connector[mc].associated_i < 0) return; // bypassed
+  if(graph->num_nodes >= graph->max_nodes) return;
+  const int nodeid = graph->num_nodes++;
+  graph->node[nodeid] = (dt_node_t) {
+    .name           = module->name,
+    .kernel         = dt_token("ckpt"),
+    .module         = module,
+    .num_connectors = 1,
+    .type           = s_node_compute,
+  };
+  dt_connector_t *c = graph->node[nodeid].connector;
+  *c = (dt_connector_t) {
+    .name         = dt_token("input"),
+    .type         = dt_token("sink"),
+    .chan         = module->connector[mc].chan,
+    .format       = module->connector[mc].format,
+    .roi          = module->connector[mc].roi,
+    .connected_mi = module->connector[mc].associated_i, // directly on node level
+    .connected_mc = module->connector[mc].associated_c,
+    .associated_i = -1,
+    .associated_c = -1,
+  };
+}
+
+int
+dt_graph_checkpoint_read(dt_node_t *node, void *mapped)
+{
+  const dt_connector_t *c = node->connector;
+  char filename[PATH_MAX];
+  checkpoint_filename(node->module->checkpoint_key, filename, sizeof(filename));
+  FILE *f = fopen(filename, "rb");
+  if(!f) goto error;
+  dt_lut_header_t header;
+  const size_t bytes = dt_connector_bufsize(c, c->roi.wd, c->roi.ht);
+  if(fread(&header, sizeof(header), 1, f) != 1 ||
+     header.magic    != dt_lut_header_magic ||
+     header.version  != dt_lut_header_version ||
+     header.channels != dt_connector_channels(c) ||
+     header.wd       != c->roi.wd ||
+     header.ht       != c->roi.ht ||
+     fread(mapped, bytes, 1, f) != 1)
+  {
+    fclose(f);
+    unlink(filename); // don't trip over it next time
+    goto error;
+  }
+  fclose(f);
+  return 0;
+error:
+  dt_log(s_log_pipe|s_log_err, "[checkpoint] could not read %s!", filename);
+  return 1;
+}
+
+int
+dt_graph_checkpoint_write(dt_node_t *node, const void *mapped)
+{
+  const dt_connector_t *c = node->connector;
+  char filename[PATH_MAX], tmpname[PATH_MAX+64];
+  checkpoint_filename(node->module->checkpoint_key, filename, sizeof(filename));
+  if(!access(filename, R_OK)) return 0; // someone was faster
+  char dirname[PATH_MAX];
+  fs_cachedir(dirname, sizeof(dirname));
+  fs_mkdir(dirname, 0755);
+  strncat(dirname, "/nodes", sizeof(dirname)-strlen(dirname)-1);
+  fs_mkdir(dirname, 0755); // ignore errors, will exist most of the time
+
+  dt_lut_header_t header = {
+    .magic    = dt_lut_header_magic,
+    .version  = dt_lut_header_version,
+    .channels = dt_connector_channels(c),
+    .datatype = c->format == dt_token("f32") ? dt_lut_header_f32 : dt_lut_header_f16,
+    .wd       = c->roi.wd,
+    .ht       = c->roi.ht,
+  };
+  // write to a temporary file first, other processes may read the cache concurrently:
+  snprintf(tmpname, sizeof(tmpname), "%s.%d.%p", filename, getpid(), (void *)node);
+  FILE *f = fopen(tmpname, "wb");
+  if(!f) goto error;
+  const size_t bytes = dt_connector_bufsize(c, c->roi.wd, c->roi.ht);
+  int err = fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(mapped, bytes, 1, f) != 1;
+  err |= fclose(f);
+  if(err || rename(tmpname, filename))
+  {
+    unlink(tmpname);
+    goto error;
+  }
+  dt_log(s_log_pipe, "[checkpoint] %"PRItkn" %"PRItkn" wrote %s",
+      dt_token_str(node->module->name), dt_token_str(node->module->inst), filename);
+  checkpoint_evict(dirname);
+  return 0;
+error:
+  dt_log(s_log_pipe|s_log_err, "[checkpoint] could not write %s!", filename);
+  return 1;
+}
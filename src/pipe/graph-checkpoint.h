@@ -0,0 +1,42 @@
+#pragma once
+#include "pipe/graph.h"
+
+// disk cache for the output of expensive modules across sessions. modules
+// like align, denoise, the burst merge or the cnn only depend on their inputs
+// and params, so a module instance can opt in by a line
+//
+//   checkpoint:denoise:01
+//
+// in the config. when creating nodes, everything upstream of the module is
+// hashed (module names, params, connections, size and date of all files in
+// string params such as the input image, and the roi of the output). if
+// ~/.cache/vkdt/nodes/<hash>.lut exists, the nodes of the module are replaced
+// by a single source node reading it and no node upstream runs any more
+// (the modules still compute their rois, so the input module may still open
+// its file to find the image size). broken files are removed and the real
+// nodes are created instead. if the file can't be read later on, the run
+// fails. if there is no file, a sink node is added which writes it when the
+// graph is run with s_graph_run_download_sink, i.e. during export. the
+// least recently used files are evicted when the cache grows over 8GB.
+//
+// only still images without a gui attached and not run in tiles are cached, and only outputs that
+// come as f16 or f32 images, which is what the .lut format can hold. the
+// nodes have the kernel name "ckpt".
+
+// number of module instances that ask for their output to be cached
+int dt_graph_checkpoint_cnt(dt_graph_t *graph);
+
+// called instead of creating the nodes of a module. computes
+// module->checkpoint_key and returns non-zero if the cached output has been
+// found and a source node reading it was created.
+int dt_graph_checkpoint_read_nodes(dt_graph_t *graph, dt_module_t *module);
+
+// called after the module created its nodes. adds a sink node writing the
+// output to the cache if module->checkpoint_key is set.
+void dt_graph_checkpoint_write_nodes(dt_graph_t *graph, dt_module_t *module);
+
+// read the cached output of a "ckpt" source node into mapped staging memory
+int dt_graph_checkpoint_read(dt_node_t *node, void *mapped);
+
+// write the staging memory of a "ckpt" sink node to the cache
+int dt_graph_checkpoint_write(dt_node_t *node, const void *mapped);
@@ -1,14 +1,21 @@
 #include "core/log.h"
 #include "core/fs.h"
+#include "core/profile.h"
+#include "db/hash.h"
 #include "pipe/graph.h"
 #include "pipe/graph-io.h"
 #include "pipe/graph-print.h"
 #include "pipe/graph-export.h"
+#include "pipe/graph-checkpoint.h"
+#include "pipe/graph-tile.h"
 #include "pipe/graph-defaults.h"
 #include "pipe/modules/api.h"
+#include "core/threads.h"
+#include "qvk/qvk.h"
 
 #include <libgen.h>
 #include <unistd.h>
+#include <stdlib.h>
 
 // export convenience functions, see cli/main.c
 
@@ -79,12 +86,280 @@ dt_graph_disconnect_display_modules(
       dt_module_remove(graph, m); // disconnect and reset/ignore
 }
 
+// pipelined animation export: while the gpu is busy with frame f+1, frame f
+// is encoded by the thread pool. the sink data is copied out of the shared
+// staging buffer into a small ring of host buffers, together with a snapshot
+// of the output module (so the filename param can move on to the next frame).
+// only the encoding overlaps: every frame is still run with
+// s_graph_run_wait_done, so there is never more than one frame on the gpu.
+#define DT_GRAPH_EXPORT_RING 4 // max number of frames in flight for encoding
+
+typedef struct dt_graph_export_job_t
+{
+  int          taskid;        // thread pool task encoding this slot, or -1
+  int          cnt;           // number of sinks in this job
+  int          max;           // allocated number of sinks
+  dt_module_t *mod;           // snapshots of the output modules
+  uint8_t    **param;         // private copy of the params of every module
+  uint8_t    **buf;           // sink data, copied from staging
+  size_t      *buf_size;      // allocation size of the buffers above
+}
+dt_graph_export_job_t;
+
+static void
+export_job_work(uint32_t item, void *arg)
+{
+  dt_graph_export_job_t *j = arg;
+  const double beg = dt_time();
+  j->mod[item].so->write_sink(j->mod + item, j->buf[item]);
+  if(dt_profile_active())
+  { // same span as the synchronous write_sink in dt_graph_run, on this worker's track
+    char name[64];
+    snprintf(name, sizeof(name), "write_sink %"PRItkn" %"PRItkn,
+        dt_token_str(j->mod[item].name), dt_token_str(j->mod[item].inst));
+    dt_profile_span("pipe", name, beg, dt_time());
+  }
+}
+
+// returns non-zero if all sinks that will need a download are safe to be written
+// out of order on a worker thread. that is the case for o-* modules that don't
+// keep a stream open (those request write_sink explicitly and stay synchronous).
+static int
+export_can_pipeline(dt_graph_t *graph)
+{
+  int cnt = 0;
+  for(int m=0;m<graph->num_modules;m++)
+  {
+    dt_module_t *mod = graph->module + m;
+    if(!mod->name || !mod->so->write_sink) continue;
+    if(mod->connector[0].type != dt_token("sink")) continue;
+    if(mod->flags & s_module_request_write_sink) continue; // handled by dt_graph_run
+    if(strncmp(dt_token_str(mod->name), "o-", 2)) return 0; // may touch the graph
+    cnt++;
+  }
+  return cnt;
+}
+
+static void
+export_job_wait(dt_graph_export_job_t *j)
+{ // workers only wake up on a push, if they were all busy nobody may have
+  // started on this yet. encode the rest here instead of waiting for them:
+  if(j->taskid >= 0) threads_help(j->taskid);
+  j->taskid = -1;
+}
+
+static void
+export_job_cleanup(dt_graph_export_job_t *j)
+{
+  export_job_wait(j);
+  for(int i=0;i<j->max;i++)
+  {
+    free(j->param[i]);
+    free(j->buf[i]);
+  }
+  free(j->mod);
+  free(j->param);
+  free(j->buf);
+  free(j->buf_size);
+  memset(j, 0, sizeof(*j));
+  j->taskid = -1;
+}
+
+// copy all sinks of the last frame out of staging memory and push a job to
+// encode them. expects the frame to be done on the gpu (s_graph_run_wait_done).
+static VkResult
+export_job_submit(dt_graph_t *graph, dt_graph_export_job_t *j)
+{
+  export_job_wait(j); // wait for the ring slot to become available
+  if(j->max < graph->num_nodes)
+  {
+    int max = graph->num_nodes;
+    j->mod      = realloc(j->mod,      sizeof(dt_module_t)*max);
+    j->param    = realloc(j->param,    sizeof(uint8_t*)*max);
+    j->buf      = realloc(j->buf,      sizeof(uint8_t*)*max);
+    j->buf_size = realloc(j->buf_size, sizeof(size_t)*max);
+    for(int i=j->max;i<max;i++) { j->param[i] = 0; j->buf[i] = 0; j->buf_size[i] = 0; }
+    j->max = max;
+  }
+  uint8_t *mapped = 0;
+  QVKR(vkMapMemory(qvk.device, graph->vkmem_staging, 0, VK_WHOLE_SIZE, 0, (void**)&mapped));
+  j->cnt = 0;
+  for(int n=0;n<graph->num_nodes;n++)
+  {
+    dt_node_t *node = graph->node + n;
+    if(!dt_node_sink(node) || !node->module->so->write_sink) continue;
+    if(node->module->flags & s_module_request_write_sink) continue;
+    const int i = j->cnt++;
+    const size_t size = node->connector[0].size_staging;
+    if(j->buf_size[i] < size)
+    {
+      free(j->buf[i]);
+      j->buf[i] = malloc(size);
+      j->buf_size[i] = size;
+    }
+    memcpy(j->buf[i], mapped + node->connector[0].offset_staging, size);
+    j->mod[i] = *node->module;
+    j->param[i] = realloc(j->param[i], node->module->param_size);
+    memcpy(j->param[i], node->module->param, node->module->param_size);
+    j->mod[i].param = j->param[i];
+  }
+  vkUnmapMemory(qvk.device, graph->vkmem_staging);
+  if(!j->cnt) return VK_SUCCESS;
+  j->taskid = threads_task("export", j->cnt, -1, j, export_job_work, 0);
+  if(j->taskid < 0)
+  { // thread pool is busy, encode inline
+    for(int i=0;i<j->cnt;i++) export_job_work(i, j);
+    j->taskid = -1;
+  }
+  return VK_SUCCESS;
+}
+
+// returns non-zero if any connection carries data over from one frame to the next
+static int
+export_has_feedback(dt_graph_t *graph)
+{
+  for(int m=0;m<graph->num_modules;m++)
+    for(int c=0;c<graph->module[m].num_connectors;c++)
+      if(graph->module[m].name && (graph->module[m].connector[c].flags & s_conn_feedback))
+        return 1;
+  return 0;
+}
+
+// run the full graph. if it doesn't fit into device memory, still images are
+// run in tiles (see pipe/graph-tile.h), for animations all we can do is tell
+// the user.
+static VkResult
+export_run_fit(
+    dt_graph_t     *graph,
+    dt_graph_run_t  run)
+{
+  VkResult res = dt_graph_run(graph, run);
+  if(res == VK_ERROR_OUT_OF_DEVICE_MEMORY && graph->frame_cnt <= 1 &&
+     (run & s_graph_run_download_sink))
+  {
+    dt_log(s_log_pipe, "export does not fit into device memory, running in tiles");
+    res = dt_graph_run_tiled(graph);
+  }
+  if(res == VK_ERROR_OUT_OF_DEVICE_MEMORY)
+    dt_log(s_log_err, "export does not fit into device memory, try a smaller --width/--height");
+  return res;
+}
+
+// point the input module of a default config to the image file
+static int
+export_set_input(
+    dt_graph_t        *graph,
+    dt_graph_export_t *param,
+    dt_token_t         input_module)
+{
+  char imgfilename[PATH_MAX+100];
+  // follow link if this is a cfg in a tag collection:
+  ssize_t linklen = readlink(param->p_cfgfile, imgfilename, sizeof(imgfilename));
+  if(linklen == -1) snprintf(imgfilename, sizeof(imgfilename), "%s", param->p_cfgfile);
+  else imgfilename[linklen] = 0;
+  // reading the config will reset the search path. we'll repoint it to the
+  // actual image file, not the default cfg:
+  dt_graph_set_searchpath(graph, imgfilename);
+  int len = strlen(imgfilename);
+  assert(len > 4);
+  imgfilename[len-4] = 0; // cut away ".cfg"
+  char *basen = fs_basename(imgfilename); // cut away path so we can relocate more easily
+  int modid = dt_module_get(graph, input_module, dt_token("main"));
+  return modid < 0 ||
+      dt_module_set_param_string(graph->module + modid, dt_token("filename"), basen);
+}
+
+// hash everything that determines the structure of the export graph: the
+// config without params, the input module, the outputs and the extra lines.
+// if a graph is passed, its params will be read from the config, see
+// dt_graph_read_config_structure().
+static uint64_t
+export_read_structure(
+    dt_graph_t        *graph,
+    dt_graph_export_t *param)
+{
+  uint64_t hash = dt_graph_read_config_structure(graph, param->p_cfgfile);
+  if(!hash)
+  { // default config for a raw input
+    dt_token_t input_module = param->input_module;
+    if(param->input_module == 0)
+      input_module = dt_graph_default_input_module(param->p_cfgfile);
+    char graph_cfg[PATH_MAX+100];
+    if(param->p_defcfg)
+      snprintf(graph_cfg, sizeof(graph_cfg), "%s", param->p_defcfg);
+    else
+      snprintf(graph_cfg, sizeof(graph_cfg), "default-darkroom.%"PRItkn, dt_token_str(input_module));
+    hash = dt_graph_read_config_structure(graph, graph_cfg);
+    if(!hash || (graph && export_set_input(graph, param, input_module))) return 0;
+    hash = (hash ^ input_module) * 1099511628211ul;
+  }
+  for(int i=0;i<param->output_cnt;i++)
+  {
+    hash = (hash ^ param->output[i].mod)  * 1099511628211ul;
+    hash = (hash ^ param->output[i].inst) * 1099511628211ul;
+    hash = (hash ^ (param->output[i].max_width > 0 || param->output[i].max_height > 0)) * 1099511628211ul;
+  }
+  for(int i=0;i<param->extra_param_cnt;i++)
+    hash = (hash ^ hash64(param->p_extra_param[i])) * 1099511628211ul;
+  return hash;
+}
+
+// after reading new params into a warm graph, compare them to the old ones
+// and ask the modules what needs to be re-run because of it
+static dt_graph_run_t
+export_check_params(
+    dt_graph_t    *graph,
+    const uint8_t *old)   // copy of the params pool before reading
+{
+  dt_graph_run_t run = s_graph_run_none;
+  for(int m=0;m<graph->num_modules;m++)
+  {
+    dt_module_t *mod = graph->module + m;
+    if(!mod->name) continue;
+    for(int p=0;p<mod->so->num_params;p++)
+    {
+      const dt_ui_param_t *pp = mod->so->param[p];
+      uint8_t *oldval = (uint8_t *)old + (mod->param - graph->params_pool) + pp->offset;
+      if(!memcmp(mod->param + pp->offset, oldval, dt_ui_param_size(pp->type, pp->cnt))) continue;
+      run |= mod->so->check_params ?
+        mod->so->check_params(mod, p, oldval) :
+        s_graph_run_record_cmd_buf;
+    }
+  }
+  return run;
+}
+
 VkResult
 dt_graph_export(
     dt_graph_t        *graph,  // graph to run, will overwrite filename param
     dt_graph_export_t *param)
 {
-  if(param->p_cfgfile)
+  // insert default:
+  if(!param->output[0].inst) param->output[0].inst = dt_token("main");
+
+  // if the last export on this graph had the same structure, keep the modules
+  // and only read the new params. if the rois come out the same too, we can
+  // skip creating nodes and allocating memory further down.
+  int warm = 0;
+  dt_graph_run_t warm_run = s_graph_run_all;
+  if(param->p_cfgfile && graph->warm_structure)
+  {
+    uint8_t *old = malloc(graph->params_end);
+    memcpy(old, graph->params_pool, graph->params_end);
+    warm = export_read_structure(graph, param) == graph->warm_structure;
+    if(warm) warm_run = export_check_params(graph, old);
+    free(old);
+  }
+  if(param->p_cfgfile && !warm && graph->num_modules)
+    dt_graph_reset(graph); // start over from scratch
+  if(warm)
+  { // dt_graph_reset() would have cleared the output bounds, they are set again below
+    graph->output_wd = 0;
+    graph->output_ht = 0;
+  }
+  graph->warm_structure = 0; // until the run went through
+
+  if(param->p_cfgfile && !warm)
   {
     int err = dt_graph_read_config_ascii(graph, param->p_cfgfile);
     if(err)
@@ -99,21 +374,7 @@ dt_graph_export(
       else
         snprintf(graph_cfg, sizeof(graph_cfg), "default-darkroom.%"PRItkn, dt_token_str(input_module));
       err = dt_graph_read_config_ascii(graph, graph_cfg);
-      char imgfilename[PATH_MAX+100];
-      // follow link if this is a cfg in a tag collection:
-      ssize_t linklen = readlink(param->p_cfgfile, imgfilename, sizeof(imgfilename));
-      if(linklen == -1) snprintf(imgfilename, sizeof(imgfilename), "%s", param->p_cfgfile);
-      else imgfilename[linklen] = 0;
-      // reading the config will reset the search path. we'll repoint it to the
-      // actual image file, not the default cfg:
-      dt_graph_set_searchpath(graph, imgfilename);
-      int len = strlen(imgfilename);
-      assert(len > 4);
-      imgfilename[len-4] = 0; // cut away ".cfg"
-      char *basen = fs_basename(imgfilename); // cut away path so we can relocate more easily
-      int modid = dt_module_get(graph, input_module, dt_token("main"));
-      if(modid < 0 ||
-          dt_module_set_param_string(graph->module + modid, dt_token("filename"), basen))
+      if(export_set_input(graph, param, input_module))
       {
         dt_log(s_log_err, "config '%s' has no valid %"PRItkn" input module!", graph_cfg, dt_token_str(input_module));
         return VK_INCOMPLETE;
@@ -139,11 +400,8 @@ dt_graph_export(
     }
   }
 
-  // insert default:
-  if(!param->output[0].inst) param->output[0].inst = dt_token("main");
-
-  // replace requested display node by export node:
-  if(!found_main)
+  // replace requested display node by export node (a warm graph has it already):
+  if(!found_main && !warm)
   {
     int cnt = 0;
     for(;cnt<param->output_cnt;cnt++)
@@ -225,17 +483,35 @@ dt_graph_export(
   if(graph->frame_cnt > 1)
   {
     VkResult res = VK_SUCCESS;
-    dt_graph_apply_keyframes(graph);
-    dt_graph_run(graph, s_graph_run_all);
-    if(audio_f)
+    // range of frames to write, for splitting long animations over several processes:
+    const int end  = param->frame_end > 0 ? MIN(param->frame_end, graph->frame_cnt) : graph->frame_cnt;
+    if(param->frame_beg < 0 || param->frame_beg >= end)
     {
-      do {
-        audio_cnt = graph->module[audio_mod].so->audio(graph->module+audio_mod, 0, &audio_samples);
-        if(audio_cnt) fwrite(audio_samples, 2*sizeof(uint16_t), audio_cnt, audio_f);
-      } while(audio_cnt);
+      dt_log(s_log_err, "frame range %d:%d is empty, the animation has %d frames!",
+          param->frame_beg, param->frame_end, graph->frame_cnt);
+      if(audio_f) fclose(audio_f);
+      return VK_INCOMPLETE;
     }
-    for(int f=1;f<graph->frame_cnt;f++)
+    const int beg  = param->frame_beg;
+    const int step = MAX(1, param->frame_step);
+    const int last = beg + (end-1-beg)/step*step;
+    // feedback connectors carry state from one frame to the next, so we need to
+    // render all frames leading up to the range and can't skip any in between:
+    const int feedback = export_has_feedback(graph);
+    const int start = !feedback ? beg : param->frame_warmup > 0 ? MAX(0, beg - param->frame_warmup) : 0;
+    if(start != beg)
+      dt_log(s_log_pipe, "rendering %d warm-up frames for feedback connectors", beg - start);
+    // keep the gpu busy while the cpu encodes. the ring slots reuse their
+    // host buffers, so we'll only allocate during the first few frames.
+    const int pipeline = param->pipeline && export_can_pipeline(graph);
+    dt_graph_export_job_t job[DT_GRAPH_EXPORT_RING] = {{0}};
+    for(int i=0;i<DT_GRAPH_EXPORT_RING;i++) job[i].taskid = -1;
+    const dt_graph_run_t download = pipeline ? 0 : s_graph_run_download_sink;
+    for(int f=start;f<end;f++)
     {
+      const int in_range = f >= beg && (f-beg) % step == 0;
+      if(!in_range && !feedback) continue; // nothing depends on this frame
+      const int write = in_range && (!param->last_frame_only || f == last);
       graph->frame = f;
       for(int i=0;i<param->output_cnt;i++)
       {
@@ -249,13 +525,21 @@ dt_graph_export(
             filename);
       }
       dt_graph_apply_keyframes(graph);
-      res = dt_graph_run(graph,
-          s_graph_run_record_cmd_buf | 
-          ((!param->last_frame_only || (f == graph->frame_cnt-1)) ?
-          s_graph_run_download_sink : 0) |
-          s_graph_run_wait_done);
+      if(f == start) // first frame needs the full thing
+        res = export_run_fit(graph,
+            (s_graph_run_all & ~s_graph_run_download_sink) | (write ? download : 0));
+      else
+        res = dt_graph_run(graph,
+            s_graph_run_record_cmd_buf |
+            (write ? download : 0) |
+            s_graph_run_wait_done);
       if(res != VK_SUCCESS) goto done;
-      if(audio_f)
+      if(pipeline && write)
+        if((res = export_job_submit(graph, job + f % DT_GRAPH_EXPORT_RING)) != VK_SUCCESS) goto done;
+      // audio goes with the frames we render in the range. the decoders only
+      // hand out the samples of frames they have been asked for, so with a
+      // step > 1 the samples of the frames in between are not written.
+      if(audio_f && in_range)
       {
         do {
           audio_cnt = graph->module[audio_mod].so->audio(graph->module+audio_mod, f, &audio_samples);
@@ -264,12 +548,23 @@ dt_graph_export(
       }
     }
 done:
+    for(int i=0;i<DT_GRAPH_EXPORT_RING;i++)
+      export_job_cleanup(job + i);
     if(audio_f) fclose(audio_f);
     return res;
   }
   else
   {
-    return dt_graph_run(graph, s_graph_run_all);
+    dt_graph_run_t run = s_graph_run_all;
+    if(warm && !(warm_run & (s_graph_run_create_nodes | s_graph_run_alloc)) &&
+       !(warm_run && dt_graph_checkpoint_cnt(graph)) && // the cache key covers all params upstream
+       !dt_graph_roi_changed(graph) && graph->frame_cnt <= 1)
+      run = s_graph_run_record_cmd_buf | s_graph_run_upload_source |
+            s_graph_run_download_sink  | s_graph_run_wait_done;
+    VkResult res = export_run_fit(graph, run);
+    if(res == VK_SUCCESS && param->p_cfgfile)
+      graph->warm_structure = export_read_structure(0, param);
+    return res;
   }
 }
 
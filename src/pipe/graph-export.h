@@ -33,7 +33,6 @@ dt_graph_export_output_t;
 // parameter struct for export.
 // 0 is default
 // TODO: also use this for thumbnails
-// TODO: support live graph, so we can drop in without re-alloc..?
 typedef struct dt_graph_export_t
 {
   const char  *p_cfgfile;      // if not NULL, read this config file (or the default)
@@ -48,10 +47,20 @@ typedef struct dt_graph_export_t
   dt_graph_export_output_t output[20];
 
   int          dump_modules;   // debug output: write module graph in dot format
-  int          last_frame_only;// only write the very last frame of an animation
+  int          last_frame_only;// only write the very last frame of an animation (of the range below)
+  int          frame_beg;      // animations: first frame to write
+  int          frame_end;      // one past the last frame to write, 0 means all
+  int          frame_step;     // only write every n-th frame, 0 means 1
+  int          frame_warmup;   // with feedback connectors, render this many frames before frame_beg. 0 means all from 0
+  int          pipeline;       // encode animation frames on the thread pool while the gpu renders the next.
+                               // don't set this if calling from a worker thread of the pool.
 }
 dt_graph_export_t;
 
+// run an export. if p_cfgfile is set and the graph still holds the last export
+// with the same structure (modules, connections, outputs), only the params are
+// read and nodes and memory are kept if the rois didn't change. else the graph
+// is reset, so don't reset it in between exports to get this speedup.
 VkResult
 dt_graph_export(
     dt_graph_t *graph,         // graph to run, will overwrite filename param
@@ -4,6 +4,7 @@
 #include "pipe/io.h"
 #include "core/log.h"
 #include "core/fs.h"
+#include "db/hash.h"
 #include <libgen.h>
 #include <unistd.h>
 
@@ -182,6 +183,20 @@ read_connection_ascii(
   return 0;
 }
 
+// opt in to caching the output of a module on disk, see graph-checkpoint.h
+static inline int
+read_checkpoint_ascii(
+    dt_graph_t *graph,
+    char       *line)
+{
+  dt_token_t name = dt_read_token(line, &line);
+  dt_token_t inst = dt_read_token(line, &line);
+  int modid = dt_module_get(graph, name, inst);
+  if(modid < 0) return 1;
+  graph->module[modid].checkpoint = 1;
+  return 0;
+}
+
 // helper to add a new module from config file
 static inline int
 read_module_ascii(
@@ -218,6 +233,7 @@ int dt_graph_read_config_line(
   else if(cmd == dt_token("keyframe")) return read_keyframe_ascii(graph, c);
   else if(cmd == dt_token("connect"))  return read_connection_ascii(graph, c, 0);
   else if(cmd == dt_token("feedback")) return read_connection_ascii(graph, c, s_conn_feedback);
+  else if(cmd == dt_token("checkpoint")) return read_checkpoint_ascii(graph, c);
   else if(cmd == dt_token("frames"))   graph->frame_cnt  = atol(c); // does not fail
   else if(cmd == dt_token("fps"))      graph->frame_rate = atof(c); // does not fail
   else return 1;
@@ -253,9 +269,9 @@ int dt_graph_set_searchpath(
 // TODO: rewrite this to work on a uint8_t * data pointer (same for write below)
 // TODO: also insert line start pointers (for history stack)
 // this is a public api function on the graph, it reads the full stack
-int dt_graph_read_config_ascii(
-    dt_graph_t *graph,
-    const char *filename)
+// open config file, relative paths may also be in the home or base directory
+static FILE *
+open_config(const char *filename)
 {
   FILE *f = fopen(filename, "rb");
   if(!f && filename[0] != '/')
@@ -269,6 +285,14 @@ int dt_graph_read_config_ascii(
       f = fopen(graph_cfg, "rb");
     }
   }
+  return f;
+}
+
+int dt_graph_read_config_ascii(
+    dt_graph_t *graph,
+    const char *filename)
+{
+  FILE *f = open_config(filename);
   if(!f) return 1;
   dt_graph_set_searchpath(graph, filename);
   // needs to be large enough to hold 10000 vertices of drawn masks:
@@ -290,6 +314,40 @@ error:
   return 1;
 }
 
+uint64_t dt_graph_read_config_structure(
+    dt_graph_t *graph,
+    const char *filename)
+{
+  FILE *f = open_config(filename);
+  if(!f) return 0;
+  if(graph)
+  {
+    dt_graph_set_searchpath(graph, filename);
+    for(int m=0;m<graph->num_modules;m++)
+      dt_module_reset_params(graph->module+m);
+  }
+  char line[300000];
+  uint64_t hash = 1; // empty config is still a config
+  while(!feof(f))
+  {
+    line[0] = 0;
+    fscanf(f, "%299999[^\n]", line);
+    if(fgetc(f) == EOF) break; // read \n
+    if(line[0] == '#') continue;
+    char *c = line;
+    dt_token_t cmd = dt_read_token(c, &c);
+    if(cmd == dt_token("param") || cmd == dt_token("paramsub"))
+    { // params are the only thing we read, warnings are okay
+      if(graph && dt_graph_read_config_line(graph, line) < 0) hash = 0;
+    }
+    else if(line[0]) // everything else goes into the structure, keyframes too
+      hash = (hash ^ hash64(line)) * 1099511628211ul;
+    if(!hash) break;
+  }
+  fclose(f);
+  return hash;
+}
+
 #define WRITE(...) {\
   int ret = snprintf(line, size, __VA_ARGS__); \
   if(ret >= size) return 0; \
@@ -310,6 +368,10 @@ dt_graph_write_module_ascii(
       dt_token_str(graph->module[m].name),
       dt_token_str(graph->module[m].inst),
       graph->module[m].gui_x, graph->module[m].gui_y);
+  if(graph->module[m].checkpoint)
+    WRITE("checkpoint:%"PRItkn":%"PRItkn"\n",
+        dt_token_str(graph->module[m].name),
+        dt_token_str(graph->module[m].inst));
   return line;
 }
 
@@ -6,6 +6,15 @@ int dt_graph_read_config_ascii(
     dt_graph_t *graph,
     const char *filename);
 
+// hash the structure of a config file, i.e. all lines but the params. if a
+// graph is passed, it has to have been read from a config with the same
+// structure before: its params are reset to defaults and read from the file,
+// modules and connections are left untouched. compare the returned hash to
+// find out whether this was okay. returns 0 if the file can't be read.
+uint64_t dt_graph_read_config_structure(
+    dt_graph_t *graph,
+    const char *filename);
+
 int dt_graph_write_config_ascii(
     dt_graph_t *graph,
     const char *filename);
@@ -0,0 +1,293 @@
+#include "pipe/graph-tile.h"
+#include "pipe/modules/api.h"
+#include "core/core.h"
+#include "core/log.h"
+#include "core/profile.h"
+#include "qvk/qvk.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// extra pixels of the input around each tile, so filters near the border of
+// the tile see the same neighbourhood as in the full image
+#define DT_GRAPH_TILE_MARGIN 256
+// give up if the image can't be done with this many tiles per side
+#define DT_GRAPH_TILE_MAX 16
+// tiles start at multiples of this, so the bayer and x-trans patterns line up
+#define DT_GRAPH_TILE_ALIGN 6
+
+static inline int
+tile_format(const dt_connector_t *c)
+{
+  return c->format != dt_token("bc1") && c->format != dt_token("yuv") &&
+         c->format != dt_token("geo") && c->format != dt_token("ssbo") &&
+         c->array_length <= 1;
+}
+
+// move the crop window b[4] of the full image into the tile x0,y0,x1,y1.
+// where the tile cuts the window, the new edge keeps the phase of the colour
+// filter array relative to the old one. returns zero if the window is unset.
+static int
+tile_crop(
+    const uint32_t b[4],
+    int x0, int y0, int x1, int y1,
+    uint32_t       r[4])
+{
+  if(b[2] <= b[0] || b[3] <= b[1]) return 0;
+  const int a = DT_GRAPH_TILE_ALIGN;
+  int o[2] = { (int)b[0] - x0, (int)b[1] - y0 };
+  int e[2] = { (int)b[2] - x0, (int)b[3] - y0 };
+  const int s[2] = { x1 - x0, y1 - y0 };
+  for(int k=0;k<2;k++)
+  {
+    if(o[k] < 0) o[k] = (o[k] % a + a) % a;
+    if(e[k] > s[k]) e[k] = o[k] + (s[k] - o[k]) / a * a;
+    e[k] = MAX(e[k], o[k]);
+  }
+  r[0] = o[0]; r[1] = o[1];
+  r[2] = e[0]; r[3] = e[1];
+  return 1;
+}
+
+void
+dt_graph_tile_roi_out(dt_graph_t *graph, dt_module_t *module)
+{
+  const int m = module - graph->module;
+  if(graph->tile.wd <= 0 || m >= graph->tile.src_cnt) return;
+  graph->tile.src[m].tiled = 0;
+  dt_connector_t *c = module->connector;
+  if(strncmp(dt_token_str(module->name), "i-", 2) ||
+     c->type != dt_token("source") || !tile_format(c)) return;
+  if(module->inst == dt_token("main"))
+  { // the main input goes first (see roi_out_pass()), remember its size for the others
+    graph->tile.full_wd = c->roi.full_wd;
+    graph->tile.full_ht = c->roi.full_ht;
+  }
+  else if(c->roi.full_wd != graph->tile.full_wd ||
+          c->roi.full_ht != graph->tile.full_ht)
+    return; // some lut or other auxiliary input
+  graph->tile.src[m].tiled = 1;
+  const int x0 = graph->tile.x, y0 = graph->tile.y;
+  const int x1 = MIN((int)c->roi.full_wd, x0 + graph->tile.wd);
+  const int y1 = MIN((int)c->roi.full_ht, y0 + graph->tile.ht);
+  c->roi.full_wd = x1 - x0;
+  c->roi.full_ht = y1 - y0;
+  tile_crop(module->img_param.crop_aabb, x0, y0, x1, y1, module->img_param.crop_aabb);
+}
+
+int
+dt_graph_tile_read_source(dt_graph_t *graph, dt_node_t *node, uint8_t *mapped)
+{
+  dt_module_t *mod = node->module;
+  dt_graph_tile_source_t *s = graph->tile.src + (mod - graph->module);
+  dt_connector_t *c = mod->connector;
+  const uint32_t wd = graph->tile.full_wd, ht = graph->tile.full_ht;
+  if(!s->buf)
+  { // read the full image once, the module expects to write its full roi:
+    s->buf = malloc(dt_connector_bufsize(c, wd, ht));
+    if(!s->buf) return 1;
+    const dt_roi_t roi = c->roi;
+    c->roi.full_wd = c->roi.wd = wd;
+    c->roi.full_ht = c->roi.ht = ht;
+    dt_read_source_params_t p = { .node = node, .c = 0, .a = 0 };
+    mod->so->read_source(mod, s->buf, &p);
+    c->roi = roi;
+  }
+  const size_t bpp = dt_connector_bufsize(c, 1, 1);
+  const size_t row = bpp * c->roi.wd;
+  for(uint32_t j=0;j<c->roi.ht;j++)
+    memcpy(mapped + j*row, s->buf + ((graph->tile.y + j)*(size_t)wd + graph->tile.x)*bpp, row);
+  return 0;
+}
+
+static void
+tile_cleanup(dt_graph_t *graph)
+{
+  for(int m=0;m<graph->tile.src_cnt;m++)
+    free(graph->tile.src[m].buf);
+  free(graph->tile.src);
+  memset(&graph->tile, 0, sizeof(graph->tile));
+}
+
+// the sinks we stitch, with their size and scale as in the full run
+typedef struct tile_sink_t
+{
+  dt_module_t *mod;
+  dt_roi_t     roi;
+  size_t       bpp;
+  uint8_t     *buf;
+}
+tile_sink_t;
+
+// copy the core cx0..cx1, cy0..cy1 of the tile (in pixels of the sink's full
+// roi) from staging to the stitched image. the tile starts at ox, oy.
+static void
+tile_stitch(
+    tile_sink_t    *s,
+    const dt_roi_t *troi,
+    const uint8_t  *src,
+    int ox, int oy,
+    int cx0, int cy0, int cx1, int cy1)
+{
+  const float k = s->roi.scale, st = troi->scale;
+  const int X0 = CLAMP((int)ceilf(cx0/k - 0.5f), 0, (int)s->roi.wd);
+  const int X1 = CLAMP((int)ceilf(cx1/k - 0.5f), 0, (int)s->roi.wd);
+  const int Y0 = CLAMP((int)ceilf(cy0/k - 0.5f), 0, (int)s->roi.ht);
+  const int Y1 = CLAMP((int)ceilf(cy1/k - 0.5f), 0, (int)s->roi.ht);
+  for(int Y=Y0;Y<Y1;Y++)
+  {
+    const int v = CLAMP((int)(((Y+0.5f)*k - oy)/st), 0, (int)troi->ht-1);
+    uint8_t *dst = s->buf + s->bpp * (Y*(size_t)s->roi.wd);
+    const uint8_t *line = src + s->bpp * (v*(size_t)troi->wd);
+    if(k == 1.0f && st == 1.0f)
+    { // unscaled, copy the whole row
+      memcpy(dst + s->bpp*X0, line + s->bpp*(X0 - ox), s->bpp*(X1 - X0));
+      continue;
+    }
+    for(int X=X0;X<X1;X++)
+    {
+      const int u = CLAMP((int)(((X+0.5f)*k - ox)/st), 0, (int)troi->wd-1);
+      memcpy(dst + s->bpp*X, line + s->bpp*u, s->bpp);
+    }
+  }
+}
+
+VkResult
+dt_graph_run_tiled(dt_graph_t *graph)
+{
+  int mi = -1;
+  for(int m=0;m<graph->num_modules;m++)
+    if(graph->module[m].name && graph->module[m].inst == dt_token("main") &&
+       !strncmp(dt_token_str(graph->module[m].name), "i-", 2) &&
+       graph->module[m].connector[0].type == dt_token("source"))
+      mi = m;
+  if(mi < 0 || graph->frame_cnt > 1 || graph->gui_attached ||
+     !tile_format(graph->module[mi].connector))
+  {
+    dt_log(s_log_err, "can only tile still images with a plain main input");
+    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  }
+  // the roi pass of the failed run left us the full sizes:
+  const int W = graph->module[mi].connector[0].roi.full_wd;
+  const int H = graph->module[mi].connector[0].roi.full_ht;
+  const uint32_t *b = graph->module[mi].img_param.crop_aabb;
+  uint32_t crop[4] = {0, 0, W, H};
+  int use_crop = -1; // do the sinks see the crop window or the whole input?
+  int sink_cnt = 0;
+  tile_sink_t sink[20] = {{0}};
+  for(int m=0;m<graph->num_modules;m++)
+  {
+    dt_module_t *mod = graph->module + m;
+    if(!mod->name || mod->disabled || !mod->so->write_sink ||
+       mod->connector[0].type != dt_token("sink")) continue;
+    const dt_roi_t *r = &mod->connector[0].roi;
+    int c = -1;
+    if(b[2] > b[0] && b[3] > b[1] && r->full_wd == b[2]-b[0] && r->full_ht == b[3]-b[1]) c = 1;
+    else if(r->full_wd == (uint32_t)W && r->full_ht == (uint32_t)H) c = 0;
+    if(c < 0 || (use_crop >= 0 && c != use_crop) ||
+       (mod->flags & s_module_request_write_sink) ||
+       !tile_format(mod->connector) || sink_cnt >= (int)(sizeof(sink)/sizeof(sink[0])))
+    {
+      dt_log(s_log_err, "can't tile the graph: %"PRItkn"_%"PRItkn" doesn't see the input image at its full size",
+          dt_token_str(mod->name), dt_token_str(mod->inst));
+      return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+    use_crop = c;
+    sink[sink_cnt].mod = mod;
+    sink[sink_cnt].roi = *r;
+    sink[sink_cnt].bpp = dt_connector_bufsize(mod->connector, 1, 1);
+    sink_cnt++;
+  }
+  if(!sink_cnt) return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  if(use_crop) memcpy(crop, b, sizeof(crop));
+
+  VkResult res = VK_SUCCESS;
+  const int output_wd = graph->output_wd, output_ht = graph->output_ht;
+  for(int i=0;i<sink_cnt;i++)
+  {
+    sink[i].buf = calloc(sink[i].bpp, sink[i].roi.wd * (size_t)sink[i].roi.ht);
+    if(!sink[i].buf) { res = VK_ERROR_OUT_OF_HOST_MEMORY; goto done; }
+  }
+  graph->tile.src_cnt = graph->num_modules;
+  graph->tile.src = calloc(sizeof(graph->tile.src[0]), graph->num_modules);
+  graph->tile.full_wd = W;
+  graph->tile.full_ht = H;
+
+  const int a = DT_GRAPH_TILE_ALIGN, M = DT_GRAPH_TILE_MARGIN;
+  const int cw = crop[2] - crop[0], ch = crop[3] - crop[1];
+  for(int n=2;n<=DT_GRAPH_TILE_MAX;n++)
+  {
+    const int tw = ((cw + n-1)/n + a-1)/a*a, th = ((ch + n-1)/n + a-1)/a*a;
+    res = VK_SUCCESS;
+    for(int ty=0;ty<n&&res==VK_SUCCESS;ty++) for(int tx=0;tx<n&&res==VK_SUCCESS;tx++)
+    { // core of the tile in pixels of the sinks' full roi:
+      const int cx0 = tx*tw, cx1 = MIN(cw, cx0 + tw);
+      const int cy0 = ty*th, cy1 = MIN(ch, cy0 + th);
+      if(cx0 >= cx1 || cy0 >= cy1) continue;
+      // the tile in the input image, expanded by the margin:
+      const int x0 = MAX(0, (int)crop[0] + cx0 - M) / a * a;
+      const int y0 = MAX(0, (int)crop[1] + cy0 - M) / a * a;
+      int x1 = MIN(W, (int)crop[0] + cx1 + M), y1 = MIN(H, (int)crop[1] + cy1 + M);
+      if(x1 < W) x1 = x0 + (x1 - x0) / a * a;
+      if(y1 < H) y1 = y0 + (y1 - y0) / a * a;
+      // the part of it the sinks will see, and where it starts:
+      uint32_t tc[4] = {0, 0, x1-x0, y1-y0};
+      if(use_crop) tile_crop(crop, x0, y0, x1, y1, tc);
+      const int ox = x0 + tc[0] - crop[0], oy = y0 + tc[1] - crop[1];
+      graph->tile.x  = x0;
+      graph->tile.y  = y0;
+      graph->tile.wd = x1 - x0;
+      graph->tile.ht = y1 - y0;
+      // scale the main output the same way as the full image:
+      for(int i=0;i<sink_cnt;i++) if(sink[i].mod->inst == dt_token("main"))
+      {
+        graph->output_wd = sink[i].roi.scale > 1.0f ? MAX(1, (tc[2]-tc[0])/sink[i].roi.scale) : 0;
+        graph->output_ht = sink[i].roi.scale > 1.0f ? MAX(1, (tc[3]-tc[1])/sink[i].roi.scale) : 0;
+      }
+      dt_log(s_log_pipe, "running tile %d/%d of %dx%d: %d %d %dx%d",
+          ty*n+tx+1, n*n, n, n, x0, y0, x1-x0, y1-y0);
+      res = dt_graph_run(graph, s_graph_run_all & ~s_graph_run_download_sink);
+      if(res != VK_SUCCESS) break;
+      uint8_t *mapped = 0;
+      if((res = vkMapMemory(qvk.device, graph->vkmem_staging, 0, VK_WHOLE_SIZE, 0, (void**)&mapped)) != VK_SUCCESS)
+        goto done;
+      for(int i=0;i<sink_cnt;i++)
+      {
+        const dt_roi_t *troi = &sink[i].mod->connector[0].roi;
+        if(troi->full_wd != tc[2]-tc[0] || troi->full_ht != tc[3]-tc[1])
+        {
+          dt_log(s_log_err, "can't tile the graph: %"PRItkn"_%"PRItkn" sees %dx%d of a %dx%d tile",
+              dt_token_str(sink[i].mod->name), dt_token_str(sink[i].mod->inst),
+              troi->full_wd, troi->full_ht, tc[2]-tc[0], tc[3]-tc[1]);
+          vkUnmapMemory(qvk.device, graph->vkmem_staging);
+          res = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+          goto done;
+        }
+        for(int nd=0;nd<graph->num_nodes;nd++)
+          if(graph->node[nd].module == sink[i].mod && dt_node_sink(graph->node+nd) &&
+             graph->node[nd].kernel != dt_token("ckpt"))
+            tile_stitch(sink+i, troi, mapped + graph->node[nd].connector[0].offset_staging,
+                ox, oy, cx0, cy0, cx1, cy1);
+      }
+      vkUnmapMemory(qvk.device, graph->vkmem_staging);
+    }
+    if(res != VK_ERROR_OUT_OF_DEVICE_MEMORY) break; // done or other error
+  }
+  if(res == VK_ERROR_OUT_OF_DEVICE_MEMORY)
+    dt_log(s_log_err, "export does not fit into device memory even in %dx%d tiles", DT_GRAPH_TILE_MAX, DT_GRAPH_TILE_MAX);
+  if(res == VK_SUCCESS) for(int i=0;i<sink_cnt;i++)
+  { // write the stitched images as if they came out of the full run:
+    dt_module_t mod = *sink[i].mod;
+    mod.connector[0].roi = sink[i].roi;
+    const double write_beg = dt_time();
+    mod.so->write_sink(&mod, sink[i].buf);
+    dt_profile_span("pipe", "write_sink", write_beg, dt_time());
+  }
+done:
+  graph->output_wd = output_wd;
+  graph->output_ht = output_ht;
+  for(int i=0;i<sink_cnt;i++) free(sink[i].buf);
+  tile_cleanup(graph);
+  return res;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "pipe/graph.h"
+
+// tiled execution for exports that don't fit into device memory.
+//
+// regions of interest don't have offsets, so the graph is cut at the
+// sources instead: while graph->tile.wd > 0, every i-* source with a plain
+// image output that has the size of the main input passes on only the
+// rectangle graph->tile of its image, as if it was the whole image. the crop
+// window in img_param (black borders of raw files) is moved and clipped along.
+// the full image is read once into a host buffer and the tiles are copied out
+// of it. the tiles are expanded by a fixed margin (see graph-tile.c) on all
+// sides and only their core is stitched into full size buffers, one per sink,
+// which are written by write_sink when all tiles are done.
+//
+// this works for graphs that keep the geometry of the image up to the sinks
+// (maybe cropping the black borders and scaling the output). modules which
+// look at the whole image (histograms, automatic exposure, crop, lens
+// distortion, pyramids wider than the margin) only see their tile and may
+// leave seams. animations and graphs with sinks writing on every run are not
+// tiled.
+
+// called after modify_roi_out of any module, cuts the output of tiled sources
+void dt_graph_tile_roi_out(dt_graph_t *graph, dt_module_t *module);
+
+// returns non-zero if the source of this module only passes on the tile
+static inline int
+dt_graph_tile_source(const dt_graph_t *graph, const dt_module_t *module)
+{
+  const int m = module - graph->module;
+  return graph->tile.wd > 0 && m < graph->tile.src_cnt && graph->tile.src[m].tiled;
+}
+
+// copy the tile of a tiled source to mapped staging memory. reads the full
+// image on first use.
+int dt_graph_tile_read_source(dt_graph_t *graph, dt_node_t *node, uint8_t *mapped);
+
+// run the graph in tiles after dt_graph_run() returned
+// VK_ERROR_OUT_OF_DEVICE_MEMORY (so the rois of the full image are known),
+// and write all sinks. returns VK_ERROR_OUT_OF_DEVICE_MEMORY if the graph
+// can't be tiled or even small tiles don't fit.
+VkResult dt_graph_run_tiled(dt_graph_t *graph);
@@ -6,8 +6,11 @@
 #include "modules/api.h"
 #include "modules/localsize.h"
 #include "core/log.h"
+#include "core/profile.h"
 #include "qvk/qvk.h"
 #include "graph-print.h"
+#include "graph-checkpoint.h"
+#include "graph-tile.h"
 #ifdef DEBUG_MARKERS
 #include "db/stringpool.h"
 #endif
@@ -15,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/types.h>
@@ -47,6 +51,8 @@ dt_graph_init(dt_graph_t *g)
   dt_vkalloc_init(&g->heap, 16000, 1ul<<40); // bytesize doesn't matter
   dt_vkalloc_init(&g->heap_ssbo, 8000, 1ul<<40);
   dt_vkalloc_init(&g->heap_staging, 100, 1ul<<40);
+  dt_vkalloc_plan_init(&g->heap); // record lifetimes to plan offsets statically
+  dt_vkalloc_plan_init(&g->heap_ssbo);
   g->params_max = 16u<<20;
   g->params_end = 0;
   g->params_pool = calloc(sizeof(uint8_t), g->params_max);
@@ -100,6 +106,7 @@ dt_graph_init(dt_graph_t *g)
 
   g->lod_scale = 1;
   g->active_module = -1;
+  g->pinned_module = -1;
 }
 
 void
@@ -205,6 +212,8 @@ dt_graph_cleanup(dt_graph_t *g)
   free(g->module);             g->module = 0;
   free(g->node);               g->node = 0;
   free(g->params_pool);        g->params_pool = 0;
+  free(g->params_last);        g->params_last = 0;
+  g->params_last_size = 0;
   free(g->conn_image_pool);    g->conn_image_pool = 0;
   for(int i=0;i<2;i++)
   {
@@ -253,13 +262,39 @@ dt_graph_create_shader_module(
     const char     *type,
     VkShaderModule *shader_module)
 {
-  // create the compute shader stage
-  char filename[PATH_MAX+100] = {0};
-  snprintf(filename, sizeof(filename), "%s/modules/%"PRItkn"/%"PRItkn".%s.spv",
-      dt_pipe.basedir, dt_token_str(node), dt_token_str(kernel), type);
-
-  size_t len;
-  void *data = read_file(filename, &len);
+  // look up spir-v in the process wide cache first. entries are never
+  // removed, so the data pointer stays valid after we unlock.
+  const dt_token_t stage = dt_token(type);
+  size_t len = 0;
+  void *data = 0;
+  threads_mutex_lock(&dt_pipe.shader_mutex);
+  int i = 0;
+  for(;i<dt_pipe.num_shaders;i++)
+  {
+    const dt_pipe_shader_t *s = dt_pipe.shader + i;
+    if(s->module == node && s->kernel == kernel && s->stage == stage)
+      break;
+  }
+  if(i == dt_pipe.num_shaders)
+  { // not found, read from disk
+    char filename[PATH_MAX+100] = {0};
+    snprintf(filename, sizeof(filename), "%s/modules/%"PRItkn"/%"PRItkn".%s.spv",
+        dt_pipe.basedir, dt_token_str(node), dt_token_str(kernel), type);
+    if(dt_pipe.num_shaders == dt_pipe.max_shaders)
+    {
+      dt_pipe.max_shaders = dt_pipe.max_shaders ? 2*dt_pipe.max_shaders : 256;
+      dt_pipe.shader = realloc(dt_pipe.shader, sizeof(dt_pipe_shader_t)*dt_pipe.max_shaders);
+    }
+    dt_pipe_shader_t *s = dt_pipe.shader + dt_pipe.num_shaders++;
+    s->module = node;
+    s->kernel = kernel;
+    s->stage  = stage;
+    s->len    = 0;
+    s->data   = read_file(filename, &s->len); // also remember missing files (optional geometry shaders)
+  }
+  len  = dt_pipe.shader[i].len;
+  data = dt_pipe.shader[i].data;
+  threads_mutex_unlock(&dt_pipe.shader_mutex);
   if(!data) return VK_ERROR_INVALID_EXTERNAL_HANDLE;
 
   VkShaderModuleCreateInfo sm_info = {
@@ -268,7 +303,6 @@ dt_graph_create_shader_module(
     .pCode    = data
   };
   QVKR(vkCreateShaderModule(qvk.device, &sm_info, 0, shader_module));
-  free(data);
 #ifdef DEBUG_MARKERS
 #ifdef QVK_ENABLE_VALIDATION
   char name[100];
@@ -474,6 +508,7 @@ allocate_image_array_element(
   assert(img->mem);
   img->offset = img->mem->offset + heap_offset;
   img->size   = img->mem->size;
+  if(heap_offset == 0) dt_vkalloc_plan_dst(heap, img->mem, &img->offset);
   // reference counting. we can't just do a ref++ here because we will
   // free directly after and wouldn't know which node later on still relies
   // on this buffer. hence we ran a reference counting pass before this, and
@@ -737,7 +772,7 @@ alloc_outputs(dt_graph_t *graph, dt_node_t *node)
         .basePipelineIndex   = -1,
       };
 
-      QVKR(vkCreateGraphicsPipelines(qvk.device, VK_NULL_HANDLE,
+      QVKR(vkCreateGraphicsPipelines(qvk.device, qvk.pipeline_cache,
             1, &pipeline_info, NULL, &node->pipeline));
 
       // TODO: keep cached for others
@@ -770,7 +805,7 @@ alloc_outputs(dt_graph_t *graph, dt_node_t *node)
         .stage  = stage_info,
         .layout = node->pipeline_layout
       };
-      QVKR(vkCreateComputePipelines(qvk.device, VK_NULL_HANDLE, 1, &pipeline_info, 0, &node->pipeline));
+      QVKR(vkCreateComputePipelines(qvk.device, qvk.pipeline_cache, 1, &pipeline_info, 0, &node->pipeline));
 
       // we don't need the module any more
       vkDestroyShaderModule(qvk.device, stage_info.module, 0);
@@ -854,6 +889,11 @@ alloc_outputs(dt_graph_t *graph, dt_node_t *node)
         // same node (as multiple places in the code e.g. using a single read_source call)
         c->offset_staging = img->mem->offset;
         c->size_staging   = size;
+        if(c->type != dt_token("source"))
+        {
+          dt_vkalloc_plan_dst(&graph->heap_ssbo, img->mem, &img->offset);
+          dt_vkalloc_plan_dst(&graph->heap_ssbo, img->mem, &c->offset_staging);
+        }
         // reference counting. we can't just do a ref++ here because we will
         // free directly after and wouldn't know which node later on still relies
         // on this buffer. hence we ran a reference counting pass before this, and
@@ -1357,6 +1397,55 @@ alloc_outputs3(dt_graph_t *graph, dt_node_t *node)
   return VK_SUCCESS;
 }
 
+// record a cpu span for the given node in the profile, if one is being written
+static inline void
+profile_node(const dt_node_t *node, const char *what, double beg)
+{
+  if(!dt_profile_active()) return;
+  char name[64];
+  snprintf(name, sizeof(name), "%s %"PRItkn" %"PRItkn, what,
+      dt_token_str(node->name), dt_token_str(node->kernel));
+  dt_profile_span("pipe", name, beg, dt_time());
+}
+
+// put the kernel timestamps of a finished command buffer on the gpu track of
+// the profile. the gpu clock is not calibrated against ours, so we align the
+// first timestamp with the time of submission.
+static inline VkResult
+profile_gpu(dt_graph_t *graph, dt_graph_query_t *q)
+{
+  if(!dt_profile_active() || q->cnt < 2 || q->cpu_submit <= 0.0) return VK_SUCCESS;
+  QVKR(vkGetQueryPoolResults(qvk.device, q->pool,
+        0, q->cnt,
+        sizeof(q->pool_results[0]) * q->max,
+        q->pool_results,
+        sizeof(q->pool_results[0]),
+        VK_QUERY_RESULT_64_BIT));
+  char name[32];
+  const double to_s = 1e-9 * qvk.ticks_to_nanoseconds;
+  for(int i=0;i<q->cnt-1;i+=2)
+  {
+    snprintf(name, sizeof(name), "%"PRItkn" %"PRItkn, dt_token_str(q->name[i]), dt_token_str(q->kernel[i]));
+    dt_profile_gpu_span(name,
+        q->cpu_submit + (q->pool_results[i  ] - q->pool_results[0]) * to_s,
+        q->cpu_submit + (q->pool_results[i+1] - q->pool_results[0]) * to_s);
+  }
+  q->cpu_submit = 0.0; // don't write these again
+  return VK_SUCCESS;
+}
+
+// size of the largest device local memory heap. this is what all our
+// images and buffers need to fit into.
+static inline uint64_t
+device_memory_budget()
+{
+  uint64_t budget = 0;
+  for(uint32_t i=0;i<qvk.mem_properties.memoryHeapCount;i++)
+    if(qvk.mem_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+      budget = MAX(budget, qvk.mem_properties.memoryHeaps[i].size);
+  return budget;
+}
+
 // free all buffers which we are done with now that the node
 // has been processed. that is: all inputs and all of our outputs
 // which aren't connected to another node.
@@ -1458,6 +1547,7 @@ modify_roi_out(dt_graph_t *graph, dt_module_t *module)
   if(!module->disabled && module->so->modify_roi_out)
   {
     module->so->modify_roi_out(graph, module);
+    dt_graph_tile_roi_out(graph, module); // tiled sources only pass on part of the image
     // mark roi in of all outputs as uninitialised:
     for(int i=0;i<module->num_connectors;i++)
       if(dt_connector_output(module->connector+i))
@@ -1602,6 +1692,14 @@ void dt_token_print(dt_token_t t)
   fprintf(stderr, "token: %"PRItkn"\n", dt_token_str(t));
 }
 
+// sinks that want their input copied back to the host: modules with a
+// write_sink() callback and the writers of the disk cache
+static inline int
+node_downloads(dt_node_t *node)
+{
+  return node->module->so->write_sink || node->kernel == dt_token("ckpt");
+}
+
 static VkResult
 record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
 {
@@ -1640,7 +1738,6 @@ record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
     }
     return VK_SUCCESS;
   }
-  // TODO: extend the runflag to only switch on modules *after* cached input/changed parameters
 
   // special case for end of pipeline and thumbnail creation:
   if(graph->thumbnail_image &&
@@ -1705,7 +1802,7 @@ record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
     {
       // this needs to prepare the frame we're actually reading.
       // for feedback connections, this is crossed over.
-      if(!((node->connector[i].type == dt_token("sink")) && node->module->so->write_sink))
+      if(!((node->connector[i].type == dt_token("sink")) && node_downloads(node)))
       {
         if(!(node->connector[i].flags & s_conn_dynamic_array))
           for(int k=0;k<MAX(1,node->connector[i].array_length);k++)
@@ -1793,7 +1890,7 @@ record_command_buffer(dt_graph_t *graph, dt_node_t *node, int runflag)
   }};
   const int f = graph->frame % 2;
   const int yuv = node->connector[0].format == dt_token("yuv");
-  if(dt_node_sink(node) && node->module->so->write_sink)
+  if(dt_node_sink(node) && node_downloads(node))
   { // only schedule copy back if the node actually asks for it
     if(dt_connector_ssbo(node->connector+0))
     {
@@ -1988,7 +2085,11 @@ create_nodes(dt_graph_t *graph, dt_module_t *module, uint64_t *uniform_offset)
   const int nodes_begin = graph->num_nodes;
   // TODO: if roi size/scale does not match, insert resample node!
   // TODO: where? inside create_nodes? or we fix it afterwards?
-  if(module->disabled)
+  const int cached = module->checkpoint && dt_graph_checkpoint_read_nodes(graph, module);
+  if(cached)
+  { // the output is read from the disk cache, nothing to do upstream
+  }
+  else if(module->disabled)
   {
     int mc_in = -1, mc_out = -1;
     for(int i=0;i<module->num_connectors;i++)
@@ -2047,6 +2148,7 @@ create_nodes(dt_graph_t *graph, dt_module_t *module, uint64_t *uniform_offset)
     for(int i=0;i<module->num_connectors;i++)
       dt_connector_copy(graph, module, i, nodeid, i);
   }
+  if(!cached) dt_graph_checkpoint_write_nodes(graph, module);
 
   module->uniform_offset = u_offset;
   module->uniform_size   = u_size;
@@ -2074,6 +2176,187 @@ create_nodes(dt_graph_t *graph, dt_module_t *module, uint64_t *uniform_offset)
   }
 }
 
+// walk all modules in post order and determine roi on all outputs
+static void
+roi_out_pass(
+    dt_graph_t     *graph,
+    const uint32_t *modid,
+    int             cnt,
+    int             main_input_module)
+{
+  if(main_input_module >= 0) // may set metadata required by others (such as find the right lut)
+    modify_roi_out(graph, graph->module + main_input_module);
+  for(int i=0;i<cnt;i++)
+    modify_roi_out(graph, graph->module + modid[i]);
+  for(int i=0;i<cnt;i++) // potentially init remaining feedback rois:
+    if(graph->module[modid[i]].connector[0].roi.full_wd == 0)
+      modify_roi_out(graph, graph->module + modid[i]);
+}
+
+// nodes bake the raw metadata into their push constants, but not the exif shot info
+static int
+img_param_equal(
+    const dt_image_params_t *a,
+    const dt_image_params_t *b)
+{
+  return !memcmp(a, b, offsetof(dt_image_params_t, datetime)) &&
+         !strncmp(a->maker, b->maker, sizeof(a->maker)) &&
+         !strncmp(a->model, b->model, sizeof(a->model)) &&
+         !memcmp(&a->snd_format, &b->snd_format, sizeof(*a) - offsetof(dt_image_params_t, snd_format));
+}
+
+int dt_graph_roi_changed(dt_graph_t *graph)
+{
+  uint32_t modid[100];
+  assert(sizeof(modid)/sizeof(modid[0]) >= graph->num_modules);
+  int cnt = 0;
+  dt_module_t *const arr = graph->module;
+  const int arr_cnt = graph->num_modules;
+#define TRAVERSE_POST \
+  modid[cnt++] = curr;
+#include "graph-traverse.inc"
+
+  int main_input_module = -1;
+  for(int i=0;i<cnt;i++)
+    if(!strncmp(dt_token_str(graph->module[modid[i]].name), "i-", 2) &&
+        graph->module[modid[i]].inst == dt_token("main"))
+      main_input_module = modid[i];
+
+  // remember what the nodes have been created for:
+  dt_roi_t          *roi = malloc(sizeof(dt_roi_t)*DT_MAX_CONNECTORS*cnt);
+  dt_image_params_t *img = malloc(sizeof(dt_image_params_t)*cnt);
+  for(int i=0;i<cnt;i++)
+  {
+    const dt_module_t *mod = graph->module + modid[i];
+    img[i] = mod->img_param;
+    for(int j=0;j<mod->num_connectors;j++)
+      roi[DT_MAX_CONNECTORS*i+j] = mod->connector[j].roi;
+  }
+
+  // same as the first two passes of dt_graph_run, but don't touch the nodes:
+  roi_out_pass(graph, modid, cnt, main_input_module);
+  for(int i=cnt-1;i>=0;i--)
+    if(graph->module[modid[i]].connector[0].roi.full_wd > 0)
+      modify_roi_in(graph, graph->module+modid[i]);
+
+  int changed = 0;
+  for(int i=0;i<cnt&&!changed;i++)
+  {
+    const dt_module_t *mod = graph->module + modid[i];
+    if(!img_param_equal(img+i, &mod->img_param)) changed = 1;
+    for(int j=0;j<mod->num_connectors;j++)
+      if(memcmp(roi+DT_MAX_CONNECTORS*i+j, &mod->connector[j].roi, sizeof(dt_roi_t))) changed = 1;
+  }
+  free(roi);
+  free(img);
+  return changed;
+}
+
+// which allocator an output connector takes its memory from
+static inline int
+connector_heap(dt_connector_t *c)
+{
+  if(!dt_connector_ssbo(c)) return 0; // graph->heap
+  return c->type == dt_token("source") ? 2 : 1; // heap_staging or heap_ssbo
+}
+
+// do any of the images of the two output connectors share memory?
+static int
+connector_images_overlap(dt_graph_t *graph, int n0, int c0, int n1, int c1)
+{
+  dt_connector_t *a = graph->node[n0].connector + c0;
+  dt_connector_t *b = graph->node[n1].connector + c1;
+  for(int f0=0;f0<MAX(1,a->frames);f0++) for(int k0=0;k0<MAX(1,a->array_length);k0++)
+  {
+    const dt_connector_image_t *i0 = dt_graph_connector_image(graph, n0, c0, k0, f0);
+    if(!i0 || !i0->size) continue;
+    for(int f1=0;f1<MAX(1,b->frames);f1++) for(int k1=0;k1<MAX(1,b->array_length);k1++)
+    {
+      const dt_connector_image_t *i1 = dt_graph_connector_image(graph, n1, c1, k1, f1);
+      if(!i1 || !i1->size) continue;
+      if(i0->offset < i1->offset + i1->size && i1->offset < i0->offset + i0->size)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+// intermediate buffers share memory with others that are not alive at the
+// same time. the output of a node is still intact if no other output in
+// the same memory has been written after it, nor will be in this run.
+static int
+output_resident(
+    dt_graph_t     *graph,
+    const uint32_t *nodeid,
+    int             cnt,
+    const uint8_t  *dirty,
+    int             mi,
+    int             mc)
+{
+  const uint64_t written = graph->node[mi].written;
+  if(!written) return 0;
+  const int heap = connector_heap(graph->node[mi].connector + mc);
+  for(int i=0;i<cnt;i++)
+  {
+    dt_node_t *node = graph->node + nodeid[i];
+    if(nodeid[i] == mi || (!dirty[nodeid[i]] && node->written <= written)) continue;
+    for(int c=0;c<node->num_connectors;c++)
+      if(dt_connector_output(node->connector+c) &&
+         connector_heap(node->connector+c) == heap &&
+         connector_images_overlap(graph, mi, mc, nodeid[i], c))
+        return 0;
+  }
+  return 1;
+}
+
+// mark all nodes which need to run because the params of their module changed
+// since the last run, or because they depend on such a node. returns the
+// number of dirty nodes, or -1 if the clean inputs of the dirty nodes have
+// been overwritten in the meantime and everything needs to run.
+static int
+find_dirty_nodes(
+    dt_graph_t     *graph,
+    const uint32_t *nodeid,
+    int             cnt,
+    uint8_t        *dirty)
+{
+  int num_dirty = 0;
+  memset(dirty, 0, graph->num_nodes);
+  for(int i=0;i<cnt;i++)
+  { // post order: everything we depend on has been visited
+    dt_node_t *node = graph->node + nodeid[i];
+    const dt_module_t *mod = node->module;
+    if(mod->param_size)
+    {
+      const uint64_t off = mod->param - graph->params_pool;
+      if(off + mod->param_size > graph->params_last_size ||
+         memcmp(graph->params_last + off, mod->param, mod->param_size))
+        dirty[nodeid[i]] = 1;
+    }
+    for(int c=0;c<node->num_connectors;c++)
+    {
+      dt_connector_t *cn = node->connector + c;
+      if(cn->flags & s_conn_feedback) return -1; // needs the previous frame
+      if(dt_connector_input(cn) && cn->connected_mi >= 0 && dirty[cn->connected_mi])
+        dirty[nodeid[i]] = 1;
+    }
+    num_dirty += dirty[nodeid[i]];
+  }
+  for(int i=0;i<cnt;i++)
+  { // now check that the clean inputs of dirty nodes are still there
+    if(!dirty[nodeid[i]]) continue;
+    dt_node_t *node = graph->node + nodeid[i];
+    for(int c=0;c<node->num_connectors;c++)
+    {
+      dt_connector_t *cn = node->connector + c;
+      if(dt_connector_input(cn) && cn->connected_mi >= 0 && !dirty[cn->connected_mi] &&
+         !output_resident(graph, nodeid, cnt, dirty, cn->connected_mi, cn->connected_mc))
+        return -1;
+    }
+  }
+  return num_dirty;
+}
+
 VkResult dt_graph_run(
     dt_graph_t     *graph,
     dt_graph_run_t  run)
@@ -2082,6 +2365,22 @@ VkResult dt_graph_run(
   dt_module_flags_t module_flags = 0;
   const int f  = graph->frame % 2;     // recording this pipeline now
   const int fp = (graph->frame+1) % 2; // waiting for the previous frame
+  const int incremental = graph->incremental;
+  graph->incremental = 0; // until we successfully ran through
+
+  // keep the inputs of the module currently edited in the gui around, so
+  // slider changes only need to run the nodes from there on. only do that
+  // if the last allocation left plenty of headroom:
+  const uint64_t vmsize_last = graph->heap.vmsize + graph->heap_ssbo.vmsize;
+  const uint64_t budget = device_memory_budget();
+  const int pin = graph->gui_attached && graph->active_module >= 0 &&
+    graph->active_module < graph->num_modules &&
+    vmsize_last && (!budget || 2*vmsize_last < budget);
+  // the gui switched to another module since then. the reference counts are
+  // only computed during allocation, so redo that. the images move, so all
+  // nodes run again, but the rois and nodes stay:
+  if(pin && graph->active_module != graph->pinned_module)
+    run |= s_graph_run_alloc | s_graph_run_record_cmd_buf | s_graph_run_upload_source;
 
   if(run & s_graph_run_alloc)
     QVKLR(&qvk.queue_mutex, vkDeviceWaitIdle(qvk.device));
@@ -2156,15 +2455,7 @@ VkResult dt_graph_run(
   // "int curr" will be the current node
   // walk all inputs and determine roi on all outputs
   if(run & s_graph_run_roi)
-  {
-    if(main_input_module >= 0) // may set metadata required by others (such as find the right lut)
-      modify_roi_out(graph, graph->module + main_input_module);
-    for(int i=0;i<cnt;i++)
-      modify_roi_out(graph, graph->module + modid[i]);
-    for(int i=0;i<cnt;i++) // potentially init remaining feedback rois:
-      if(graph->module[modid[i]].connector[0].roi.full_wd == 0)
-        modify_roi_out(graph, graph->module + modid[i]);
-  }
+    roi_out_pass(graph, modid, cnt, main_input_module);
 
 
   // we want to make sure the last output/display is initialised.
@@ -2347,6 +2638,24 @@ VkResult dt_graph_run(
     // this is needed for memory allocation later:
     for(int i=0;i<cnt;i++)
       count_references(graph, graph->node+nodeid[i]);
+    // pin the inputs of the active module as decided above:
+    graph->pinned_module = pin ? graph->active_module : -1;
+    if(pin)
+    {
+      for(int i=0;i<cnt;i++)
+      {
+        dt_node_t *node = graph->node + nodeid[i];
+        if(node->module != graph->module + graph->active_module) continue;
+        for(int c=0;c<node->num_connectors;c++)
+        {
+          const int mi = node->connector[c].connected_mi, mc = node->connector[c].connected_mc;
+          if(dt_connector_input(node->connector+c) && mi >= 0 &&
+             graph->node[mi].module != node->module &&
+             !(node->connector[c].flags & s_conn_feedback))
+            graph->node[mi].connector[mc].connected_mi++; // one more reference that is never freed
+        }
+      }
+    }
     // free pipeline resources if previously allocated anything:
     dt_vkalloc_nuke(&graph->heap);
     dt_vkalloc_nuke(&graph->heap_ssbo);
@@ -2363,6 +2672,22 @@ VkResult dt_graph_run(
       QVKR(alloc_outputs(graph, graph->node+nodeid[i]));
       QVKR(free_inputs  (graph, graph->node+nodeid[i]));
     }
+    // the above only recorded the lifetimes, now that we know all of them
+    // assign the offsets. nothing is bound yet.
+    dt_vkalloc_plan(&graph->heap);
+    dt_vkalloc_plan(&graph->heap_ssbo);
+    dt_log(s_log_mem, "planned images  %g MB (peak live %g MB)",
+        graph->heap.vmsize/(1024.0*1024.0), graph->heap.peak_rss/(1024.0*1024.0));
+    dt_log(s_log_mem, "planned buffers %g MB (peak live %g MB)",
+        graph->heap_ssbo.vmsize/(1024.0*1024.0), graph->heap_ssbo.peak_rss/(1024.0*1024.0));
+    // fail gracefully instead of letting the driver run out of memory. the
+    // caller may retry with a smaller output roi (see dt_graph_export()).
+    if(budget && graph->heap.vmsize + graph->heap_ssbo.vmsize > budget)
+    {
+      dt_log(s_log_pipe|s_log_err, "graph needs %g MB of device memory, but the device only has %g MB!",
+          (graph->heap.vmsize + graph->heap_ssbo.vmsize)/(1024.0*1024.0), budget/(1024.0*1024.0));
+      return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
   }
 
   if(graph->heap.vmsize > graph->vkmem_size)
@@ -2615,17 +2940,42 @@ VkResult dt_graph_run(
     double upload_beg = dt_time();
     uint8_t *mapped = 0;
     QVKR(vkMapMemory(qvk.device, graph->vkmem_staging, 0, VK_WHOLE_SIZE, 0, (void**)&mapped));
-    for(int n=0;n<graph->num_nodes;n++)
-    { // for all source nodes:
-      dt_node_t *node = graph->node + n;
+    for(int i=0;i<cnt;i++)
+    { // for all source nodes we need (cached modules cut off the ones upstream):
+      dt_node_t *node = graph->node + nodeid[i];
       if(dt_node_source(node))
       {
-        if(node->module->so->read_source)
+        if(node->kernel == dt_token("ckpt"))
+        {
+          if(run & s_graph_run_upload_source)
+          {
+            const double read_beg = dt_time();
+            if(dt_graph_checkpoint_read(node, mapped + node->connector[0].offset_staging))
+            { // the nodes upstream are gone, we can't make up for it now
+              vkUnmapMemory(qvk.device, graph->vkmem_staging);
+              if(mutex) threads_mutex_unlock(mutex);
+              return VK_INCOMPLETE;
+            }
+            profile_node(node, "read_source", read_beg);
+          }
+        }
+        else if(node->module->so->read_source)
         {
           int run_node = (node->flags & s_module_request_read_source) ||
                          (run & s_graph_run_upload_source);
           const int c = 0;
-          if(run_node || (dynamic_array && (node->connector[c].flags & s_conn_dynamic_array)))
+          if(run_node && dt_graph_tile_source(graph, node->module))
+          { // copy the tile out of the full image
+            const double read_beg = dt_time();
+            if(dt_graph_tile_read_source(graph, node, mapped + node->connector[c].offset_staging))
+            {
+              vkUnmapMemory(qvk.device, graph->vkmem_staging);
+              if(mutex) threads_mutex_unlock(mutex);
+              return VK_ERROR_OUT_OF_HOST_MEMORY;
+            }
+            profile_node(node, "read_source", read_beg);
+          }
+          else if(run_node || (dynamic_array && (node->connector[c].flags & s_conn_dynamic_array)))
           {
             for(int a=0;a<MAX(1,node->connector[c].array_length);a++)
             {
@@ -2635,8 +2985,10 @@ VkResult dt_graph_run(
                 node->connector[c].array_req[a] = 0; // clear image load request
               }
               dt_read_source_params_t p = { .node = node, .c = c, .a = a };
+              const double read_beg = dt_time();
               node->module->so->read_source(node->module,
                   mapped + node->connector[c].offset_staging, &p);
+              profile_node(node, "read_source", read_beg);
               if(node->connector[c].array_length > 1)
               {
                 if(!dt_graph_connector_image(graph, node-graph->node, c, a, graph->frame)->image)
@@ -2697,6 +3049,7 @@ VkResult dt_graph_run(
     vkUnmapMemory(qvk.device, graph->vkmem_staging);
     double upload_end = dt_time();
     dt_log(s_log_perf, "upload source total:\t%8.3f ms", 1000.0*(upload_end-upload_beg));
+    dt_profile_span("pipe", "upload source", upload_beg, upload_end);
   }
   if(mutex) threads_mutex_unlock(mutex);
 
@@ -2711,11 +3064,29 @@ VkResult dt_graph_run(
     double rt_end = dt_time();
     dt_log(s_log_perf, "create raytrace accel:\t%8.3f ms", 1000.0*(rt_end-rt_beg));
     rt_beg = rt_end;
+    // if only params changed since the last complete run, only record the
+    // nodes after the modules that changed and keep the rest of the images:
+    uint8_t dirty[2000];
+    int num_dirty = -1;
+    if(incremental && graph->gui_attached && graph->params_last &&
+       graph->frame_cnt <= 1 && !dynamic_array &&
+      !(run & (s_graph_run_roi | s_graph_run_create_nodes | s_graph_run_alloc |
+               s_graph_run_upload_source | s_graph_run_before_active)) &&
+      !(module_flags & (s_module_request_read_source | s_module_request_write_sink |
+                        s_module_request_read_geo)))
+      num_dirty = find_dirty_nodes(graph, nodeid, cnt, dirty);
+    if(num_dirty >= 0)
+      dt_log(s_log_perf, "incremental run:\t%d/%d nodes", num_dirty, cnt);
     for(int i=0;i<cnt;i++)
+    {
+      if(num_dirty >= 0 && !dirty[nodeid[i]]) continue;
       QVKR(record_command_buffer(graph, graph->node+nodeid[i], run_all ||
           (graph->node[nodeid[i]].module->flags & s_module_request_read_source)));
+      graph->node[nodeid[i]].written = ++graph->recorded;
+    }
     rt_end = dt_time();
     dt_log(s_log_perf, "record command buffer:\t%8.3f ms", 1000.0*(rt_end-rt_beg));
+    dt_profile_span("pipe", "record command buffer", rt_beg, rt_end);
     QVKR(vkEndCommandBuffer(graph->command_buffer[f]));
   }
 } // end scope, done with nodes
@@ -2766,11 +3137,15 @@ VkResult dt_graph_run(
   if(run & s_graph_run_record_cmd_buf)
   {
     vkResetFences(qvk.device, 1, &graph->command_fence[f]);
+    graph->query[f].cpu_submit = dt_time();
     QVKLR(graph->queue_mutex, vkQueueSubmit(graph->queue, 1, &submit, graph->command_fence[f]));
+    const double wait_beg = dt_time();
     if(run & s_graph_run_wait_done) // timeout in nanoseconds, 30 is about 1s
       QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[f], VK_TRUE, 1ul<<40)); // wait for our command buffer
     else
       QVKR(vkWaitForFences(qvk.device, 1, &graph->command_fence[fp], VK_TRUE, 1ul<<40)); // wait for previous command buffer
+    dt_profile_span("pipe", "wait for fence", wait_beg, dt_time());
+    QVKR(profile_gpu(graph, graph->query + ((run & s_graph_run_wait_done) ? f : fp)));
   }
   
   // XXX FIXME: this is a race condition for multi-frames. we'll need to wait until download is complete before starting the other command buffer!
@@ -2782,7 +3157,18 @@ VkResult dt_graph_run(
     for(int n=0;n<graph->num_nodes;n++)
     { // for all sink nodes:
       dt_node_t *node = graph->node + n;
-      if(dt_node_sink(node))
+      if(dt_node_sink(node) && node->kernel == dt_token("ckpt"))
+      {
+        if(run & s_graph_run_download_sink)
+        {
+          uint8_t *mapped = 0;
+          QVKR(vkMapMemory(qvk.device, graph->vkmem_staging, 0, VK_WHOLE_SIZE,
+                0, (void**)&mapped));
+          dt_graph_checkpoint_write(node, mapped + node->connector[0].offset_staging);
+          vkUnmapMemory(qvk.device, graph->vkmem_staging);
+        }
+      }
+      else if(dt_node_sink(node))
       {
         if(node->module->so->write_sink &&
           ((node->module->flags & s_module_request_write_sink) ||
@@ -2791,8 +3177,10 @@ VkResult dt_graph_run(
           uint8_t *mapped = 0;
           QVKR(vkMapMemory(qvk.device, graph->vkmem_staging, 0, VK_WHOLE_SIZE,
                 0, (void**)&mapped));
+          const double write_beg = dt_time();
           node->module->so->write_sink(node->module,
               mapped + node->connector[0].offset_staging);
+          profile_node(node, "write_sink", write_beg);
           vkUnmapMemory(qvk.device, graph->vkmem_staging);
         }
       }
@@ -2837,6 +3225,21 @@ VkResult dt_graph_run(
     graph->query[fp].last_frame_duration = (graph->query[fp].pool_results[graph->query[fp].cnt-1]-graph->query[fp].pool_results[0])*1e-6 * qvk.ticks_to_nanoseconds;
     dt_log(s_log_perf, "total time:\t%8.3f ms", graph->query[fp].last_frame_duration);
   }
+  if(graph->gui_attached && (run & s_graph_run_record_cmd_buf))
+  { // remember the params to find out what changed in the next run
+    if(graph->params_last_size < graph->params_end)
+    {
+      free(graph->params_last);
+      graph->params_last = malloc(graph->params_end);
+    }
+    if(graph->params_last)
+    {
+      memcpy(graph->params_last, graph->params_pool, graph->params_end);
+      graph->params_last_size = graph->params_end;
+      graph->incremental = 1;
+    }
+    else graph->params_last_size = 0;
+  }
   // reset run flags:
   graph->runflags = 0;
   return VK_SUCCESS;
@@ -2890,12 +3293,15 @@ void dt_graph_reset(dt_graph_t *g)
   dt_raytrace_graph_reset(g);
   g->gui_attached = 0;
   g->gui_msg = 0;
-  g->active_module = 0;
+  g->active_module = -1;
+  g->pinned_module = -1;
   g->lod_scale = 0;
   g->runflags = 0;
   g->frame = 0;
   g->output_wd = 0;
   g->output_ht = 0;
+  g->warm_structure = 0;
+  g->incremental = 0;
   g->thumbnail_image = 0;
   g->query[0].cnt = g->query[1].cnt = 0;
   g->params_end = 0;
@@ -32,9 +32,28 @@ typedef struct dt_graph_query_t
   dt_token_t  *name;
   dt_token_t  *kernel;
   float        last_frame_duration; // for convenience the last frame time in milliseconds
+  double       cpu_submit;          // dt_time() when this was submitted, to place gpu spans in profiles
 }
 dt_graph_query_t;
 
+// per module state of sources during a tiled run
+typedef struct dt_graph_tile_source_t
+{
+  int                   tiled;         // set in the roi pass if this source only passes on the tile
+  uint8_t              *buf;           // host copy of its full image, read on the first tile
+}
+dt_graph_tile_source_t;
+
+// part of the input images processed by a tiled run, see pipe/graph-tile.h
+typedef struct dt_graph_tile_t
+{
+  int                   x, y, wd, ht;  // in pixels of the full main input image. wd == 0: no tiling
+  uint32_t              full_wd, full_ht; // size of the full main input image
+  int                   src_cnt;       // number of entries in src, one per module
+  dt_graph_tile_source_t *src;
+}
+dt_graph_tile_t;
+
 // the graph is stored as list of modules and list of nodes.
 // these have connectors with detailed buffer information which
 // also hold the id to the other connected module or node. thus,
@@ -108,6 +127,7 @@ typedef struct dt_graph_t
   dt_graph_run_t        runflags;      // used to trigger next runflags/invalidate things
   int                   lod_scale;     // scale output down by this factor. default = 1.
   int                   active_module; // currently active module, relevant for runflags
+  int                   pinned_module; // module whose inputs the last allocation kept around, or -1
 
   int                   frame;
   int                   frame_cnt;     // number of frames to compute
@@ -117,6 +137,7 @@ typedef struct dt_graph_t
   VkImage               thumbnail_image;
   int                   output_wd;
   int                   output_ht;
+  dt_graph_tile_t       tile;          // only process part of the image, for exports too large for the device
   void                 *io_mutex;      // if this is set to != 0 will be locked during read_source() calls
 
   int                   gui_attached;  // can't free the output images while still used etc.
@@ -125,6 +146,13 @@ typedef struct dt_graph_t
   char                  basedir[PATH_MAX];// copy of the global search directory such that modules can access it
 
   dt_image_params_t     main_img_param;// will be copied over from the i-*:main module after modify_roi_out
+  uint64_t              warm_structure;// hash of the config structure the nodes were last created for by dt_graph_export, or 0
+
+  // incremental runs for the gui: only nodes after modules with changed params are recorded
+  uint8_t              *params_last;   // copy of params_pool after the last complete run
+  uint32_t              params_last_size;
+  int                   incremental;   // non-zero if the last run left the images intact for an incremental run
+  uint64_t              recorded;      // counts recorded nodes, to stamp dt_node_t::written
 #ifdef DEBUG_MARKERS
   dt_stringpool_t       debug_markers; // store string names of vk objects here
 #endif
@@ -141,6 +169,12 @@ VkResult dt_graph_run(
     dt_graph_t     *graph,
     dt_graph_run_t  run);
 
+// run the roi passes on the modules only, and return non-zero if any region
+// of interest or image parameter changed compared to when the nodes were
+// created. if not, new inputs can be processed by uploading sources and
+// recording the command buffer, without s_graph_run_create_nodes/alloc.
+int dt_graph_roi_changed(dt_graph_t *graph);
+
 void dt_token_print(dt_token_t t);
 
 VkResult dt_graph_create_shader_module(
@@ -40,49 +40,49 @@ int dt_module_add(
   mod->committed_param_size = 0;
   mod->committed_param = 0;
   mod->flags = 0;
+  mod->checkpoint = 0;
+  mod->checkpoint_key = 0;
   mod->keyframe_cnt = 0;
 
-  // copy over initial info from module class:
-  for(int i=0;i<dt_pipe.num_modules;i++)
-  { // TODO: speed this up somehow?
-    if(name == dt_pipe.module[i].name)
+  // copy over initial info from module class, loads it on first use:
+  mod->num_connectors = 0;
+  dt_module_so_t *so = dt_pipe_get_module(name);
+  if(so)
+  {
+    mod->so = so;
+    // init params:
+    mod->param_size = 0;
+    if(mod->so->num_params)
     {
-      mod->so = dt_pipe.module + i;
-      // init params:
-      mod->param_size = 0;
-      if(mod->so->num_params)
+      dt_ui_param_t *p = mod->so->param[mod->so->num_params-1];
+      mod->param_size = p->offset + dt_ui_param_size(p->type, p->cnt);
+      mod->param = graph->params_pool + graph->params_end;
+      graph->params_end += mod->param_size;
+      assert(graph->params_end <= graph->params_max);
+    }
+    for(int p=0;p<mod->so->num_params;p++)
+    { // init default params
+      dt_ui_param_t *pp = mod->so->param[p];
+      memcpy(mod->param + pp->offset, pp->val, dt_ui_param_size(pp->type, pp->cnt));
+    }
+    for(int c=0;c<mod->so->num_connectors;c++)
+    { // init connectors from our module class:
+      mod->connector[c] = mod->so->connector[c];
+      dt_connector_t *cn = mod->connector+c;
+      cn->array_length = 1; // modules don't support arrays for now
+      // set connector's ref id's to -1 or ref count to 0 if a write|source node
+      if(cn->type == dt_token("read") || cn->type == dt_token("sink"))
       {
-        dt_ui_param_t *p = mod->so->param[mod->so->num_params-1];
-        mod->param_size = p->offset + dt_ui_param_size(p->type, p->cnt);
-        mod->param = graph->params_pool + graph->params_end;
-        graph->params_end += mod->param_size;
-        assert(graph->params_end <= graph->params_max);
+        cn->connected_mi = -1;
+        cn->connected_mc = -1;
       }
-      for(int p=0;p<mod->so->num_params;p++)
-      { // init default params
-        dt_ui_param_t *pp = mod->so->param[p];
-        memcpy(mod->param + pp->offset, pp->val, dt_ui_param_size(pp->type, pp->cnt));
-      }
-      for(int c=0;c<mod->so->num_connectors;c++)
-      { // init connectors from our module class:
-        mod->connector[c] = mod->so->connector[c];
-        dt_connector_t *cn = mod->connector+c;
-        cn->array_length = 1; // modules don't support arrays for now
-        // set connector's ref id's to -1 or ref count to 0 if a write|source node
-        if(cn->type == dt_token("read") || cn->type == dt_token("sink"))
-        {
-          cn->connected_mi = -1;
-          cn->connected_mc = -1;
-        }
-        else if(cn->type == dt_token("write") || cn->type == dt_token("source"))
-        {
-          cn->connected_mi = 0;
-          cn->connected_mc = 0;
-        }
+      else if(cn->type == dt_token("write") || cn->type == dt_token("source"))
+      {
+        cn->connected_mi = 0;
+        cn->connected_mc = 0;
       }
-      mod->num_connectors = mod->so->num_connectors;
-      break;
     }
+    mod->num_connectors = mod->so->num_connectors;
   }
   if(mod->num_connectors == 0)
   { // if connectors still empty fail
@@ -134,6 +134,7 @@ int dt_module_remove(
   graph->module[modid].inst = 0;
   graph->module[modid].connector[0].type = 0; // to avoid being detected as sink
   graph->module[modid].flags = 0;
+  graph->module[modid].checkpoint = 0;
   graph->module[modid].num_connectors = 0;
   free(graph->module[modid].keyframe);
   graph->module[modid].keyframe_size = 0;
@@ -115,6 +115,9 @@ typedef struct dt_module_t
 
   dt_module_flags_t flags; // flags to signal special requests during graph processing
 
+  int      checkpoint;     // keep the output in the disk cache, see graph-checkpoint.h
+  uint64_t checkpoint_key; // hash of everything the output depends on, 0 if it can't be cached
+
   // this is useful for instance for a cpu caching of
   // input data decoded from disk inside a module:
   void *data; // if you indeed must store your own data.
@@ -1,8 +1,8 @@
 #include "modules/api.h"
+#include "core/bc1.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <zlib.h>
 
 // this callback is responsible to set the full_{wd,ht} dimensions on the
 // regions of interest on all "write"|"source" channels
@@ -12,24 +12,12 @@ void modify_roi_out(
 {
   // load only header
   const char *filename = dt_module_param_string(mod, 0);
-
-  uint32_t header[4] = {0};
-  gzFile f = gzopen(filename, "rb");
-  if(!f || gzread(f, header, sizeof(uint32_t)*4) != sizeof(uint32_t)*4)
-  {
-    fprintf(stderr, "[i-bc1] %s: can't open file!\n", filename);
-    if(f) gzclose(f);
-  }
-  // checks: magic != dt_token("bc1z") || version != 1
-  if(header[0] != dt_token("bc1z") || header[1] != 1)
-  {
-    fprintf(stderr, "[i-bc1] %s: wrong magic number or version!\n", filename);
-    gzclose(f);
-  }
-  const uint32_t wd = 4*(header[2]/4), ht = 4*(header[3]/4);
+  uint32_t wd = 0, ht = 0;
+  gzFile f = dt_bc1_open(filename, &wd, &ht);
+  if(!f) fprintf(stderr, "[i-bc1] %s: can't open file or wrong magic number/version!\n", filename);
+  else gzclose(f);
   mod->connector[0].roi.full_wd = wd;
   mod->connector[0].roi.full_ht = ht;
-  gzclose(f);
 }
 
 int read_source(
@@ -38,27 +26,12 @@ int read_source(
     dt_read_source_params_t *p)
 {
   const char *filename = dt_module_param_string(mod, 0);
-
-  uint32_t header[4] = {0};
-  gzFile f = gzopen(filename, "rb");
-  if(!f || gzread(f, header, sizeof(uint32_t)*4) != sizeof(uint32_t)*4)
-  {
-    fprintf(stderr, "[i-bc1] %s: can't open file!\n", filename);
-    if(f) gzclose(f);
-    return 1;
-  }
-  // checks: magic != dt_token("bc1z") || version != 1
-  if(header[0] != dt_token("bc1z") || header[1] != 1)
+  uint32_t wd, ht;
+  uint8_t *data = mapped;
+  if(dt_bc1_read(filename, &wd, &ht, &data))
   {
-    fprintf(stderr, "[i-bc1] %s: wrong magic number or version!\n", filename);
-    gzclose(f);
+    fprintf(stderr, "[i-bc1] %s: can't read file!\n", filename);
     return 1;
   }
-  const uint32_t wd = 4*(header[2]/4), ht = 4*(header[3]/4);
-  // fprintf(stderr, "[i-bc1] %s magic %"PRItkn" version %u dim %u x %u\n",
-  //     filename, dt_token_str(header[0]),
-  //     header[1], header[2], header[3]);
-  gzread(f, mapped, sizeof(uint8_t)*8*(wd/4)*(ht/4));
-  gzclose(f);
   return 0;
 }
@@ -1,6 +1,7 @@
 #include "modules/api.h"
 #include "connector.h"
 #include "core/core.h"
+#include "core/threads.h"
 #include "adobe_coeff.h"
 
 #include <stdio.h>
@@ -16,10 +17,40 @@
 
 #include "video_mlv.c"
 
+// number of frames decoded ahead on the thread pool during playback
+#define MLV_PREFETCH 4
+
+typedef enum slot_state_t
+{
+  s_slot_empty = 0,
+  s_slot_queued,   // pushed to the thread pool, can still be cancelled
+  s_slot_decoding,
+  s_slot_ready,
+  s_slot_failed,
+}
+slot_state_t;
+
+typedef struct buf_t buf_t;
+typedef struct slot_t
+{ // one frame decoded ahead of time. buffers are kept for the next frame
+  uint16_t    *frame;    // decoded frame, wd*ht
+  uint8_t     *raw;      // compressed frame data
+  size_t       raw_size;
+  uint32_t     index;    // frame index
+  slot_state_t state;
+  buf_t       *dat;
+}
+slot_t;
+
 typedef struct buf_t
 {
   char         filename[256]; // opened mlv if any
   mlv_header_t video;
+
+  slot_t          slot[MLV_PREFETCH]; // protected by the mutex
+  int             refs;               // the module plus one per job in the thread pool
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
 }
 buf_t;
 
@@ -53,6 +84,127 @@ int mat3inv(float *const dst, const float *const src)
   return 0;
 }
 
+static void
+slot_work(uint32_t item, void *arg)
+{
+  slot_t *s = arg;
+  buf_t *dat = s->dat;
+  threads_mutex_lock(&dat->mutex);
+  int run = s->state == s_slot_queued;
+  if(run) s->state = s_slot_decoding; // from now on nobody else touches the slot
+  threads_mutex_unlock(&dat->mutex);
+
+  int err = 1;
+  if(run)
+  {
+    uint32_t size = 0;
+    err = mlv_read_frame(&dat->video, s->index, &s->raw, &s->raw_size, &size) ||
+          mlv_decode_frame(&dat->video, s->raw, size, s->frame);
+  }
+
+  threads_mutex_lock(&dat->mutex);
+  if(run) s->state = err ? s_slot_failed : s_slot_ready;
+  int last = --dat->refs == 0;
+  pthread_cond_broadcast(&dat->cond);
+  threads_mutex_unlock(&dat->mutex);
+  if(last)
+  { // the module is gone already, we were a cancelled job
+    threads_mutex_destroy(&dat->mutex);
+    pthread_cond_destroy(&dat->cond);
+    free(dat);
+  }
+}
+
+// cancel queued frames, wait for the ones being decoded and free the buffers.
+// cancelled jobs may still sit in a busy pool, they'll find their slot empty.
+static void
+slots_drain(buf_t *dat)
+{
+  threads_mutex_lock(&dat->mutex);
+  for(int k=0;k<MLV_PREFETCH;k++)
+    if(dat->slot[k].state == s_slot_queued) dat->slot[k].state = s_slot_empty;
+  for(int k=0;k<MLV_PREFETCH;k++)
+    while(dat->slot[k].state == s_slot_decoding)
+      pthread_cond_wait(&dat->cond, &dat->mutex);
+  for(int k=0;k<MLV_PREFETCH;k++)
+  {
+    slot_t *s = dat->slot + k;
+    free(s->frame);
+    free(s->raw);
+    s->frame    = 0;
+    s->raw      = 0;
+    s->raw_size = 0;
+    s->state    = s_slot_empty;
+  }
+  threads_mutex_unlock(&dat->mutex);
+}
+
+// queue the frames after the given one for decoding on the thread pool
+static void
+prefetch(dt_module_t *mod, uint32_t frame)
+{
+  buf_t *dat = mod->data;
+  const uint32_t cnt = MIN(mod->graph->frame_cnt, dat->video.frames);
+  const size_t frame_size = sizeof(uint16_t) * dat->video.RAWI.xRes * dat->video.RAWI.yRes;
+  threads_mutex_lock(&dat->mutex);
+  for(uint32_t f=frame+1;f<=frame+MLV_PREFETCH&&f<cnt;f++)
+  {
+    slot_t *s = 0;
+    for(int k=0;k<MLV_PREFETCH;k++)
+    {
+      slot_t *t = dat->slot + k;
+      if(t->state != s_slot_empty && t->index == f)
+      { // already there or in flight
+        s = 0;
+        break;
+      }
+      // reuse slots that are not being decoded and hold a frame outside the window
+      if(!s && t->state != s_slot_decoding &&
+          (t->state == s_slot_empty || t->index <= frame || t->index > frame + MLV_PREFETCH))
+        s = t;
+    }
+    if(!s) continue;
+    if(!s->frame) s->frame = malloc(frame_size);
+    s->index = f;
+    s->dat   = dat;
+    s->state = s_slot_queued;
+    if(threads_task("i-mlv", 1, -1, s, slot_work, 0) < 0)
+    { // pool is full, try again next frame
+      s->state = s_slot_empty;
+      break;
+    }
+    dat->refs++;
+  }
+  threads_mutex_unlock(&dat->mutex);
+}
+
+// copy the frame to the output if it has been decoded ahead of time.
+// returns zero on success.
+static int
+prefetch_take(buf_t *dat, uint32_t frame, void *mapped)
+{
+  int err = 1;
+  threads_mutex_lock(&dat->mutex);
+  for(int k=0;k<MLV_PREFETCH;k++)
+  {
+    slot_t *s = dat->slot + k;
+    if(s->state == s_slot_empty || s->index != frame) continue;
+    // not picked up by a worker yet? rather decode in place than wait for the pool:
+    if(s->state == s_slot_queued) s->state = s_slot_empty;
+    while(s->state == s_slot_decoding)
+      pthread_cond_wait(&dat->cond, &dat->mutex);
+    if(s->state == s_slot_ready)
+    {
+      memcpy(mapped, s->frame, sizeof(uint16_t) * dat->video.RAWI.xRes * dat->video.RAWI.yRes);
+      err = 0;
+    }
+    s->state = s_slot_empty;
+    break;
+  }
+  threads_mutex_unlock(&dat->mutex);
+  return err;
+}
+
 static inline int
 open_file(
     dt_module_t *mod,
@@ -62,6 +214,13 @@ open_file(
   if(dat && !strcmp(dat->filename, fname))
     return 0; // already open
 
+  if(dat->filename[0])
+  { // close the previous clip, the decode-ahead jobs reference it
+    slots_drain(dat);
+    mlv_header_cleanup(&dat->video);
+    dat->filename[0] = 0;
+  }
+
   fprintf(stderr, "[o-mlv] opening `%s'\n", fname);
 
   const char *filename = fname;
@@ -95,14 +254,21 @@ read_frame(
 {
   buf_t *dat = mod->data;
   int frame = MIN(mod->graph->frame, dat->video.MLVI.videoFrameCount-1);
-  return mlv_get_frame(
-    &dat->video, frame, mapped);
+  int err = 0;
+  if(prefetch_take(dat, frame, mapped))
+    err = mlv_get_frame(&dat->video, frame, mapped);
+  // decode the next frames while the gpu is busy with this one
+  prefetch(mod, frame);
+  return err;
 }
 
 int init(dt_module_t *mod)
 {
   buf_t *dat = malloc(sizeof(*dat));
   memset(dat, 0, sizeof(*dat));
+  dat->refs = 1;
+  threads_mutex_init(&dat->mutex, 0);
+  pthread_cond_init(&dat->cond, 0);
   mod->data = dat;
   mod->flags = s_module_request_read_source;
   return 0;
@@ -112,12 +278,21 @@ void cleanup(dt_module_t *mod)
 {
   if(!mod->data) return;
   buf_t *dat= mod->data;
+  slots_drain(dat);
   if(dat->filename[0])
   {
     mlv_header_cleanup(&dat->video);
     dat->filename[0] = 0;
   }
-  free(dat);
+  threads_mutex_lock(&dat->mutex);
+  int last = --dat->refs == 0;
+  threads_mutex_unlock(&dat->mutex);
+  if(last)
+  {
+    threads_mutex_destroy(&dat->mutex);
+    pthread_cond_destroy(&dat->cond);
+    free(dat);
+  }
   mod->data = 0;
 }
 
@@ -5,7 +5,11 @@
 #include <strings.h>
 #include <math.h>
 #include <time.h>
-#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "video_mlv.h"
 
@@ -170,95 +174,180 @@ static void close_all_chunks(FILE ** files, int entries)
   if(files) free(files);
 }
 
-// TODO: replace by qsort
+static int frame_index_compare(const void *a, const void *b)
+{
+  const mlv_frame_index_t *fa = a, *fb = b;
+  if(fa->frame_time   != fb->frame_time)   return fa->frame_time   < fb->frame_time   ? -1 : 1;
+  /* keep the order in the file for equal time stamps, like a stable sort would */
+  if(fa->chunk_num    != fb->chunk_num)    return fa->chunk_num    < fb->chunk_num    ? -1 : 1;
+  if(fa->block_offset != fb->block_offset) return fa->block_offset < fb->block_offset ? -1 : 1;
+  return 0;
+}
+
 static void frame_index_sort(mlv_frame_index_t *frame_index, uint32_t entries)
 {
   if (!entries) return;
-
-  uint32_t n = entries;
-  do
-  {
-    uint32_t new_n = 1;
-    for (uint32_t i = 0; i < n-1; ++i)
-    {
-      if (frame_index[i].frame_time > frame_index[i+1].frame_time)
-      {
-        mlv_frame_index_t tmp = frame_index[i+1];
-        frame_index[i+1] = frame_index[i];
-        frame_index[i] = tmp;
-        new_n = i + 1;
-      }
-    }
-    n = new_n;
-  } while (n > 1);
+  qsort(frame_index, entries, sizeof(frame_index[0]), frame_index_compare);
 }
 
-/* Unpack or decompress original raw data */
-int mlv_get_frame(
-    mlv_header_t *video,
-    uint64_t      frame_index,
-    uint16_t     *unpackedFrame)
+/* Frame index cache. Scanning all blocks of a long clip takes a while, so we
+ * store the result in <filename>.idx next to the clip: a header to detect
+ * changes to the chunks, the mlv_header_t as is, and the video, audio and
+ * VERS frame indices. On later opens this file is memory mapped and the
+ * indices are used in place. */
+typedef struct
 {
-  int bitdepth  = video->RAWI.raw_info.bits_per_pixel;
-  int width     = video->RAWI.xRes;
-  int height    = video->RAWI.yRes;
-  int pixel_cnt = width * height;
-
-  int chunk = video->video_index[frame_index].chunk_num;
-  uint32_t frame_size = video->video_index[frame_index].frame_size;
-  uint64_t frame_offset = video->video_index[frame_index].frame_offset;
-  uint64_t frame_header_offset = video->video_index[frame_index].block_offset;
+  char     magic[8];    /* "vkdtidx" */
+  uint32_t version;
+  uint32_t header_size; /* sizeof(mlv_header_t) */
+  uint64_t chunk_size;  /* sum of the sizes of all chunks */
+  int64_t  chunk_mtime; /* latest modification time of all chunks */
+  int32_t  filenum;
+  uint32_t pad;
+}
+mlv_idx_hdr_t;
 
-  /* How many bytes is RAW frame */
-  int raw_frame_size = (width * height * bitdepth) / 8;
-  /* Memory buffer for original RAW data */
-  uint8_t *raw_frame = malloc(raw_frame_size + 4); // additional 4 bytes for safety
+#define MLV_IDX_VERSION 1
 
-  FILE *file = video->file[chunk];
+static void mlv_idx_stat(const mlv_header_t *video, mlv_idx_hdr_t *hdr)
+{
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, "vkdtidx", 8);
+  hdr->version     = MLV_IDX_VERSION;
+  hdr->header_size = sizeof(mlv_header_t);
+  hdr->filenum     = video->filenum;
+  for(int i = 0; i < video->filenum; i++)
+  {
+    struct stat sb;
+    if(fstat(fileno(video->file[i]), &sb)) continue;
+    hdr->chunk_size += sb.st_size;
+    hdr->chunk_mtime = MAX(hdr->chunk_mtime, sb.st_mtime);
+  }
+}
 
-  fseek(file, frame_header_offset, SEEK_SET);
-  if(fread(&video->VIDF, sizeof(mlv_vidf_hdr_t), 1, file) != 1)
+/* Map the index and set up the video struct from it. Returns 0 on success. */
+static int mlv_read_index(mlv_header_t *video, const char *filename)
+{
+  char idxname[PATH_MAX];
+  snprintf(idxname, sizeof(idxname), "%s.idx", filename);
+  int fd = open(idxname, O_RDONLY);
+  if(fd < 0) return 1;
+  struct stat sb;
+  if(fstat(fd, &sb) || sb.st_size < sizeof(mlv_idx_hdr_t) + sizeof(mlv_header_t))
   {
-    free(raw_frame);
+    close(fd);
+    return 1;
+  }
+  uint8_t *map = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return 1;
+
+  mlv_idx_hdr_t expected;
+  mlv_idx_stat(video, &expected);
+  const mlv_idx_hdr_t *hdr = (const mlv_idx_hdr_t *)map;
+  const mlv_header_t *stored = (const mlv_header_t *)(hdr + 1);
+  if(memcmp(hdr, &expected, sizeof(expected)) ||
+     sb.st_size != sizeof(*hdr) + sizeof(*stored) + sizeof(mlv_frame_index_t) *
+       ((uint64_t)stored->frames + stored->audios + stored->vers_blocks))
+  { /* stale or broken, will be rewritten */
+    munmap(map, sb.st_size);
     return 1;
   }
 
-  fseek(file, frame_offset, SEEK_SET);
+  FILE **file = video->file;
+  int filenum = video->filenum;
+  memcpy(video, stored, sizeof(*video));
+  video->file     = file;
+  video->filenum  = filenum;
+  video->idx_map  = map;
+  video->idx_size = sb.st_size;
+  mlv_frame_index_t *index = (mlv_frame_index_t *)(stored + 1);
+  video->video_index = video->frames      ? index : 0; index += video->frames;
+  video->audio_index = video->audios      ? index : 0; index += video->audios;
+  video->vers_index  = video->vers_blocks ? index : 0;
+  return 0;
+}
+
+static void mlv_write_index(const mlv_header_t *video, const char *filename)
+{
+  char idxname[PATH_MAX], tmpname[PATH_MAX+10];
+  snprintf(idxname, sizeof(idxname), "%s.idx", filename);
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", idxname);
+  FILE *f = fopen(tmpname, "wb");
+  if(!f) return; /* read-only media, we'll just scan again next time */
+
+  mlv_idx_hdr_t hdr;
+  mlv_idx_stat(video, &hdr);
+  mlv_header_t stored = *video;
+  stored.file = 0;
+  stored.video_index = stored.audio_index = stored.vers_index = 0;
+  stored.audio_data = 0;
+  stored.audio_size = stored.audio_buffer_size = 0;
+  stored.frame_buf = 0;
+  stored.frame_buf_size = 0;
+  stored.idx_map = 0;
+  stored.idx_size = 0;
+
+  int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+           fwrite(&stored, sizeof(stored), 1, f) == 1 &&
+           fwrite(video->video_index, sizeof(mlv_frame_index_t), video->frames, f) == video->frames &&
+           fwrite(video->audio_index, sizeof(mlv_frame_index_t), video->audios, f) == video->audios &&
+           fwrite(video->vers_index, sizeof(mlv_frame_index_t), video->vers_blocks, f) == video->vers_blocks;
+  ok &= !fclose(f);
+  if(!ok || rename(tmpname, idxname)) unlink(tmpname);
+}
+
+/* Read the packed or lj92 compressed data of a frame. This uses pread() and
+ * does not touch the video struct, so it can run on several threads at once.
+ * The buffer is grown as needed and can be reused for the next frame. */
+int mlv_read_frame(
+    const mlv_header_t *video,
+    uint64_t            frame_index,
+    uint8_t           **buf,
+    size_t             *buf_size,
+    uint32_t           *size)
+{
+  const mlv_frame_index_t *idx = video->video_index + frame_index;
+  const int lj92 = video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92;
+  /* How many bytes is RAW frame */
+  const uint32_t raw_frame_size = (video->RAWI.xRes * video->RAWI.yRes * video->RAWI.raw_info.bits_per_pixel) / 8;
+  *size = lj92 ? idx->frame_size : raw_frame_size;
+  if(*buf_size < *size + 4)
+  { // additional 4 bytes for safety
+    free(*buf);
+    *buf_size = *size + 4;
+    *buf = malloc(*buf_size);
+  }
+  const int fd = fileno(video->file[idx->chunk_num]);
+  if(pread(fd, *buf, *size, idx->frame_offset) != *size)
+    return 1; // frame data read error
+  return 0;
+}
+
+/* Unpack or decompress raw data as returned by mlv_read_frame, thread safe */
+int mlv_decode_frame(
+    const mlv_header_t *video,
+    const uint8_t      *raw_frame,
+    uint32_t            frame_size,
+    uint16_t           *unpackedFrame)
+{
+  int bitdepth  = video->RAWI.raw_info.bits_per_pixel;
+  int width     = video->RAWI.xRes;
+  int height    = video->RAWI.yRes;
+  int pixel_cnt = width * height;
+
   if (video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92)
   {
-    if(fread(raw_frame, frame_size, 1, file) != 1)
-    { // frame data read error
-      free(raw_frame);
-      return 1;
-    }
-
     int components = 1;
     lj92 decoder_object;
-    int ret = lj92_open(&decoder_object, raw_frame, frame_size, &width, &height, &bitdepth, &components);
-    if(ret != LJ92_ERROR_NONE)
-    { // lj92 decoding failed
-      free(raw_frame);
-      return 1;
-    }
-    else
-    {
-      ret = lj92_decode(decoder_object, unpackedFrame, width * height * components, 0, NULL, 0);
-      if(ret != LJ92_ERROR_NONE)
-      { // lj92 failure
-        free(raw_frame);
-        return 1;
-      }
-    }
+    int ret = lj92_open(&decoder_object, (uint8_t *)raw_frame, frame_size, &width, &height, &bitdepth, &components);
+    if(ret != LJ92_ERROR_NONE) return 1; // lj92 decoding failed
+    ret = lj92_decode(decoder_object, unpackedFrame, width * height * components, 0, NULL, 0);
     lj92_close(decoder_object);
+    if(ret != LJ92_ERROR_NONE) return 1; // lj92 failure
   }
   else /* If not compressed just unpack to 16bit */
   {
-    if(fread(raw_frame, raw_frame_size, 1, file) != 1)
-    { // can't read frame data
-      free(raw_frame);
-      return 1;
-    }
-
     uint32_t mask = (1 << bitdepth) - 1;
 #pragma omp parallel for
     for (int i = 0; i < pixel_cnt; ++i)
@@ -272,11 +361,25 @@ int mlv_get_frame(
       unpackedFrame[i] = ((uint16_t)(data & mask));
     }
   }
-
-  free(raw_frame);
   return 0;
 }
 
+/* Unpack or decompress original raw data */
+int mlv_get_frame(
+    mlv_header_t *video,
+    uint64_t      frame_index,
+    uint16_t     *unpackedFrame)
+{
+  const int fd = fileno(video->file[video->video_index[frame_index].chunk_num]);
+  if(pread(fd, &video->VIDF, sizeof(mlv_vidf_hdr_t), video->video_index[frame_index].block_offset) != sizeof(mlv_vidf_hdr_t))
+    return 1;
+
+  uint32_t size = 0;
+  if(mlv_read_frame(video, frame_index, &video->frame_buf, &video->frame_buf_size, &size))
+    return 1;
+  return mlv_decode_frame(video, video->frame_buf, size, unpackedFrame);
+}
+
 void mlv_header_init(mlv_header_t *video)
 {
   memset(video, 0, sizeof(*video));
@@ -288,10 +391,15 @@ void mlv_header_cleanup(mlv_header_t *video)
   /* Close all MLV file chunks */
   if(video->file) close_all_chunks(video->file, video->filenum);
   /* Free all memory */
-  free(video->video_index);
-  free(video->audio_index);
-  free(video->vers_index);
+  if(video->idx_map) munmap(video->idx_map, video->idx_size);
+  else
+  {
+    free(video->video_index);
+    free(video->audio_index);
+    free(video->vers_index);
+  }
   free(video->audio_data);
+  free(video->frame_buf);
   memset(video, 0, sizeof(*video));
 }
 
@@ -303,6 +411,12 @@ int mlv_open_clip(
   video->file = load_all_chunks(filename, &video->filenum);
   if(!video->file) return MLV_ERR_OPEN; // can not open file
 
+  if(open_mode == MLV_OPEN_FULL && !mlv_read_index(video, filename))
+  {
+    mlv_read_audio(video);
+    goto preview_out;
+  }
+
   uint64_t block_num = 0; /* Number of blocks in file */
   mlv_hdr_t block_header; /* Basic MLV block header */
   uint64_t video_frames = 0; /* Number of frames in video */
@@ -619,6 +733,8 @@ int mlv_open_clip(
   /* Set VERS block count in video object */
   video->vers_blocks = vers_blocks;
 
+  if(open_mode == MLV_OPEN_FULL) mlv_write_index(video, filename);
+
   /* Reads MLV audio into buffer (video->audio_data) and sync it,
    * set full audio buffer size (video->audio_buffer_size) and
    * aligned usable audio data size (video->audio_size) */
@@ -78,6 +78,14 @@ typedef struct
 
   /* Restricted lossless raw data bit depth */
   int lossless_bpp;
+
+  /* Reused buffer for packed/compressed frame data in mlv_get_frame */
+  uint8_t * frame_buf;
+  size_t    frame_buf_size;
+
+  /* Memory mapped frame index cache, the indices above point into it if set */
+  void *    idx_map;
+  size_t    idx_size;
 }
 mlv_header_t;
 
@@ -95,3 +103,16 @@ int mlv_get_frame(
     mlv_header_t *video,
     uint64_t      frame_index,
     uint16_t     *unpackedFrame);
+
+/* Thread safe variants, to decode several frames in parallel */
+int mlv_read_frame(
+    const mlv_header_t *video,
+    uint64_t            frame_index,
+    uint8_t           **buf,
+    size_t             *buf_size,
+    uint32_t           *size);
+int mlv_decode_frame(
+    const mlv_header_t *video,
+    const uint8_t      *raw_frame,
+    uint32_t            frame_size,
+    uint16_t           *unpackedFrame);
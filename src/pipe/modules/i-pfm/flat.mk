@@ -1 +1,2 @@
+MOD_CFLAGS=-fopenmp
 pipe/modules/i-pfm/libi-pfm.so: core/half.h
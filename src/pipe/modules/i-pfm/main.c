@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 typedef struct pfminput_buf_t
 {
@@ -94,16 +96,41 @@ static int
 read_plain(
     pfminput_buf_t *pfm, uint16_t *out)
 {
-  fseek(pfm->f, pfm->data_begin, SEEK_SET);
-  uint16_t one = float_to_half(1.0f);
-  const int stride = pfm->channels == 1 ? 1 : 4;
-  for(int64_t k=0;k<pfm->width*(int64_t)pfm->height;k++)
+  // map the whole file instead of going through stdio, these may be large
+  const size_t npx = pfm->width*(size_t)pfm->height;
+  const size_t end = pfm->data_begin + sizeof(float)*pfm->channels*npx;
+  struct stat statbuf;
+  if(fstat(fileno(pfm->f), &statbuf) || statbuf.st_size < end)
   {
-    float in[3];
-    fread(in, pfm->channels, sizeof(float), pfm->f);
-    for(int i=0;i<pfm->channels;i++) out[stride*k+i] = float_to_half(CLAMP(in[i], -65000.0, 65000.0));
-    if(stride == 4) out[stride*k+3] = one;
+    fprintf(stderr, "[i-pfm] file `%s' is truncated!\n", pfm->filename);
+    return 1;
   }
+  void *data = mmap(0, end, PROT_READ, MAP_PRIVATE, fileno(pfm->f), 0);
+  if(data == MAP_FAILED) return 1;
+  madvise(data, end, MADV_SEQUENTIAL);
+  const float *in = (const float *)((const uint8_t *)data + pfm->data_begin);
+
+  if(pfm->channels == 1) float_to_half_buf(out, in, npx);
+  else
+  { // convert in blocks and expand rgb to rgba on the way
+    const uint16_t one = float_to_half(1.0f);
+    const size_t block = 4096;
+#pragma omp parallel for schedule(static)
+    for(size_t b=0;b<npx;b+=block)
+    {
+      uint16_t tmp[3*4096];
+      const size_t cnt = MIN(block, npx-b);
+      float_to_half_buf(tmp, in + 3*b, 3*cnt);
+      for(size_t k=0;k<cnt;k++)
+      {
+        out[4*(b+k)+0] = tmp[3*k+0];
+        out[4*(b+k)+1] = tmp[3*k+1];
+        out[4*(b+k)+2] = tmp[3*k+2];
+        out[4*(b+k)+3] = one;
+      }
+    }
+  }
+  munmap(data, end);
   return 0;
 }
 
@@ -3,7 +3,11 @@
 #include "mat3.h"
 #include <omp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <mutex>
+#include <condition_variable>
 #include <ctime>
 #include <math.h>
 #ifdef VKDT_USE_EXIV2
@@ -13,6 +17,7 @@
 extern "C" {
 #include "modules/api.h"
 #include "core/log.h"
+#include "core/threads.h"
 
 static rawspeed::CameraMetaData *meta = 0;
 
@@ -21,14 +26,62 @@ int rawspeed_get_number_of_processor_cores()
   return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+// the raw file contents, either memory mapped or a heap copy. the decoder
+// references this, so it has to live as long as the decoder does.
+struct raw_buffer_deleter
+{
+  void  *map  = 0;
+  size_t size = 0;
+  void operator()(const rawspeed::Buffer *b) const
+  {
+    delete b;
+    if(map) munmap(map, size);
+  }
+};
+typedef std::unique_ptr<const rawspeed::Buffer, raw_buffer_deleter> raw_buffer_t;
+
+// number of frames of a timelapse sequence to decode ahead on the thread pool
+#define RAW_PREFETCH 3
+
+typedef enum rawinput_slot_state_t
+{
+  s_slot_empty = 0,
+  s_slot_queued,   // pushed to the thread pool, can still be cancelled
+  s_slot_decoding,
+  s_slot_ready,
+  s_slot_failed,
+}
+rawinput_slot_state_t;
+
+typedef struct rawinput_buf_t rawinput_buf_t;
+typedef struct rawinput_slot_t
+{ // a raw decoded (or being decoded) ahead of time
+  std::unique_ptr<rawspeed::RawDecoder> d;
+  raw_buffer_t m;
+
+  char filename[PATH_MAX] = {0};
+  int frame = 0;
+  rawinput_slot_state_t state = s_slot_empty;
+
+  const dt_module_t *mod = 0;
+  rawinput_buf_t    *buf = 0;
+}
+rawinput_slot_t;
+
 typedef struct rawinput_buf_t
 {
   std::unique_ptr<rawspeed::RawDecoder> d;
-  std::unique_ptr<const rawspeed::Buffer> m;
+  raw_buffer_t m;
 
   char filename[PATH_MAX] = {0};
 
   int ox, oy;
+
+  // decode-ahead ring for timelapses, slot state protected by the mutex
+  rawinput_slot_t slot[RAW_PREFETCH];
+  int refs = 1;    // the module plus one per job in the thread pool
+  std::mutex mutex;
+  std::condition_variable cond;
 }
 rawinput_buf_t;
 
@@ -116,52 +169,71 @@ free_raw(dt_module_t *mod)
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
   if(mod_data->d.get()) mod_data->d.reset();
   if(mod_data->m.get()) mod_data->m.reset();
+  mod_data->filename[0] = 0;
 }
 
-int
-load_raw(
-    dt_module_t *mod,
-    const char *filename)
+// map the file into memory instead of reading it to a heap buffer first.
+// this saves a full copy of the file and lets the kernel read ahead.
+raw_buffer_t
+map_file(const char *filename)
 {
-  clock_t beg = clock();
-  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
-  if(mod_data)
-  {
-    if(!strcmp(mod_data->filename, filename))
-      return 0; // already loaded
-    else free_raw(mod); // maybe loaded the wrong one
-  }
-  else
-  {
-    assert(0); // this should be inited in init()
+  struct stat sb;
+  int fd = open(filename, O_RDONLY);
+  if(fd >= 0 && !fstat(fd, &sb) && sb.st_size > 0 && sb.st_size < UINT32_MAX)
+  { // the bit pumps may read a bit past the end. this lands in the zero filled
+    // rest of the last page, unless the file ends too close to a page boundary.
+    const size_t page  = sysconf(_SC_PAGESIZE);
+    const size_t slack = (page - sb.st_size % page) % page;
+    void *map = slack >= 64 ? mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(map != MAP_FAILED)
+    {
+      madvise(map, sb.st_size, MADV_SEQUENTIAL);
+      madvise(map, sb.st_size, MADV_WILLNEED);
+      return raw_buffer_t(
+          new rawspeed::Buffer((const uint8_t *)map, sb.st_size),
+          raw_buffer_deleter{map, (size_t)sb.st_size});
+    }
   }
-
+  else if(fd >= 0) close(fd);
+  // fall back to reading the file (also throws the exceptions for us)
   rawspeed::FileReader f(filename);
+  return raw_buffer_t(f.readFile().release(), raw_buffer_deleter());
+}
 
+// decode the given file into decoder and buffer, does not touch the module.
+// this is called from worker threads for the decode-ahead, too.
+int
+decode_raw(
+    const dt_module_t                       *mod,
+    const char                              *filename,
+    std::unique_ptr<rawspeed::RawDecoder>   &d,
+    raw_buffer_t                            &m)
+{
   try
   {
     rawspeed_load_meta(mod);
 
-    mod_data->m = f.readFile();
+    m = map_file(filename);
 
-    rawspeed::RawParser t(*mod_data->m);
-    mod_data->d = t.getDecoder(meta);
+    rawspeed::RawParser t(*m);
+    d = t.getDecoder(meta);
 
-    if(!mod_data->d.get()) return 1;
+    if(!d.get()) return 1;
 
-    mod_data->d->failOnUnknown = true;
-    mod_data->d->checkSupport(meta);
-    mod_data->d->decodeRaw();
+    d->failOnUnknown = true;
+    d->checkSupport(meta);
+    d->decodeRaw();
 
-    mod_data->d->decodeMetaData(meta);
+    d->decodeMetaData(meta);
 
-    const auto errors = mod_data->d->mRaw->getErrors();
+    const auto errors = d->mRaw->getErrors();
     // for(const auto &error : errors) fprintf(stderr, "[rawspeed] (%s) %s\n", filename, error.c_str());
 
     // TODO: do some corruption detection and support for esoteric formats/fails here
     // the data type doesn't seem to be inited on hdrmerge raws:
-    // if(mod_data->d->mRaw->getDataType() == rawspeed::TYPE_FLOAT32)
-    if(sizeof(uint16_t) != mod_data->d->mRaw->getBpp())
+    // if(d->mRaw->getDataType() == rawspeed::TYPE_FLOAT32)
+    if(sizeof(uint16_t) != d->mRaw->getBpp())
     {
       // fprintf(stderr, "[i-raw] unhandled pixel format: %s\n", filename);
       return 1;
@@ -177,12 +249,140 @@ load_raw(
     // printf("[rawspeed] unhandled exception in\n");
     return 1;
   }
+  return 0;
+}
+
+int
+load_raw(
+    dt_module_t *mod,
+    const char *filename)
+{
+  clock_t beg = clock();
+  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  if(mod_data)
+  {
+    if(!strcmp(mod_data->filename, filename))
+      return 0; // already loaded
+    else free_raw(mod); // maybe loaded the wrong one
+  }
+  else
+  {
+    assert(0); // this should be inited in init()
+  }
+
+  if(decode_raw(mod, filename, mod_data->d, mod_data->m))
+  {
+    free_raw(mod);
+    return 1;
+  }
   clock_t end = clock();
   snprintf(mod_data->filename, sizeof(mod_data->filename), "%s", filename);
   dt_log(s_log_perf, "[rawspeed] load %s in %3.0fms", filename, 1000.0*(end-beg)/CLOCKS_PER_SEC);
   return 0;
 }
 
+void
+prefetch_work(uint32_t item, void *arg)
+{
+  rawinput_slot_t *s = (rawinput_slot_t *)arg;
+  rawinput_buf_t  *b = s->buf;
+  int last = 0;
+  std::unique_lock<std::mutex> lock(b->mutex);
+  if(s->state == s_slot_queued)
+  { // else cancelled, or another job got here first
+    s->state = s_slot_decoding; // from now on nobody else touches the slot
+    lock.unlock();
+    clock_t beg = clock();
+    int err = decode_raw(s->mod, s->filename, s->d, s->m);
+    clock_t end = clock();
+    if(!err) dt_log(s_log_perf, "[rawspeed] prefetch %s in %3.0fms", s->filename, 1000.0*(end-beg)/CLOCKS_PER_SEC);
+    lock.lock();
+    s->state = err ? s_slot_failed : s_slot_ready;
+  }
+  last = --b->refs == 0;
+  b->cond.notify_all();
+  lock.unlock();
+  if(last) delete b; // the module is gone already, we were a cancelled job
+}
+
+// if the given file has been decoded ahead of time, wait for it and make it current
+void
+prefetch_take(
+    dt_module_t *mod,
+    const char  *filename)
+{
+  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  if(!strcmp(mod_data->filename, filename)) return;
+  std::unique_lock<std::mutex> lock(mod_data->mutex);
+  for(int k=0;k<RAW_PREFETCH;k++)
+  {
+    rawinput_slot_t *s = mod_data->slot + k;
+    if(s->state == s_slot_empty || strcmp(s->filename, filename)) continue;
+    // if no worker picked it up yet, don't wait for the pool (might be busy
+    // with thumbnails or be us) but cancel and decode right here:
+    if(s->state == s_slot_queued) s->state = s_slot_empty;
+    mod_data->cond.wait(lock, [s]{ return s->state != s_slot_decoding; });
+    if(s->state == s_slot_ready)
+    {
+      free_raw(mod);
+      std::swap(mod_data->d, s->d);
+      std::swap(mod_data->m, s->m);
+      snprintf(mod_data->filename, sizeof(mod_data->filename), "%s", filename);
+    }
+    s->d.reset();
+    s->m.reset();
+    s->filename[0] = 0;
+    s->state = s_slot_empty;
+    return;
+  }
+}
+
+// schedule decoding of the frames after the given one on the thread pool
+void
+prefetch(
+    dt_module_t *mod,
+    const char  *fname,
+    int          id,
+    int          frame)
+{
+  rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
+  for(int f=frame+1;f<=frame+RAW_PREFETCH&&f<mod->graph->frame_cnt;f++)
+  {
+    char filename[2*PATH_MAX+10];
+    if(get_filename(mod, fname, id + f, filename, sizeof(filename))) break;
+    std::lock_guard<std::mutex> lock(mod_data->mutex);
+    rawinput_slot_t *s = 0;
+    for(int k=0;k<RAW_PREFETCH;k++)
+    {
+      rawinput_slot_t *t = mod_data->slot + k;
+      if(t->state != s_slot_empty && !strcmp(t->filename, filename))
+      { // already there or in flight
+        s = 0;
+        break;
+      }
+      // we can reuse slots that are not being decoded and hold a frame outside the window
+      if(!s && t->state != s_slot_decoding &&
+          (t->state == s_slot_empty || t->frame <= frame || t->frame > frame + RAW_PREFETCH))
+        s = t;
+    }
+    if(!s) continue;
+    s->d.reset();
+    s->m.reset();
+    snprintf(s->filename, sizeof(s->filename), "%s", filename);
+    s->frame = f;
+    s->mod   = mod;
+    s->buf   = mod_data;
+    s->state = s_slot_queued;
+    if(threads_task("i-raw", 1, -1, s, prefetch_work, 0) < 0)
+    { // pool is full, try again next frame
+      s->filename[0] = 0;
+      s->state = s_slot_empty;
+      break;
+    }
+    mod_data->refs++;
+  }
+}
+
 } // end anonymous namespace
 
 int init(dt_module_t *mod)
@@ -204,7 +404,27 @@ void cleanup(dt_module_t *mod)
   if(!mod->data) return;
   rawinput_buf_t *mod_data = (rawinput_buf_t *)mod->data;
   free_raw(mod);
-  delete mod_data;
+  int last = 0;
+  { // cancel decode-ahead jobs that did not start yet and wait for the running
+    // ones, they reference the module. the queued jobs may sit in a busy pool
+    // (or this may run on a pool thread itself), so don't wait for those: the
+    // last of them to run frees the buffer.
+    std::unique_lock<std::mutex> lock(mod_data->mutex);
+    for(int k=0;k<RAW_PREFETCH;k++)
+      if(mod_data->slot[k].state == s_slot_queued)
+        mod_data->slot[k].state = s_slot_empty;
+    mod_data->cond.wait(lock, [mod_data]{
+        for(int k=0;k<RAW_PREFETCH;k++)
+          if(mod_data->slot[k].state == s_slot_decoding) return false;
+        return true; });
+    for(int k=0;k<RAW_PREFETCH;k++)
+    { // drop decoded frames now, the buffer may live on a bit
+      mod_data->slot[k].d.reset();
+      mod_data->slot[k].m.reset();
+    }
+    last = --mod_data->refs == 0;
+  }
+  if(last) delete mod_data;
   mod->data = 0;
 }
 
@@ -441,6 +661,11 @@ int read_source(
   char        filename[2*PATH_MAX+10];
   if(get_filename(mod, fname, id + mod->graph->frame, filename, sizeof(filename)))
     return 1;
+  if(strstr(fname, "%"))
+  { // timelapse: pick up the frame if it has been decoded ahead, and queue the next ones
+    prefetch_take(mod, filename);
+    prefetch(mod, fname, id, mod->graph->frame);
+  }
   int err = load_raw(mod, filename);
   if(err) return 1;
   uint16_t *buf = (uint16_t *)mapped;
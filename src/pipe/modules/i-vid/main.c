@@ -3,17 +3,24 @@
 // hand it down to vk video for decoding
 
 #include "modules/api.h"
+#include "core/threads.h"
+#include "core/fs.h"
 
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavcodec/avcodec.h>
 #include <libavcodec/bsf.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#define VID_QUEUE 8  // decoded frames kept ahead of the graph
+#define VID_APKT  64 // demuxed audio packets waiting for audio()
+#define VID_LRU   4  // recently shown frames kept for scrubbing back and forth
+
 typedef struct vid_data_t
 {
   char                  filename[PATH_MAX];
@@ -26,10 +33,38 @@ typedef struct vid_data_t
   int                   wd, ht;
   AVCodecContext       *actx, *vctx;
   uint32_t              dim[6];
-  int64_t               frame;
   float                *sndbuf;
   size_t                sndbuf_size;
   int64_t               snd_lag;
+
+  // the decoder thread demuxes and decodes ahead of the graph. everything
+  // below is protected by the mutex, fmtc and vctx belong to the thread.
+  pthread_t             thread;
+  pthread_mutex_t       mutex;
+  pthread_cond_t        cond;
+  int                   running, quit, eof, err;
+  AVFrame              *dframe;            // frame being decoded by the thread
+  AVFrame              *queue[VID_QUEUE];  // ring buffer of decoded frames
+  int64_t               qframe[VID_QUEUE]; // and their frame numbers
+  int                   qhead, qcnt;
+  int64_t               next;              // frame number the thread decodes next
+  int64_t               seek, seek_dts;    // requested seek or -1
+  AVPacket             *apkt[VID_APKT];    // ring buffer of audio packets
+  int                   ahead, acnt;
+  int64_t               apts_min;          // after a seek, drop audio ending before this (audio time base)
+
+  // index of all frames, to seek to the right keyframe and count frames
+  // exactly. built by another thread on first open, then read from disk.
+  pthread_t             index_thread;
+  int                   indexing;
+  int64_t              *ipts;              // pts of all video frames, sorted
+  int64_t              *kpts;              // pts of the keyframes, sorted
+  int                   ipts_cnt, kpts_cnt;
+
+  // owned by the graph thread:
+  AVFrame              *lru[VID_LRU];
+  int64_t               lru_frame[VID_LRU];
+  uint64_t              lru_tick[VID_LRU], tick;
 }
 vid_data_t;
 
@@ -173,11 +208,399 @@ dump_parameters(
   fprintf(stderr, "[i-vid] chroma location %s\n", cl[chroma_location]);
 }
 
+// drop all decoded frames and audio packets, call with the mutex locked
+static inline void
+queue_clear(vid_data_t *d)
+{
+  for(;d->qcnt;d->qcnt--,d->qhead=(d->qhead+1)%VID_QUEUE)
+    av_frame_unref(d->queue[d->qhead]);
+  for(;d->acnt;d->acnt--,d->ahead=(d->ahead+1)%VID_APKT)
+    av_packet_unref(d->apkt[d->ahead]);
+}
+
+// keep an audio packet for audio(), which runs on the graph thread. we can't
+// send it to the decoder from here, the two would race on actx.
+static inline void
+apkt_push(vid_data_t *d, AVPacket *pkt)
+{
+  pthread_mutex_lock(&d->mutex);
+  if(d->seek < 0 && (pkt->pts == AV_NOPTS_VALUE || pkt->pts + pkt->duration > d->apts_min))
+  { // if nobody listens, drop the oldest
+    if(d->acnt == VID_APKT)
+    {
+      av_packet_unref(d->apkt[d->ahead]);
+      d->ahead = (d->ahead+1)%VID_APKT;
+      d->acnt--;
+    }
+    av_packet_move_ref(d->apkt[(d->ahead+d->acnt++)%VID_APKT], pkt);
+  }
+  pthread_mutex_unlock(&d->mutex);
+}
+
+// demux and decode until we get the next video frame.
+// returns 0 on success, 1 on end of stream, and an av error < 0 otherwise.
+static int
+decode_frame(vid_data_t *d, AVFrame *frame)
+{
+  int ret = 0;
+  AVPacket *curr = d->pkt0;
+  do {
+    if(d->pkt0->data) av_packet_unref(d->pkt0);
+    if(d->pkt1->data) av_packet_unref(d->pkt1);
+    if((ret = avcodec_receive_frame(d->vctx, frame)) < 0)
+    {
+      if(ret == AVERROR(EAGAIN))
+      { // receive frame needs moar packets!
+        if((ret = av_read_frame(d->fmtc, curr)) < 0)
+        { // this would have to be EOF hopefully
+          if(ret == AVERROR_EOF) return 1;
+          return ret;
+        }
+        if(curr->stream_index == d->video_idx)
+        {
+          AVPacket *pk = curr;
+          if(d->mp4)
+          {
+            if(d->pktf->data) av_packet_unref(d->pktf);
+            if((ret = av_bsf_send_packet   (d->vbsfc, curr))    < 0) return ret;
+            if((ret = av_bsf_receive_packet(d->vbsfc, d->pktf)) < 0) return ret;
+            pk = d->pktf;
+          }
+          if((ret = avcodec_send_packet(d->vctx, pk)) < 0)
+          {
+            if(ret == AVERROR(EAGAIN)) {} // internal buffer is full, stop sending! first pick it up.
+            return ret;
+          }
+        }
+        if(curr->stream_index == d->audio_idx && d->actx)
+          apkt_push(d, curr);
+        continue; // go on receive a frame now
+      }
+      else if(ret == AVERROR_EOF) return 1; // flushed, nothing left
+      return ret; // seems to be broken indeed.
+    }
+    return 0; // got frame
+  } while(1);
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+  const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// first element >= v
+static inline int
+lower_bound(const int64_t *arr, int cnt, int64_t v)
+{
+  int lo = 0, hi = cnt;
+  while(lo < hi)
+  {
+    const int mid = (lo + hi)/2;
+    if(arr[mid] < v) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static inline void
+index_filename(const char *filename, char *out, size_t size)
+{ // key the index on the path and size/date of the video
+  uint64_t hash = 14695981039346656037ul;
+  for(const char *c=filename;*c;c++) hash = (hash ^ (uint8_t)*c) * 1099511628211ul;
+  struct stat statbuf = {0};
+  stat(filename, &statbuf);
+  hash = (hash ^ statbuf.st_size) * 1099511628211ul;
+  hash = (hash ^ statbuf.st_mtime) * 1099511628211ul;
+  char cachedir[PATH_MAX];
+  fs_cachedir(cachedir, sizeof(cachedir));
+  snprintf(out, size, "%s/vid/%016lx.idx", cachedir, hash);
+}
+
+// the index file is a header { magic, version, frame count, keyframe count }
+// followed by the pts of all frames and the pts of the keyframes.
+static int
+index_read(vid_data_t *d)
+{
+  char filename[PATH_MAX+100];
+  index_filename(d->filename, filename, sizeof(filename));
+  FILE *f = fopen(filename, "rb");
+  if(!f) return 1;
+  uint32_t header[4] = {0};
+  if(fread(header, sizeof(header), 1, f) != 1 ||
+     header[0] != dt_token("vidx") || header[1] != 1 || !header[2] || !header[3])
+    goto error;
+  d->ipts = malloc(sizeof(int64_t)*header[2]);
+  d->kpts = malloc(sizeof(int64_t)*header[3]);
+  if(fread(d->ipts, sizeof(int64_t), header[2], f) != header[2] ||
+     fread(d->kpts, sizeof(int64_t), header[3], f) != header[3])
+    goto error;
+  d->ipts_cnt = header[2];
+  d->kpts_cnt = header[3];
+  fclose(f);
+  return 0;
+error:
+  free(d->ipts);
+  free(d->kpts);
+  d->ipts = d->kpts = 0;
+  fclose(f);
+  return 1;
+}
+
+static void
+index_write(const char *vidname, const int64_t *ipts, int ipts_cnt, const int64_t *kpts, int kpts_cnt)
+{
+  char filename[PATH_MAX+100], tmpname[PATH_MAX+200];
+  index_filename(vidname, filename, sizeof(filename));
+  char dirname[PATH_MAX];
+  fs_cachedir(dirname, sizeof(dirname));
+  fs_mkdir(dirname, 0755);
+  strncat(dirname, "/vid", sizeof(dirname)-strlen(dirname)-1);
+  fs_mkdir(dirname, 0755);
+  snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, getpid());
+  FILE *f = fopen(tmpname, "wb");
+  if(!f) return;
+  uint32_t header[4] = { dt_token("vidx"), 1, ipts_cnt, kpts_cnt };
+  int err = fwrite(header, sizeof(header), 1, f) != 1 ||
+    fwrite(ipts, sizeof(int64_t), ipts_cnt, f) != ipts_cnt ||
+    fwrite(kpts, sizeof(int64_t), kpts_cnt, f) != kpts_cnt;
+  err |= fclose(f);
+  if(err || rename(tmpname, filename)) unlink(tmpname);
+}
+
+// read through all packets of the video (without decoding them) and remember
+// the timestamps. this runs on its own demuxer, besides the decoder thread.
+static void*
+index_work(void *arg)
+{
+  vid_data_t *d = arg;
+  AVFormatContext *fmtc = 0;
+  AVPacket *pkt = av_packet_alloc();
+  int64_t *ipts = 0, *kpts = 0;
+  int ipts_cnt = 0, kpts_cnt = 0, ipts_max = 0, kpts_max = 0, quit = 0;
+  if(avformat_open_input(&fmtc, d->filename, 0, 0) < 0) goto done;
+  if(avformat_find_stream_info(fmtc, 0) < 0) goto done;
+  const int idx = av_find_best_stream(fmtc, AVMEDIA_TYPE_VIDEO, -1, -1, 0, 0);
+  if(idx < 0) goto done;
+  for(int64_t cnt=0;av_read_frame(fmtc, pkt) >= 0;cnt++)
+  {
+    if(pkt->stream_index == idx)
+    {
+      const int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+      if(ipts_cnt == ipts_max) ipts = realloc(ipts, sizeof(int64_t)*(ipts_max = MAX(1024, 2*ipts_max)));
+      ipts[ipts_cnt++] = pts;
+      if(pkt->flags & AV_PKT_FLAG_KEY)
+      {
+        if(kpts_cnt == kpts_max) kpts = realloc(kpts, sizeof(int64_t)*(kpts_max = MAX(64, 2*kpts_max)));
+        kpts[kpts_cnt++] = pts;
+      }
+    }
+    av_packet_unref(pkt);
+    if((cnt & 0xff) == 0)
+    { // don't hold up closing the stream
+      pthread_mutex_lock(&d->mutex);
+      quit = d->quit;
+      pthread_mutex_unlock(&d->mutex);
+      if(quit) break;
+    }
+  }
+  if(quit || !ipts_cnt || !kpts_cnt) goto done;
+  // packets come in decoding order, frames are displayed in pts order:
+  qsort(ipts, ipts_cnt, sizeof(int64_t), cmp_int64);
+  qsort(kpts, kpts_cnt, sizeof(int64_t), cmp_int64);
+  index_write(d->filename, ipts, ipts_cnt, kpts, kpts_cnt);
+  pthread_mutex_lock(&d->mutex);
+  d->ipts = ipts;
+  d->kpts = kpts;
+  d->ipts_cnt = ipts_cnt;
+  d->kpts_cnt = kpts_cnt;
+  ipts = kpts = 0;
+  pthread_mutex_unlock(&d->mutex);
+done:
+  free(ipts);
+  free(kpts);
+  av_packet_free(&pkt);
+  avformat_close_input(&fmtc);
+  return 0;
+}
+
+// the decoder thread: keep the queue filled ahead of the graph and seek on request
+static void*
+decode_work(void *arg)
+{
+  vid_data_t *d = arg;
+  int flushed = 0;
+  // if we have an index, we seek to the keyframe before the target
+  // and skip frames until we reach it. frames are then labelled by pts.
+  const int64_t *ipts = 0, *kpts = 0;
+  int ipts_cnt = 0, key = -1, retry = 0;
+  int64_t target = -1;
+  pthread_mutex_lock(&d->mutex);
+  while(1)
+  {
+    while(!d->quit && d->seek < 0 && (d->qcnt == VID_QUEUE || d->eof || d->err))
+      pthread_cond_wait(&d->cond, &d->mutex);
+    if(d->quit) break;
+    if(d->seek >= 0)
+    {
+      const int64_t frame = d->seek, dts = d->seek_dts;
+      d->seek = -1;
+      queue_clear(d);
+      d->eof = d->err = 0;
+      ipts = 0;
+      key  = -1;
+      if(d->ipts && frame < d->ipts_cnt)
+      {
+        ipts     = d->ipts;
+        kpts     = d->kpts;
+        ipts_cnt = d->ipts_cnt;
+        key      = MAX(0, lower_bound(kpts, d->kpts_cnt, ipts[frame] + 1) - 1);
+        retry    = 2;
+      }
+      const int64_t ts = ipts ? kpts[key] : dts;
+      // we'll decode forward from the keyframe, the audio up to the target frame
+      // would come out ahead of it:
+      d->apts_min = ipts && d->audio_idx >= 0 ?
+        av_rescale_q(ipts[frame], d->fmtc->streams[d->video_idx]->time_base,
+            d->fmtc->streams[d->audio_idx]->time_base) : INT64_MIN;
+      pthread_mutex_unlock(&d->mutex);
+      // without index: old api. passing -1 converts the timestamp to something even more obscure.
+      // passing video idx seeks to somewhere about the right place (+10 frames or so)
+      int ret = av_seek_frame(d->fmtc, d->video_idx, ts, ipts ? AVSEEK_FLAG_BACKWARD : AVSEEK_FLAG_ANY);
+      avcodec_flush_buffers(d->vctx);
+      flushed = 0;
+      target  = frame;
+      pthread_mutex_lock(&d->mutex);
+      if(ret < 0)
+      {
+        fprintf(stderr, "[i-vid] error seeking (%s)\n", av_err2str(ret));
+        d->err = 1;
+      }
+      d->next = frame;
+      pthread_cond_broadcast(&d->cond);
+      continue;
+    }
+    int64_t frame = d->next;
+    pthread_mutex_unlock(&d->mutex);
+
+    int ret = decode_frame(d, d->dframe);
+    if(ret == 1 && !flushed)
+    { // end of the stream, flush the decoder with an empty packet and get the rest
+      flushed = 1;
+      if((ret = avcodec_send_packet(d->vctx, 0)) >= 0) ret = decode_frame(d, d->dframe);
+    }
+    int skip = 0;
+    if(ret == 0 && ipts && d->dframe->best_effort_timestamp != AV_NOPTS_VALUE)
+    {
+      frame = MIN(ipts_cnt-1, lower_bound(ipts, ipts_cnt, d->dframe->best_effort_timestamp));
+      if(target >= 0 && frame > target && key > 0 && retry-- > 0)
+      { // the demuxer landed behind our frame, go back one more keyframe
+        av_seek_frame(d->fmtc, d->video_idx, kpts[--key], AVSEEK_FLAG_BACKWARD);
+        avcodec_flush_buffers(d->vctx);
+        skip = 1;
+      }
+      else if(frame < target) skip = 1; // decode on until we get there
+      else target = -1;
+    }
+
+    pthread_mutex_lock(&d->mutex);
+    if(d->seek >= 0 || d->quit || skip)
+    { // nobody wants this frame (any more)
+      av_frame_unref(d->dframe);
+    }
+    else if(ret == 1) d->eof = 1;
+    else if(ret < 0)
+    {
+      fprintf(stderr, "[i-vid] error during decoding (%s)\n", av_err2str(ret));
+      d->err = 1;
+    }
+    else
+    {
+      const int slot = (d->qhead + d->qcnt++) % VID_QUEUE;
+      av_frame_move_ref(d->queue[slot], d->dframe);
+      d->qframe[slot] = frame;
+      d->next = frame + 1;
+    }
+    pthread_cond_broadcast(&d->cond);
+  }
+  pthread_mutex_unlock(&d->mutex);
+  return 0;
+}
+
+static inline void close_stream(vid_data_t *d);
+
+// forget about the stream, but keep the buffer audio() hands out
+static inline void
+vid_reset(vid_data_t *d)
+{
+  float *sndbuf = d->sndbuf;
+  const size_t sndbuf_size = d->sndbuf_size;
+  memset(d, 0, sizeof(*d));
+  d->sndbuf = sndbuf;
+  d->sndbuf_size = sndbuf_size;
+}
+
+static inline int
+thread_start(vid_data_t *d)
+{
+  pthread_mutex_init(&d->mutex, 0);
+  pthread_cond_init(&d->cond, 0);
+  d->dframe = av_frame_alloc();
+  for(int i=0;i<VID_QUEUE;i++) d->queue[i] = av_frame_alloc();
+  for(int i=0;i<VID_APKT;i++)  d->apkt[i]  = av_packet_alloc();
+  for(int i=0;i<VID_LRU;i++)
+  {
+    d->lru[i] = av_frame_alloc();
+    d->lru_frame[i] = -1;
+  }
+  d->seek = -1;
+  d->apts_min = INT64_MIN;
+  if(index_read(d) && !pthread_create(&d->index_thread, 0, index_work, d))
+    d->indexing = 1;
+  if(pthread_create(&d->thread, 0, decode_work, d)) return 1;
+  d->running = 1;
+  return 0;
+}
+
+static inline void
+thread_stop(vid_data_t *d)
+{
+  if(d->running)
+  {
+    pthread_mutex_lock(&d->mutex);
+    d->quit = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+    pthread_join(d->thread, 0);
+  }
+  if(d->indexing)
+  {
+    pthread_mutex_lock(&d->mutex);
+    d->quit = 1;
+    pthread_mutex_unlock(&d->mutex);
+    pthread_join(d->index_thread, 0);
+    d->indexing = 0;
+  }
+  if(!d->dframe) return; // never started
+  queue_clear(d);
+  av_frame_free(&d->dframe);
+  for(int i=0;i<VID_QUEUE;i++) av_frame_free(d->queue + i);
+  for(int i=0;i<VID_APKT;i++)  av_packet_free(d->apkt + i);
+  for(int i=0;i<VID_LRU;i++)   av_frame_free(d->lru + i);
+  free(d->ipts);
+  free(d->kpts);
+  pthread_mutex_destroy(&d->mutex);
+  pthread_cond_destroy(&d->cond);
+  d->running = 0;
+}
+
 static inline int
 open_stream(vid_data_t *d, const char *filename)
 {
   if(!strcmp(d->filename, filename)) return 0; // already opened this stream
-  memset(d, 0, sizeof(*d));
+  close_stream(d); // stop the decoder and index threads of the previous file
+  vid_reset(d);
 
   int ret = 0;
   fprintf(stderr, "[i-vid] trying to open %s\n", filename);
@@ -252,6 +675,9 @@ open_stream(vid_data_t *d, const char *filename)
   const AVCodec *v_codec = avcodec_find_decoder(vcodec);
   d->vctx = avcodec_alloc_context3(v_codec);
   if((ret = avcodec_parameters_to_context(d->vctx, d->fmtc->streams[d->video_idx]->codecpar)) < 0) goto error;
+  // the default is one thread, which is far too slow for 4k hevc:
+  d->vctx->thread_count = threads_num();
+  d->vctx->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
   if((ret = avcodec_open2(d->vctx, v_codec, &opts)) < 0) goto error;
   if(d->audio_idx >= 0)
   {
@@ -272,10 +698,16 @@ open_stream(vid_data_t *d, const char *filename)
   strncpy(d->filename, filename, sizeof(d->filename));
 #pragma GCC diagnostic pop
   dump_parameters(d);
+  if(thread_start(d))
+  {
+    fprintf(stderr, "[i-vid] could not start decoder thread!\n");
+    close_stream(d);
+    return 1;
+  }
   return 0;
 error:
   fprintf(stderr, "[i-vid] error opening %s (%s)\n", filename, av_err2str(ret));
-  memset(d, 0, sizeof(*d));
+  vid_reset(d);
   return 1;
 }
 
@@ -293,6 +725,7 @@ close_stream(vid_data_t *d)
   if(!d) return;
   if(!d->filename[0]) return;
 
+  thread_stop(d);
   av_frame_free(&d->aframe);
   av_frame_free(&d->vframe);
   if(d->pkt0->data) av_packet_unref(d->pkt0);
@@ -309,7 +742,7 @@ close_stream(vid_data_t *d)
   avcodec_free_context(&d->vctx);
   avcodec_close(d->actx);
   avcodec_free_context(&d->actx);
-  memset(d, 0, sizeof(*d));
+  vid_reset(d);
 }
 
 void cleanup(dt_module_t *mod)
@@ -381,7 +814,10 @@ void modify_roi_out(
   // for(int i=0;i<sizeof(mod->img_param.maker);i++) if(mod->img_param.maker[i] == ' ') mod->img_param.maker[i] = 0;
   double frame_rate = av_q2d(d->fmtc->streams[d->video_idx]->avg_frame_rate);
   double duration = d->fmtc->duration / (double)AV_TIME_BASE; // in seconds
-  mod->graph->frame_cnt = duration * frame_rate;
+  mod->graph->frame_cnt = duration * frame_rate; // estimate, until the index is built
+  pthread_mutex_lock(&d->mutex);
+  if(d->ipts_cnt) mod->graph->frame_cnt = d->ipts_cnt; // exact, from the index
+  pthread_mutex_unlock(&d->mutex);
   // XXX FIXME: the number is correct but needs more testing because
   // we can't deliver 60fps on slower computers, killing audio etc
   // this first needs a robust way of doing frame drops.
@@ -403,95 +839,74 @@ int read_source(
   vid_data_t *d = mod->data;
   if(!d->filename[0]) return 1; // not open
 
-  int ret = 0;
-
   if(p->a == 0)
-  { // first channel, new frame. parse + decode + handle audio:
-    const double tbn = 1.0/av_q2d(d->fmtc->streams[d->video_idx]->time_base);
-    int rate = tbn/mod->graph->frame_rate; // some obscure sampling rate vs frames per second number
-    // fprintf(stderr, "frames %d %ld %d %d\n", mod->graph->frame, d->frame, d->vctx->frame_number, vfidx);//d->vframe->pts);
-    if(mod->graph->frame != d->frame)
-    // if(mod->graph->frame + 1 != d->vctx->frame_number) // zero vs 1 based
-    { // seek
-      // old api. passing -1 converts the timestamp to something even more obscure.
-      // passing video idx seeks to somewhere about the right place (+10 frames or so)
-      int64_t dts = mod->graph->frame * rate;
-      if((ret = av_seek_frame(d->fmtc, d->video_idx, dts, AVSEEK_FLAG_ANY)) < 0) goto error;
-#if 0 // new api does not seem to work yet:
-      if((ret = avformat_seek_file(d->fmtc, -1,
-              // mod->graph->frame - 2, mod->graph->frame, mod->graph->frame + 2,
-              0, mod->graph->frame, mod->graph->frame + 2,
-              AVSEEK_FLAG_ANY|AVSEEK_FLAG_FRAME)) < 0) goto error;
-#endif
-      // fprintf(stderr, "SEEEEEEEKX\n");
-      avcodec_flush_buffers(d->vctx);
-      avcodec_flush_buffers(d->actx);
+  { // first channel, new frame. pick it up from the decoder thread:
+    const int64_t frame = mod->graph->frame;
+    d->tick++;
+    for(int i=0;i<VID_LRU;i++) if(d->lru_frame[i] == frame)
+    { // seen it recently, no need to bother the decoder
+      av_frame_unref(d->vframe);
+      av_frame_ref(d->vframe, d->lru[i]);
+      d->lru_tick[i] = d->tick;
+      goto copy;
+    }
+    int err = 0;
+    pthread_mutex_lock(&d->mutex);
+    // on first open the index thread may only finish now, correct the estimate:
+    if(d->ipts_cnt && mod->graph->frame_cnt != d->ipts_cnt) mod->graph->frame_cnt = d->ipts_cnt;
+    // frames before the one we want will never be needed again:
+    for(;d->qcnt && d->qframe[d->qhead] < frame;d->qcnt--,d->qhead=(d->qhead+1)%VID_QUEUE)
+      av_frame_unref(d->queue[d->qhead]);
+    pthread_cond_broadcast(&d->cond); // there may be room in the queue now
+    const int64_t beg = d->seek >= 0 ? d->seek : d->next;
+    if(!(d->qcnt && d->qframe[d->qhead] == frame) &&
+        (frame < beg || frame > beg + VID_QUEUE))
+    { // not coming any time soon, seek
+      const double tbn = 1.0/av_q2d(d->fmtc->streams[d->video_idx]->time_base);
+      int rate = tbn/mod->graph->frame_rate; // some obscure sampling rate vs frames per second number
+      queue_clear(d);
+      d->seek     = frame;
+      d->seek_dts = frame * rate;
+      if(d->actx) avcodec_flush_buffers(d->actx); // audio is ours, the thread doesn't touch it
       d->snd_lag = 0;
     }
-    d->frame = mod->graph->frame+1; // this would be the next one we read
+    while(!(d->qcnt && d->qframe[d->qhead] >= frame) &&
+        (d->seek >= 0 || (!d->eof && !d->err)))
+    {
+      pthread_cond_wait(&d->cond, &d->mutex);
+      for(;d->qcnt && d->qframe[d->qhead] < frame;d->qcnt--,d->qhead=(d->qhead+1)%VID_QUEUE)
+        av_frame_unref(d->queue[d->qhead]);
+      pthread_cond_broadcast(&d->cond);
+    }
+    if(d->qcnt && d->qframe[d->qhead] == frame)
+    { // take it and make room for the next one
+      av_frame_unref(d->vframe);
+      av_frame_move_ref(d->vframe, d->queue[d->qhead]);
+      d->qhead = (d->qhead+1)%VID_QUEUE;
+      d->qcnt--;
+      pthread_cond_broadcast(&d->cond);
+    }
+    else if(d->qcnt)
+    { // the stream skips this frame, show the next one instead but leave it in the queue
+      av_frame_unref(d->vframe);
+      av_frame_ref(d->vframe, d->queue[d->qhead]);
+    }
+    else err = d->err; // at the end of the stream there is just nothing to copy
+    pthread_mutex_unlock(&d->mutex);
+    if(err) return 1;
 
-    AVPacket *curr = d->pkt0;
-    do {
-      if(d->pkt0->data) av_packet_unref(d->pkt0);
-      if(d->pkt1->data) av_packet_unref(d->pkt1);
-      if((ret = avcodec_receive_frame(d->vctx, d->vframe)) < 0)
-      {
-        if(ret == AVERROR(EAGAIN))
-        { // receive frame needs moar packets!
-          if((ret = av_read_frame(d->fmtc, curr)) < 0)
-          { // this would have to be EOF hopefully
-            if(ret == AVERROR_EOF) break;
-            goto error;
-          }
-          if(curr->stream_index == d->video_idx)
-          {
-            AVPacket *pk = curr;
-            if(d->mp4)
-            {
-              if(d->pktf->data) av_packet_unref(d->pktf);
-              if((ret = av_bsf_send_packet   (d->vbsfc, curr))    < 0) goto error;
-              if((ret = av_bsf_receive_packet(d->vbsfc, d->pktf)) < 0) goto error;
-              pk = d->pktf;
-            }
-            if((ret = avcodec_send_packet(d->vctx, pk)) < 0)
-            {
-              if(ret == AVERROR(EAGAIN)) {} // internal buffer is full, stop sending! first pick it up.
-              goto error;
-            }
-          }
-          if(curr->stream_index == d->audio_idx)
-          {
-#if 0
-            AVPacket *pk = curr;
-            if(d->mp4)
-            {
-              if(d->pktf->data) av_packet_unref(d->pktf);
-              if((ret = av_bsf_send_packet   (d->absfc, curr))    < 0) goto error;
-              if((ret = av_bsf_receive_packet(d->absfc, d->pktf)) < 0) goto error;
-              pk = d->pktf;
-            }
-#endif
-            if((ret = avcodec_send_packet(d->actx, curr)) < 0)
-            {
-              if(ret == AVERROR(EAGAIN)) {} // all good, buffer full already
-              else goto error;
-            }
-          }
-          continue; // go on receive a frame now
-        }
-        else if(ret == AVERROR_EOF)
-        { // receive frame says EOF, flush empty packet
-          if((ret = avcodec_send_packet(d->vctx, 0)) < 0) goto error;
-          continue;
-        }
-        goto error; // seems to be broken indeed.
-      }
-      break; // got frame, exit loop
-    } while(1);
-    // int64_t vfidx = d->vframe->pts;//  / rate;
-    // fprintf(stderr, "frames %d %ld %d %ld\n", mod->graph->frame, d->frame, d->vctx->frame_number, vfidx);//d->vframe->pts);
+    if(d->vframe->buf[0])
+    { // remember it for scrubbing back, replacing the least recently used
+      int i = 0;
+      for(int k=1;k<VID_LRU;k++) if(d->lru_tick[k] < d->lru_tick[i]) i = k;
+      av_frame_unref(d->lru[i]);
+      av_frame_ref(d->lru[i], d->vframe);
+      d->lru_frame[i] = frame;
+      d->lru_tick[i]  = d->tick;
+    }
   }
 
+copy:
   // write the frame data to output file
   uint32_t wd = p->a ? d->wd/2 : d->wd;
   uint32_t ht = p->a ? d->ht/2 : d->ht;
@@ -502,9 +917,26 @@ int read_source(
   if(p->a == 2) av_frame_unref(d->vframe);
 
   return 0;
-error:
-  fprintf(stderr, "[i-vid] error during decoding (%s)\n", av_err2str(ret));
-  return 1;
+}
+
+// send the next audio packet the decoder thread demuxed for us.
+// returns non-zero if there is none.
+static inline int
+audio_feed(vid_data_t *d)
+{
+  int err = 1;
+  pthread_mutex_lock(&d->mutex);
+  if(d->acnt)
+  {
+    AVPacket *pkt = d->apkt[d->ahead];
+    int ret = avcodec_send_packet(d->actx, pkt);
+    av_packet_unref(pkt);
+    d->ahead = (d->ahead+1)%VID_APKT;
+    d->acnt--;
+    err = ret < 0;
+  }
+  pthread_mutex_unlock(&d->mutex);
+  return err;
 }
 
 int audio(
@@ -523,7 +955,7 @@ int audio(
   do {
     if((ret = avcodec_receive_frame(d->actx, d->aframe)) < 0)
     {
-      if(ret == AVERROR(EAGAIN)) { } // receive frame needs moar packets! but sorry the main loop is in read_source()
+      if(ret == AVERROR(EAGAIN) && !audio_feed(d)) continue; // needed moar packets, try again
       return written; // got zero samples in the last round
     }
 #if 0
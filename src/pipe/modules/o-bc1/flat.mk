@@ -1,3 +1,3 @@
+MOD_C=pipe/connector.c
 MOD_LDFLAGS=-lz
-# actually unused currently:
-#MOD_CFLAGS=-fopenmp
+MOD_CFLAGS=-fopenmp
@@ -9,6 +9,42 @@
 #include <string.h>
 #include <zlib.h>
 
+static inline int
+gpu_encode(const dt_module_t *module)
+{ // need at least one full block to run the compute kernel
+  return dt_module_param_int(module, dt_module_get_param(module->so, dt_token("gpu")))[0] &&
+    module->connector[0].roi.wd >= 4 && module->connector[0].roi.ht >= 4;
+}
+
+void
+create_nodes(
+    dt_graph_t  *graph,
+    dt_module_t *module)
+{
+  const dt_roi_t *roi = &module->connector[0].roi;
+  if(!gpu_encode(module))
+  { // only the sink node, the cpu will do all the work in write_sink
+    const int id_main = dt_node_add(graph, module, "o-bc1", "main",
+        roi->wd, roi->ht, 1, 0, 0, 1,
+        "input", "sink", "rgba", "ui8", roi);
+    dt_connector_copy(graph, module, 0, id_main, 0);
+    return;
+  }
+  // one kernel invocation per 4x4 block, outputs the 8 bytes of the block
+  // as two uint. this way we only read back 1/8 of the rgba input.
+  const dt_roi_t roi_blk = {
+    .wd = roi->wd/4, .ht = roi->ht/4, .full_wd = roi->wd/4, .full_ht = roi->ht/4, .scale = 1.0f };
+  const int id_enc = dt_node_add(graph, module, "o-bc1", "encode",
+      roi_blk.wd, roi_blk.ht, 1, 0, 0, 2,
+      "input",  "read",  "rgba", "ui8",  roi,
+      "output", "write", "rg",   "ui32", &roi_blk);
+  const int id_main = dt_node_add(graph, module, "o-bc1", "main",
+      roi_blk.wd, roi_blk.ht, 1, 0, 0, 1,
+      "input", "sink", "rg", "ui32", &roi_blk);
+  dt_connector_copy(graph, module, 0, id_enc, 0);
+  CONN(dt_node_connect(graph, id_enc, 1, id_main, 0));
+}
+
 // called after pipeline finished up to here.
 // our input buffer will come in memory mapped.
 void write_sink(
@@ -22,26 +58,30 @@ void write_sink(
   const uint32_t ht = module->connector[0].roi.ht;
   const uint8_t *in = (const uint8_t *)buf;
 
-  // go through all 4x4 blocks
-  // parallelise via our thread pool or openmp or what?
-  // probably usually bc1 thumbnails are too small to warrant a good speedup.
   const int bx = wd/4, by = ht/4;
   size_t num_blocks = bx * (uint64_t)by;
-  uint8_t *out = (uint8_t *)malloc(sizeof(uint8_t)*8*num_blocks);
-// #pragma omp parallel for collapse(2) schedule(static)
-  for(int j=0;j<4*by;j+=4)
-  {
-    for(int i=0;i<4*bx;i+=4)
-    { // swizzle block data together:
-      uint8_t block[64];
-      for(int jj=0;jj<4;jj++)
-        for(int ii=0;ii<4;ii++)
-          for(int c=0;c<4;c++)
-            block[4*(4*jj+ii)+c] = in[4*(wd*(j+jj)+(i+ii))+c];
-
-      stb_compress_dxt_block(
-          out + 8*(bx*(j/4)+(i/4)), block, 0,
-          0); // or slower: STB_DXT_HIGHQUAL
+  uint8_t *out = 0;
+  if(gpu_encode(module)) out = (uint8_t *)buf; // already encoded, 8 bytes per block in the same order
+  else
+  { // go through all 4x4 blocks on the cpu.
+    // the thread pool is no good here: thumbnails are created from within its
+    // workers already, and waiting for other tasks from there may deadlock.
+    out = (uint8_t *)malloc(sizeof(uint8_t)*8*num_blocks);
+#pragma omp parallel for collapse(2) schedule(static)
+    for(int j=0;j<4*by;j+=4)
+    {
+      for(int i=0;i<4*bx;i+=4)
+      { // swizzle block data together:
+        uint8_t block[64];
+        for(int jj=0;jj<4;jj++)
+          for(int ii=0;ii<4;ii++)
+            for(int c=0;c<4;c++)
+              block[4*(4*jj+ii)+c] = in[4*(wd*(j+jj)+(i+ii))+c];
+
+        stb_compress_dxt_block(
+            out + 8*(bx*(j/4)+(i/4)), block, 0,
+            0); // or slower: STB_DXT_HIGHQUAL
+      }
     }
   }
 
@@ -53,7 +93,7 @@ void write_sink(
   gzwrite(f, header, sizeof(uint32_t)*4);
   gzwrite(f, out, sizeof(uint8_t)*8*num_blocks);
   gzclose(f);
-  free(out);
+  if(out != buf) free(out);
   // atomically create filename only when we're quite done writing:
   unlink(filename); // just to be sure the link will work
   link(tmpfile, filename);
@@ -1 +1,5 @@
-# nothing specific needed
+ifeq ($(VKDT_USE_FFMPEG),1)
+MOD_CFLAGS=$(shell pkg-config --cflags libavformat --cflags libavcodec --cflags libavutil) -DVKDT_USE_FFMPEG=1
+MOD_LDFLAGS=$(shell pkg-config --libs libavformat --libs libavcodec --libs libavutil) -lpthread
+endif
+MOD_C=pipe/connector.c
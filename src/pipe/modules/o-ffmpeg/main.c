@@ -1,20 +1,286 @@
 #include "modules/api.h"
 #include "core/core.h"
 
+#ifdef VKDT_USE_FFMPEG
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <pthread.h>
+#define ENC_QUEUE 4 // frames waiting for the encoder before write_sink blocks
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct buf_t
 {
-  FILE *f;
+  int              failed;      // could not open the output, don't retry until the roi changes
+#ifdef VKDT_USE_FFMPEG
+  AVFormatContext *fmtc;
+  AVCodecContext  *ctx;
+  AVStream        *stream;
+  AVPacket        *pkt;
+  AVFrame         *frame[ENC_QUEUE];
+  int64_t          wr, rd;      // frames handed to / taken by the encoder thread
+  int              done;        // no more frames coming
+  int              err;
+  int              running;     // the encoder thread has been started
+  pthread_t        thread;
+  pthread_mutex_t  mutex;
+  pthread_cond_t   cond;
+#else
+  FILE            *f;           // pipe to the ffmpeg binary
+#endif
 }
 buf_t;
 
+// h264 requires width and height to be divisible by 2:
+static inline int
+enc_width(const dt_module_t *mod)
+{
+  return MAX(2, mod->connector[0].roi.wd & ~1);
+}
+
+static inline int
+enc_height(const dt_module_t *mod)
+{
+  return MAX(2, mod->connector[0].roi.ht & ~1);
+}
+
+#ifdef VKDT_USE_FFMPEG
+// send a frame (or 0 to flush) and write all packets that come out
+static int
+encode(buf_t *dat, AVFrame *frame)
+{
+  int ret = avcodec_send_frame(dat->ctx, frame);
+  while(ret >= 0)
+  {
+    ret = avcodec_receive_packet(dat->ctx, dat->pkt);
+    if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+    if(ret < 0) break;
+    av_packet_rescale_ts(dat->pkt, dat->ctx->time_base, dat->stream->time_base);
+    dat->pkt->stream_index = dat->stream->index;
+    ret = av_interleaved_write_frame(dat->fmtc, dat->pkt);
+  }
+  fprintf(stderr, "[o-ffmpeg] error encoding frame (%s)\n", av_err2str(ret));
+  return 1;
+}
+
+// the encoder thread: take frames from the queue in order until we're done
+static void*
+encode_work(void *arg)
+{
+  buf_t *dat = arg;
+  pthread_mutex_lock(&dat->mutex);
+  while(1)
+  {
+    while(dat->rd == dat->wr && !dat->done)
+      pthread_cond_wait(&dat->cond, &dat->mutex);
+    if(dat->rd == dat->wr) break; // done and nothing left
+    AVFrame *frame = dat->frame[dat->rd % ENC_QUEUE];
+    pthread_mutex_unlock(&dat->mutex);
+    int err = dat->err ? 0 : encode(dat, frame);
+    pthread_mutex_lock(&dat->mutex);
+    dat->err |= err;
+    dat->rd++;
+    pthread_cond_broadcast(&dat->cond);
+  }
+  pthread_mutex_unlock(&dat->mutex);
+  return 0;
+}
+
+static int
+open_stream(buf_t *dat, dt_module_t *mod)
+{
+  const char *basename = dt_module_param_string(mod, 0);
+  char filename[512];
+  snprintf(filename, sizeof(filename), "%s.h264", basename);
+  const int width  = enc_width(mod);
+  const int height = enc_height(mod);
+  const float rate = mod->graph->frame_rate > 0.0f ? mod->graph->frame_rate : 24;
+
+  int ret = 0;
+  if((ret = avformat_alloc_output_context2(&dat->fmtc, 0, 0, filename)) < 0) goto error;
+  const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+  if(!codec) codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if(!codec)
+  {
+    ret = AVERROR_ENCODER_NOT_FOUND;
+    goto error;
+  }
+  dat->ctx = avcodec_alloc_context3(codec);
+  dat->ctx->width           = width;
+  dat->ctx->height          = height;
+  dat->ctx->framerate       = av_d2q(rate, 100000);
+  dat->ctx->time_base       = av_inv_q(dat->ctx->framerate);
+  dat->ctx->pix_fmt         = AV_PIX_FMT_YUV420P;
+  dat->ctx->color_range     = AVCOL_RANGE_MPEG; // matches our yuv kernel
+  dat->ctx->colorspace      = AVCOL_SPC_BT709;
+  dat->ctx->color_primaries = AVCOL_PRI_BT709;
+  dat->ctx->color_trc       = AVCOL_TRC_IEC61966_2_1;
+  if(dat->fmtc->oformat->flags & AVFMT_GLOBALHEADER)
+    dat->ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  av_opt_set(dat->ctx->priv_data, "profile", "baseline", 0); // fails silently for other encoders
+  if((ret = avcodec_open2(dat->ctx, codec, 0)) < 0) goto error;
+
+  dat->stream = avformat_new_stream(dat->fmtc, 0);
+  if(!dat->stream) goto error;
+  dat->stream->time_base = dat->ctx->time_base;
+  if((ret = avcodec_parameters_from_context(dat->stream->codecpar, dat->ctx)) < 0) goto error;
+  if(!(dat->fmtc->oformat->flags & AVFMT_NOFILE) &&
+     (ret = avio_open(&dat->fmtc->pb, filename, AVIO_FLAG_WRITE)) < 0) goto error;
+  if((ret = avformat_write_header(dat->fmtc, 0)) < 0) goto error;
+
+  dat->pkt = av_packet_alloc();
+  for(int i=0;i<ENC_QUEUE;i++)
+  {
+    dat->frame[i] = av_frame_alloc();
+    dat->frame[i]->format = AV_PIX_FMT_YUV420P;
+    dat->frame[i]->width  = width;
+    dat->frame[i]->height = height;
+    if((ret = av_frame_get_buffer(dat->frame[i], 0)) < 0) goto error;
+  }
+  dat->wr = dat->rd = 0;
+  dat->done = dat->err = 0;
+  if(pthread_create(&dat->thread, 0, encode_work, dat)) goto error;
+  dat->running = 1;
+  fprintf(stderr, "[o-ffmpeg] writing %dx%d @ %g fps to `%s'\n", width, height, rate, filename);
+  return 0;
+error:
+  fprintf(stderr, "[o-ffmpeg] could not open `%s' for writing (%s)\n", filename, av_err2str(ret));
+  return 1;
+}
+
+static void
+close_stream(buf_t *dat)
+{
+  if(dat->running)
+  { // let the encoder finish the queue, then flush it
+    pthread_mutex_lock(&dat->mutex);
+    dat->done = 1;
+    pthread_cond_broadcast(&dat->cond);
+    pthread_mutex_unlock(&dat->mutex);
+    pthread_join(dat->thread, 0);
+    dat->running = 0;
+    if(!dat->err) encode(dat, 0);
+    av_write_trailer(dat->fmtc);
+  }
+  for(int i=0;i<ENC_QUEUE;i++) av_frame_free(dat->frame + i);
+  av_packet_free(&dat->pkt);
+  avcodec_free_context(&dat->ctx);
+  if(dat->fmtc && !(dat->fmtc->oformat->flags & AVFMT_NOFILE)) avio_closep(&dat->fmtc->pb);
+  avformat_free_context(dat->fmtc);
+  dat->fmtc   = 0;
+  dat->stream = 0;
+}
+
+static int
+is_open(const buf_t *dat)
+{
+  return dat->fmtc != 0;
+}
+
+static void
+push_frame(buf_t *dat, const dt_module_t *mod, const void *buf)
+{
+  const int width  = dat->ctx->width;
+  const int height = dat->ctx->height;
+
+  // wait for a free slot, the encoder is probably slower than our pipeline:
+  pthread_mutex_lock(&dat->mutex);
+  while(dat->wr - dat->rd >= ENC_QUEUE)
+    pthread_cond_wait(&dat->cond, &dat->mutex);
+  AVFrame *frame = dat->frame[dat->wr % ENC_QUEUE];
+  pthread_mutex_unlock(&dat->mutex);
+
+  // the encoder may still hold a reference to this one:
+  int ret = av_frame_make_writable(frame);
+  if(ret < 0)
+  {
+    fprintf(stderr, "[o-ffmpeg] dropping frame %ld, no buffer to write to (%s)\n",
+        (long)dat->wr, av_err2str(ret));
+    return;
+  }
+  const uint8_t *y = buf;
+  const uint8_t *u = y + width*height;
+  const uint8_t *v = u + width*height/4;
+  av_image_copy_plane(frame->data[0], frame->linesize[0], y, width,   width,   height);
+  av_image_copy_plane(frame->data[1], frame->linesize[1], u, width/2, width/2, height/2);
+  av_image_copy_plane(frame->data[2], frame->linesize[2], v, width/2, width/2, height/2);
+  frame->pts = dat->wr;
+
+  pthread_mutex_lock(&dat->mutex);
+  dat->wr++;
+  pthread_cond_broadcast(&dat->cond);
+  pthread_mutex_unlock(&dat->mutex);
+}
+#else
+// without libav, pipe the planes to the ffmpeg binary (which needs to be in
+// the PATH). the download is already i420, so it doesn't need to convert.
+static int
+open_stream(buf_t *dat, dt_module_t *mod)
+{
+  const char *basename = dt_module_param_string(mod, 0);
+  char filename[512];
+  snprintf(filename, sizeof(filename), "%s.h264", basename);
+  const int width  = enc_width(mod);
+  const int height = enc_height(mod);
+  const float rate = mod->graph->frame_rate > 0.0f ? mod->graph->frame_rate : 24;
+
+  char cmdline[1024];
+  snprintf(cmdline, sizeof(cmdline),
+      "ffmpeg "
+      "-y -f rawvideo -pix_fmt yuv420p -s %dx%d -r %g -i - "
+      "-c:v libx264 -profile:v baseline -pix_fmt yuv420p "
+      "-color_range tv -colorspace bt709 -color_primaries bt709 -color_trc iec61966-2-1 "
+      "-v error "
+      "%s",
+      width, height, rate, filename);
+  fprintf(stderr, "[o-ffmpeg] running `%s'\n", cmdline);
+  dat->f = popen(cmdline, "w");
+  if(!dat->f)
+  {
+    fprintf(stderr, "[o-ffmpeg] could not run ffmpeg to write `%s'\n", filename);
+    return 1;
+  }
+  return 0;
+}
+
+static void
+close_stream(buf_t *dat)
+{
+  if(dat->f) pclose(dat->f);
+  dat->f = 0;
+}
+
+static int
+is_open(const buf_t *dat)
+{
+  return dat->f != 0;
+}
+
+static void
+push_frame(buf_t *dat, const dt_module_t *mod, const void *buf)
+{
+  const size_t size = enc_width(mod) * (size_t)enc_height(mod) * 3 / 2;
+  if(fwrite(buf, 1, size, dat->f) != size)
+  {
+    fprintf(stderr, "[o-ffmpeg] could not write to ffmpeg, stopping\n");
+    close_stream(dat);
+    dat->failed = 1;
+  }
+}
+#endif
+
 int init(dt_module_t *mod)
 {
   buf_t *dat = malloc(sizeof(*dat));
   memset(dat, 0, sizeof(*dat));
+#ifdef VKDT_USE_FFMPEG
+  pthread_mutex_init(&dat->mutex, 0);
+  pthread_cond_init(&dat->cond, 0);
+#endif
   mod->data = dat;
   mod->flags = s_module_request_write_sink;
   return 0;
@@ -24,11 +290,11 @@ void cleanup(dt_module_t *mod)
 {
   if(!mod->data) return;
   buf_t *dat= mod->data;
-  if(dat->f)
-  {
-    pclose(dat->f);
-    dat->f = 0;
-  }
+  close_stream(dat);
+#ifdef VKDT_USE_FFMPEG
+  pthread_mutex_destroy(&dat->mutex);
+  pthread_cond_destroy(&dat->cond);
+#endif
   free(dat);
   mod->data = 0;
 }
@@ -38,9 +304,29 @@ void modify_roi_out(
     dt_module_t *mod)
 {
   if(graph->frame_cnt <= 1) return;
-  buf_t *buf = mod->data;
-  if(buf->f) pclose(buf->f);
-  buf->f = 0; // de-init
+  buf_t *dat = mod->data;
+  close_stream(dat); // de-init
+  dat->failed = 0;   // try again with the new settings
+}
+
+void
+create_nodes(
+    dt_graph_t  *graph,
+    dt_module_t *module)
+{
+  // convert to planar yuv 4:2:0 on the gpu and only download that, it's
+  // half the size of the rgba input. the planes are stacked vertically:
+  const int wd = enc_width(module), ht = enc_height(module);
+  const dt_roi_t roi_yuv = { .wd = wd, .ht = ht/2*3, .full_wd = wd, .full_ht = ht/2*3, .scale = 1.0f };
+  const int id_yuv = dt_node_add(graph, module, "o-ffmpeg", "yuv",
+      wd/2, ht/2, 1, 0, 0, 2,
+      "input",  "read",  "rgba", "ui8", &module->connector[0].roi,
+      "output", "write", "y",    "ui8", &roi_yuv);
+  const int id_main = dt_node_add(graph, module, "o-ffmpeg", "main",
+      roi_yuv.wd, roi_yuv.ht, 1, 0, 0, 1,
+      "input", "sink", "y", "ui8", &roi_yuv);
+  dt_connector_copy(graph, module, 0, id_yuv, 0);
+  CONN(dt_node_connect(graph, id_yuv, 1, id_main, 0));
 }
 
 void write_sink(
@@ -48,40 +334,12 @@ void write_sink(
     void        *buf)
 {
   buf_t *dat = mod->data;
-  if(!dat->f)
-  { // init if not done before
-    const char *basename = dt_module_param_string(mod, 0);
-    char filename[512];
-    snprintf(filename, sizeof(filename), "%s.h264", basename);
-
-    const int width  = mod->connector[0].roi.wd & ~1;
-    const int height = mod->connector[0].roi.ht & ~1;
-    const float rate = mod->graph->frame_rate > 0.0f ? mod->graph->frame_rate : 24;
-    if(width <= 0 || height <= 0) return;
-
-    // establish pipe to ffmpeg binary
-    char cmdline[1024];
-    snprintf(cmdline, sizeof(cmdline),
-        "ffmpeg "
-        "-y -f rawvideo -pix_fmt rgba -s %dx%d -r %g -i - "
-        "-c:v libx264 -profile:v baseline -pix_fmt yuv420p " // -level:v 3 " // -b:v 2500 "
-        "-v error "
-        // "-an /tmp/out_tempData.h264 "
-        "%s",
-        width, height, rate, filename);
-    fprintf(stderr, "[o-ffmpeg] running `%s'\n", cmdline);
-
-    if(dat->f) pclose(dat->f);
-    dat->f = popen(cmdline, "w");
+  if(dat->failed) return; // already complained
+  if(!is_open(dat) && open_stream(dat, mod))
+  {
+    close_stream(dat);
+    dat->failed = 1;
+    return;
   }
-  if(!dat->f) return;
-  uint32_t *p32 = buf; // our input buf is rgba ui8
-
-  // h264 requires width and height to be divisible by 2:
-  const int width  = mod->connector[0].roi.wd & ~1;
-  const int height = mod->connector[0].roi.ht & ~1;
-  const int stride = mod->connector[0].roi.wd;
-
-  for(int j=0;j<height;j++)
-    fwrite(p32 + j*stride, sizeof(uint32_t), width, dat->f);
+  push_frame(dat, mod, buf);
 }
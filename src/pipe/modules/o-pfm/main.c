@@ -1,6 +1,7 @@
 #include "modules/api.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // called after pipeline finished up to here.
@@ -31,11 +32,20 @@ void write_sink(
     while((len + 1 + off) & 0xf) off++;
     while(off-- > 0) fprintf(f, "0");
     fprintf(f, "\n");
-    for(size_t k=0;k<width*(uint64_t)height;k++)
+    // drop alpha and write a row at a time, not per pixel:
+    float *row = malloc(sizeof(float)*3*width);
+    for(int j=0;j<height;j++)
     {
-      float p32[3] = {pf[4*k+0], pf[4*k+1], pf[4*k+2]};
-      fwrite(p32, sizeof(float), 3ul, f);
+      const float *in = pf + 4*width*(uint64_t)j;
+      for(int i=0;i<width;i++)
+      {
+        row[3*i+0] = in[4*i+0];
+        row[3*i+1] = in[4*i+1];
+        row[3*i+2] = in[4*i+2];
+      }
+      fwrite(row, sizeof(float), 3ul*width, f);
     }
+    free(row);
     fclose(f);
   }
 }
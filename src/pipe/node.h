@@ -46,6 +46,8 @@ typedef struct dt_node_t
 
   uint32_t push_constant[64];  // GTX1080 has size == 256 as max anyways
   size_t   push_constant_size;
+
+  uint64_t written;     // value of graph->recorded when the outputs were last written, 0 if never
 }
 dt_node_t;
 
@@ -8,7 +8,8 @@ int main(int cnt, char *argv[])
   dt_pipe_global_init();
   for(int i=0;i<dt_pipe.num_modules;i++)
   {
-    dt_module_so_t *m = dt_pipe.module + i;
+    dt_module_so_t *m = dt_pipe_get_module(dt_pipe.module[i].name);
+    if(!m) continue;
     fprintf(stderr, "module %"PRItkn":\n", dt_token_str(m->name));
     for(int p=0;p<m->num_params;p++)
     {
@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "qvk.h"
 #include "core/log.h"
+#include "core/fs.h"
 
 #include <vulkan/vulkan.h>
 
@@ -27,6 +28,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
 #ifndef NDEBUG
 #ifdef __linux__
 #include <execinfo.h>
@@ -255,6 +257,92 @@ out:;
   return VK_SUCCESS;
 }
 
+// the pipeline cache header as defined by the vulkan spec (VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
+typedef struct qvk_pipeline_cache_header_t
+{
+  uint32_t size;
+  uint32_t version;
+  uint32_t vendor_id;
+  uint32_t device_id;
+  uint8_t  uuid[VK_UUID_SIZE];
+}
+qvk_pipeline_cache_header_t;
+
+static void
+pipeline_cache_filename(char *filename, size_t maxlen)
+{
+  char cachedir[PATH_MAX];
+  fs_cachedir(cachedir, sizeof(cachedir));
+  snprintf(filename, maxlen, "%s/pipeline.cache", cachedir);
+}
+
+// create the pipeline cache, initialised from disk if the data
+// on there matches our driver.
+static VkResult
+pipeline_cache_read()
+{
+  char filename[PATH_MAX+20];
+  pipeline_cache_filename(filename, sizeof(filename));
+  size_t len = 0;
+  uint8_t *data = 0;
+  FILE *f = fopen(filename, "rb");
+  if(f)
+  {
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(len);
+    if(fread(data, 1, len, f) != len) len = 0;
+    fclose(f);
+  }
+  const qvk_pipeline_cache_header_t *hdr = (const qvk_pipeline_cache_header_t *)data;
+  if(len < sizeof(*hdr) ||
+     hdr->version   != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+     hdr->vendor_id != qvk.vendor_id ||
+     hdr->device_id != qvk.device_id ||
+     memcmp(hdr->uuid, qvk.pipeline_cache_uuid, VK_UUID_SIZE))
+  { // different driver or garbage, start from scratch
+    if(f) dt_log(s_log_qvk, "discarding stale pipeline cache %s", filename);
+    len = 0;
+  }
+  VkPipelineCacheCreateInfo info = {
+    .sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+    .initialDataSize = len,
+    .pInitialData    = len ? data : 0,
+  };
+  VkResult res = vkCreatePipelineCache(qvk.device, &info, 0, &qvk.pipeline_cache);
+  free(data);
+  return res;
+}
+
+// write the pipeline cache to disk. we write to a temp file and
+// move it in place so concurrent processes can't read half a cache.
+static void
+pipeline_cache_write()
+{
+  if(qvk.pipeline_cache == VK_NULL_HANDLE) return;
+  size_t len = 0;
+  if(vkGetPipelineCacheData(qvk.device, qvk.pipeline_cache, &len, 0) != VK_SUCCESS || !len) return;
+  void *data = malloc(len);
+  if(vkGetPipelineCacheData(qvk.device, qvk.pipeline_cache, &len, data) == VK_SUCCESS)
+  {
+    char filename[PATH_MAX+20], tmpfile[PATH_MAX+40];
+    fs_cachedir(filename, sizeof(filename));
+    fs_mkdir(filename, 0755); // cli may run without the thumbnail cache ever creating this
+    pipeline_cache_filename(filename, sizeof(filename));
+    snprintf(tmpfile, sizeof(tmpfile), "%s.%d", filename, getpid());
+    FILE *f = fopen(tmpfile, "wb");
+    if(f)
+    {
+      size_t wd = fwrite(data, 1, len, f);
+      fclose(f);
+      if(wd == len) rename(tmpfile, filename);
+      else unlink(tmpfile);
+    }
+  }
+  free(data);
+}
+
 // this function works without gui and consequently does not init glfw
 VkResult
 qvk_init(const char *preferred_device_name, int preferred_device_id)
@@ -339,6 +427,9 @@ qvk_init(const char *preferred_device_name, int preferred_device_id)
     { // vendor ids are: nvidia 0x10de, intel 0x8086
       qvk.ticks_to_nanoseconds = dev_properties.limits.timestampPeriod;
       qvk.uniform_alignment    = dev_properties.limits.minUniformBufferOffsetAlignment;
+      qvk.vendor_id            = dev_properties.vendorID;
+      qvk.device_id            = dev_properties.deviceID;
+      memcpy(qvk.pipeline_cache_uuid, dev_properties.pipelineCacheUUID, VK_UUID_SIZE);
       for(int k=0;k<num_ext;k++)
         if (!strcmp(ext_properties[k].extensionName, VK_KHR_RAY_QUERY_EXTENSION_NAME))
           qvk.raytracing_supported = 1;
@@ -585,6 +676,8 @@ qvk_init(const char *preferred_device_name, int preferred_device_id)
   // initialise a safe fallback for cli mode ("dspy" format is going to look here):
   qvk.surf_format.format = VK_FORMAT_R8G8B8A8_UNORM;
 
+  QVKR(pipeline_cache_read());
+
   return VK_SUCCESS;
 }
 
@@ -609,6 +702,9 @@ qvk_cleanup()
   vkDestroySampler(qvk.device, qvk.tex_sampler_nearest, 0);
   vkDestroySampler(qvk.device, qvk.tex_sampler_yuv, 0);
   vkDestroySamplerYcbcrConversion(qvk.device, qvk.yuv_conversion, 0);
+  pipeline_cache_write();
+  vkDestroyPipelineCache(qvk.device, qvk.pipeline_cache, 0);
+  qvk.pipeline_cache = VK_NULL_HANDLE;
 
   if(qvk.window)  destroy_swapchain();
   if(qvk.surface) vkDestroySurfaceKHR(qvk.instance, qvk.surface, NULL);
@@ -130,6 +130,12 @@ typedef struct qvk_t
 
   int                         raytracing_supported;
   int                         float_atomics_supported;
+
+  // pipeline cache shared by all graphs, persisted in ~/.cache/vkdt/
+  VkPipelineCache             pipeline_cache;
+  uint32_t                    vendor_id;
+  uint32_t                    device_id;
+  uint8_t                     pipeline_cache_uuid[VK_UUID_SIZE];
 }
 qvk_t;
 